@@ -0,0 +1,244 @@
+#include "ftp_engine.h"
+#include "esp_log.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "ftplib.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Menuconfig ----------------------------
+#define ENGINE_SESSIONS CONFIG_FTP_ENGINE_SESSIONS
+#define ENGINE_QUEUE_LENGTH CONFIG_FTP_ENGINE_QUEUE_LENGTH
+#define ENGINE_TASK_STACK CONFIG_FTP_ENGINE_TASK_STACK
+#define ENGINE_TASK_PRIORITY CONFIG_FTP_ENGINE_TASK_PRIORITY
+#if defined CONFIG_FTP_STORAGE_MAX_FILES && !defined CONFIG_FTP_STORAGE_LITTLEFS
+#define ENGINE_MAX_FILES CONFIG_FTP_STORAGE_MAX_FILES
+#endif
+// Menuconfig ----------------------------
+
+#define ENGINE_IDLE BIT0
+
+// Internal job type telling a worker to quit
+#define ENGINE_JOB_STOP ((ftp_job_type_t)-1)
+
+static const char *ENGINE_TAG = "FTP engine";
+
+typedef struct {
+  ftp_engine_t *engine;
+  NetBuf_t *conn;
+  int id;
+} ftp_worker_t;
+
+struct ftp_engine {
+  char *host;
+  uint16_t port;
+  char *user;
+  char *password;
+  int sessions;
+
+  QueueHandle_t jobs;
+  SemaphoreHandle_t lock;
+  SemaphoreHandle_t exited;
+  EventGroupHandle_t events;
+  uint32_t pending;
+  ftp_engine_stats_t stats;
+
+  ftp_worker_t workers[];
+};
+
+static bool worker_connect(ftp_worker_t *worker) {
+  ftp_engine_t *engine = worker->engine;
+
+  if (!FtpConnect(engine->host, engine->port, &worker->conn)) {
+    ESP_LOGE(ENGINE_TAG, "Session %d: connection failed", worker->id);
+    worker->conn = NULL;
+    return false;
+  }
+  if (!FtpLogin(engine->user, engine->password, worker->conn)) {
+    ESP_LOGE(ENGINE_TAG, "Session %d: login failed: %s", worker->id,
+             FtpGetLastResponse(worker->conn));
+    FtpQuit(worker->conn);
+    worker->conn = NULL;
+    return false;
+  }
+  ESP_LOGI(ENGINE_TAG, "Session %d: logged in", worker->id);
+  return true;
+}
+
+// A failed job is retried once on a fresh session, but only when the old
+// session turns out to be dead. A server refusing the job is final.
+static bool worker_run(ftp_worker_t *worker, const ftp_job_t *job) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (worker->conn == NULL) {
+      if (attempt > 0) {
+        xSemaphoreTake(worker->engine->lock, portMAX_DELAY);
+        worker->engine->stats.reconnects++;
+        xSemaphoreGive(worker->engine->lock);
+      }
+      if (!worker_connect(worker))
+        return false;
+    }
+
+    int ok = (job->type == FTP_JOB_GET)
+                 ? FtpGet(job->local, job->remote, job->mode, worker->conn)
+                 : FtpPut(job->local, job->remote, job->mode, worker->conn);
+    if (ok)
+      return true;
+
+    ESP_LOGW(ENGINE_TAG, "Session %d: %s %s failed: %s", worker->id,
+             job->type == FTP_JOB_GET ? "get" : "put", job->remote,
+             FtpGetLastResponse(worker->conn));
+
+    FtpCommand_t noop = {"NOOP", '2', 0};
+    if (FtpPipeline(&noop, 1, worker->conn))
+      return false;
+
+    // Session is gone, drop it without QUIT
+    FtpClose(worker->conn);
+    worker->conn = NULL;
+  }
+  return false;
+}
+
+static void worker_task(void *arg) {
+  ftp_worker_t *worker = arg;
+  ftp_engine_t *engine = worker->engine;
+  ftp_job_t job;
+
+  worker_connect(worker);
+
+  while (xQueueReceive(engine->jobs, &job, portMAX_DELAY) == pdTRUE) {
+    if (job.type == ENGINE_JOB_STOP)
+      break;
+
+    bool ok = worker_run(worker, &job);
+    if (job.cb != NULL)
+      job.cb(&job, ok, job.cb_arg);
+
+    xSemaphoreTake(engine->lock, portMAX_DELAY);
+    if (ok)
+      engine->stats.completed++;
+    else
+      engine->stats.failed++;
+    if (--engine->pending == 0)
+      xEventGroupSetBits(engine->events, ENGINE_IDLE);
+    xSemaphoreGive(engine->lock);
+  }
+
+  if (worker->conn != NULL)
+    FtpQuit(worker->conn);
+  worker->conn = NULL;
+  xSemaphoreGive(engine->exited);
+  vTaskDelete(NULL);
+}
+
+static void engine_free(ftp_engine_t *engine) {
+  if (engine->jobs != NULL)
+    vQueueDelete(engine->jobs);
+  if (engine->lock != NULL)
+    vSemaphoreDelete(engine->lock);
+  if (engine->exited != NULL)
+    vSemaphoreDelete(engine->exited);
+  if (engine->events != NULL)
+    vEventGroupDelete(engine->events);
+  free(engine->host);
+  free(engine->user);
+  free(engine->password);
+  free(engine);
+}
+
+esp_err_t ftp_engine_start(const ftp_engine_config_t *config,
+                           ftp_engine_t **engine) {
+  int sessions = config->sessions > 0 ? config->sessions : ENGINE_SESSIONS;
+#ifdef ENGINE_MAX_FILES
+  // Every busy session holds one local file open, the rest fail to open
+  if (sessions > ENGINE_MAX_FILES)
+    ESP_LOGW(ENGINE_TAG,
+             "%d sessions but only %d open files on the storage, raise "
+             "FTP_STORAGE_MAX_FILES",
+             sessions, ENGINE_MAX_FILES);
+#endif
+
+  ftp_engine_t *e =
+      calloc(1, sizeof(ftp_engine_t) + sessions * sizeof(ftp_worker_t));
+  if (e == NULL)
+    return ESP_ERR_NO_MEM;
+
+  e->port = config->port;
+  e->sessions = sessions;
+  e->host = strdup(config->host);
+  e->user = strdup(config->user);
+  e->password = strdup(config->password);
+  e->jobs = xQueueCreate(ENGINE_QUEUE_LENGTH, sizeof(ftp_job_t));
+  e->lock = xSemaphoreCreateMutex();
+  e->exited = xSemaphoreCreateCounting(sessions, 0);
+  e->events = xEventGroupCreate();
+  if (e->host == NULL || e->user == NULL || e->password == NULL ||
+      e->jobs == NULL || e->lock == NULL || e->exited == NULL ||
+      e->events == NULL) {
+    engine_free(e);
+    return ESP_ERR_NO_MEM;
+  }
+  xEventGroupSetBits(e->events, ENGINE_IDLE);
+
+  // Spread the sessions over both cores
+  for (int i = 0; i < sessions; i++) {
+    char name[configMAX_TASK_NAME_LEN];
+    snprintf(name, sizeof(name), "ftp_worker%d", i);
+    e->workers[i].engine = e;
+    e->workers[i].id = i;
+    if (xTaskCreatePinnedToCore(worker_task, name, ENGINE_TASK_STACK,
+                                &e->workers[i], ENGINE_TASK_PRIORITY, NULL,
+                                i % portNUM_PROCESSORS) != pdPASS) {
+      ESP_LOGE(ENGINE_TAG, "Failed to create worker %d", i);
+      e->sessions = i;
+      ftp_engine_stop(e);
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  *engine = e;
+  return ESP_OK;
+}
+
+esp_err_t ftp_engine_submit(ftp_engine_t *engine, const ftp_job_t *job,
+                            TickType_t timeout) {
+  xSemaphoreTake(engine->lock, portMAX_DELAY);
+  engine->pending++;
+  xEventGroupClearBits(engine->events, ENGINE_IDLE);
+  xSemaphoreGive(engine->lock);
+
+  if (xQueueSend(engine->jobs, job, timeout) != pdTRUE) {
+    xSemaphoreTake(engine->lock, portMAX_DELAY);
+    if (--engine->pending == 0)
+      xEventGroupSetBits(engine->events, ENGINE_IDLE);
+    xSemaphoreGive(engine->lock);
+    return ESP_ERR_TIMEOUT;
+  }
+  return ESP_OK;
+}
+
+esp_err_t ftp_engine_wait(ftp_engine_t *engine, TickType_t timeout) {
+  EventBits_t bits = xEventGroupWaitBits(engine->events, ENGINE_IDLE, pdFALSE,
+                                         pdTRUE, timeout);
+  return (bits & ENGINE_IDLE) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void ftp_engine_get_stats(ftp_engine_t *engine, ftp_engine_stats_t *stats) {
+  xSemaphoreTake(engine->lock, portMAX_DELAY);
+  *stats = engine->stats;
+  xSemaphoreGive(engine->lock);
+}
+
+void ftp_engine_stop(ftp_engine_t *engine) {
+  ftp_job_t stop = {.type = ENGINE_JOB_STOP};
+
+  for (int i = 0; i < engine->sessions; i++)
+    xQueueSend(engine->jobs, &stop, portMAX_DELAY);
+  for (int i = 0; i < engine->sessions; i++)
+    xSemaphoreTake(engine->exited, portMAX_DELAY);
+
+  engine_free(engine);
+}
@@ -0,0 +1,73 @@
+#ifndef FTP_ENGINE_H_
+#define FTP_ENGINE_H_
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FTP_ENGINE_PATH_MAX 128
+
+typedef enum {
+  FTP_JOB_GET, // Download remote into local
+  FTP_JOB_PUT, // Upload local to remote
+} ftp_job_type_t;
+
+typedef struct ftp_job ftp_job_t;
+
+// Called from the worker task once a job has finished
+typedef void (*ftp_job_cb_t)(const ftp_job_t *job, bool ok, void *arg);
+
+struct ftp_job {
+  ftp_job_type_t type;
+  char mode; // FTPLIB_ASCII or FTPLIB_IMAGE
+  char local[FTP_ENGINE_PATH_MAX];
+  char remote[FTP_ENGINE_PATH_MAX];
+  ftp_job_cb_t cb; // Optional
+  void *cb_arg;
+};
+
+typedef struct {
+  const char *host;
+  uint16_t port;
+  const char *user;
+  const char *password;
+  // Parallel control connections, 0 for the Kconfig default. Each one keeps
+  // its local file open during a job, so SPIFFS and FATFS need at least as
+  // many in FTP_STORAGE_MAX_FILES
+  int sessions;
+} ftp_engine_config_t;
+
+typedef struct {
+  uint32_t completed;
+  uint32_t failed;
+  uint32_t reconnects;
+} ftp_engine_stats_t;
+
+typedef struct ftp_engine ftp_engine_t;
+
+// Open the sessions and start one worker task per session
+esp_err_t ftp_engine_start(const ftp_engine_config_t *config,
+                           ftp_engine_t **engine);
+
+// Queue a job, the job is copied. Blocks up to timeout for a free slot
+esp_err_t ftp_engine_submit(ftp_engine_t *engine, const ftp_job_t *job,
+                            TickType_t timeout);
+
+// Wait until every submitted job has finished
+esp_err_t ftp_engine_wait(ftp_engine_t *engine, TickType_t timeout);
+
+void ftp_engine_get_stats(ftp_engine_t *engine, ftp_engine_stats_t *stats);
+
+// Finish the queued jobs, close the sessions and free the engine
+void ftp_engine_stop(ftp_engine_t *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_ENGINE_H_ */
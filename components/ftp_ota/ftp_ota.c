@@ -0,0 +1,241 @@
+#include "ftp_ota.h"
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined ESP_PLATFORM
+#include "esp_app_desc.h"
+#include "esp_app_format.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#endif
+
+// Menuconfig ----------------------------
+#if defined CONFIG_FTP_OTA_CHUNK_SIZE
+#define OTA_CHUNK CONFIG_FTP_OTA_CHUNK_SIZE
+#else
+#define OTA_CHUNK 4096 // Host build, one flash sector
+#endif
+// Menuconfig ----------------------------
+
+#define OTA_HOST_SLOT "ota_slot.bin"
+
+static const char *OTA_TAG = "FTP OTA";
+
+// Where the image goes: an app partition on the device, a plain file on the
+// host so the download path can run against the loopback server
+typedef struct {
+#if defined ESP_PLATFORM
+  const esp_partition_t *part;
+  esp_ota_handle_t handle;
+#else
+  FILE *file;
+#endif
+} ota_slot_t;
+
+#if defined ESP_PLATFORM
+static esp_err_t slot_open(ota_slot_t *slot, const char *label, uint32_t size) {
+  slot->part = label != NULL
+                   ? esp_partition_find_first(ESP_PARTITION_TYPE_APP,
+                                              ESP_PARTITION_SUBTYPE_ANY, label)
+                   : esp_ota_get_next_update_partition(NULL);
+  if (slot->part == NULL) {
+    ESP_LOGE(OTA_TAG, "No OTA slot %s", label != NULL ? label : "to update");
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (size > slot->part->size) {
+    ESP_LOGE(OTA_TAG, "Image of %lu bytes does not fit %s",
+             (unsigned long)size, slot->part->label);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // A known size erases only what the image needs, and does it before the
+  // data connection is open so the server is not kept waiting
+  return esp_ota_begin(slot->part, size > 0 ? size : OTA_SIZE_UNKNOWN,
+                       &slot->handle);
+}
+
+static esp_err_t slot_write(ota_slot_t *slot, const void *buf, size_t len) {
+  return esp_ota_write(slot->handle, buf, len);
+}
+
+// The app description follows the image and first segment headers, well
+// inside the first chunk
+static bool slot_is_running(const char *chunk) {
+  const esp_app_desc_t *desc =
+      (const esp_app_desc_t *)(chunk + sizeof(esp_image_header_t) +
+                               sizeof(esp_image_segment_header_t));
+  return strncmp(desc->version, esp_app_get_description()->version,
+                 sizeof(desc->version)) == 0;
+}
+
+static esp_err_t slot_close(ota_slot_t *slot, bool commit, bool set_boot) {
+  if (!commit) {
+    esp_ota_abort(slot->handle);
+    return ESP_OK;
+  }
+  // Checks the app image header and checksum
+  esp_err_t err = esp_ota_end(slot->handle);
+  if (err == ESP_OK && set_boot)
+    err = esp_ota_set_boot_partition(slot->part);
+  return err;
+}
+#else
+static esp_err_t slot_open(ota_slot_t *slot, const char *label, uint32_t size) {
+  (void)size;
+  slot->file = fopen(label != NULL ? label : OTA_HOST_SLOT, "wb");
+  return slot->file != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+static esp_err_t slot_write(ota_slot_t *slot, const void *buf, size_t len) {
+  return fwrite(buf, 1, len, slot->file) == len ? ESP_OK : ESP_FAIL;
+}
+
+static bool slot_is_running(const char *chunk) {
+  (void)chunk;
+  return false;
+}
+
+static esp_err_t slot_close(ota_slot_t *slot, bool commit, bool set_boot) {
+  (void)set_boot;
+  bool ok = fclose(slot->file) == 0;
+  return commit && !ok ? ESP_FAIL : ESP_OK;
+}
+#endif
+
+static bool parse_digest(const char *hex, uint8_t digest[32]) {
+  if (strlen(hex) != 64)
+    return false;
+  for (int i = 0; i < 32; i++) {
+    unsigned int byte;
+    if (sscanf(&hex[2 * i], "%2x", &byte) != 1)
+      return false;
+    digest[i] = byte;
+  }
+  return true;
+}
+
+// One RETR from written on, flash only sees whole chunks. The last partial
+// chunk is written once the server confirmed the end of the file and, when
+// the size is known, all of it arrived. A broken transfer drops it and the
+// next attempt fetches it again. Returns ESP_ERR_NOT_FINISHED when the
+// transfer can be resumed
+static esp_err_t fetch(NetBuf_t *conn, const ftp_ota_config_t *config,
+                       uint32_t size, ota_slot_t *slot,
+                       mbedtls_sha256_context *sha, char *chunk,
+                       uint32_t *written) {
+  NetBuf_t *data;
+  if (!FtpAccessAt(config->path, FTPLIB_FILE_READ, FTPLIB_IMAGE, *written,
+                   conn, &data)) {
+    ESP_LOGW(OTA_TAG, "RETR at %lu failed: %s", (unsigned long)*written,
+             FtpGetLastResponse(conn));
+    return ESP_ERR_NOT_FINISHED;
+  }
+
+  int len;
+  esp_err_t err = ESP_OK;
+  while ((len = FtpReadFull(chunk, OTA_CHUNK, data)) == OTA_CHUNK) {
+    if (*written == 0 && config->skip_running && slot_is_running(chunk)) {
+      err = ESP_ERR_INVALID_VERSION;
+      break;
+    }
+    if ((err = slot_write(slot, chunk, len)) != ESP_OK)
+      break;
+    mbedtls_sha256_update(sha, (const unsigned char *)chunk, len);
+    *written += len;
+  }
+  if (!FtpClose(data) && err == ESP_OK) {
+    ESP_LOGW(OTA_TAG, "Transfer broke at %lu: %s", (unsigned long)*written,
+             FtpGetLastResponse(conn));
+    return ESP_ERR_NOT_FINISHED;
+  }
+  if (err == ESP_ERR_INVALID_VERSION) {
+    ESP_LOGI(OTA_TAG, "%s is the running version", config->path);
+    return err;
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "Slot write failed: %s", esp_err_to_name(err));
+    return err;
+  }
+  // Some servers confirm a transfer the connection of which broke
+  if (len < 0) {
+    ESP_LOGW(OTA_TAG, "Transfer broke at %lu", (unsigned long)*written);
+    return ESP_ERR_NOT_FINISHED;
+  }
+  if (size > 0 && *written + len != size) {
+    ESP_LOGW(OTA_TAG, "Transfer ended at %lu of %lu",
+             (unsigned long)(*written + len), (unsigned long)size);
+    return ESP_ERR_NOT_FINISHED;
+  }
+  if (len > 0) {
+    if ((err = slot_write(slot, chunk, len)) != ESP_OK)
+      return err;
+    mbedtls_sha256_update(sha, (const unsigned char *)chunk, len);
+    *written += len;
+  }
+  return ESP_OK;
+}
+
+esp_err_t ftp_ota_run(NetBuf_t **conn, const ftp_ota_config_t *config,
+                      ftp_ota_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  uint8_t expected[32];
+  if (config->sha256 != NULL && !parse_digest(config->sha256, expected)) {
+    ESP_LOGE(OTA_TAG, "Expected digest is not 64 hex digits");
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  // Without SIZE the end of the image is whatever the server sends
+  unsigned int size = 0;
+  if (!FtpGetFileSize(config->path, &size, FTPLIB_IMAGE, *conn))
+    size = 0;
+
+  char *chunk = malloc(OTA_CHUNK);
+  if (chunk == NULL)
+    return ESP_ERR_NO_MEM;
+  ota_slot_t slot;
+  esp_err_t err = slot_open(&slot, config->partition, size);
+  if (err != ESP_OK) {
+    free(chunk);
+    return err;
+  }
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  uint32_t written = 0;
+  while ((err = fetch(*conn, config, size, &slot, &sha, chunk, &written)) ==
+         ESP_ERR_NOT_FINISHED) {
+    if ((int)stats->resumes >= config->retries)
+      break;
+    stats->resumes++;
+    if (config->reconnect != NULL &&
+        (*conn = config->reconnect(*conn, config->reconnect_arg)) == NULL)
+      break;
+    ESP_LOGW(OTA_TAG, "Resuming at %lu", (unsigned long)written);
+  }
+  mbedtls_sha256_finish(&sha, stats->sha256);
+  mbedtls_sha256_free(&sha);
+  free(chunk);
+  stats->size = written;
+  if (err == ESP_ERR_NOT_FINISHED)
+    err = ESP_FAIL;
+
+  if (err == ESP_OK && config->sha256 != NULL &&
+      memcmp(expected, stats->sha256, sizeof(expected)) != 0) {
+    ESP_LOGE(OTA_TAG, "SHA-256 mismatch, image rejected");
+    err = ESP_ERR_INVALID_CRC;
+  }
+
+  esp_err_t end = slot_close(&slot, err == ESP_OK, config->set_boot);
+  if (err == ESP_OK && end != ESP_OK) {
+    ESP_LOGE(OTA_TAG, "Image rejected: %s", esp_err_to_name(end));
+    err = end;
+  }
+  if (err == ESP_OK)
+    ESP_LOGI(OTA_TAG, "Wrote %lu bytes, %lu resumes", (unsigned long)written,
+             (unsigned long)stats->resumes);
+  return err;
+}
@@ -0,0 +1,50 @@
+#ifndef FTP_OTA_H_
+#define FTP_OTA_H_
+
+#include "esp_err.h"
+#include "ftplib.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Called with a session that failed mid-transfer, returns a logged in
+// replacement or NULL to give up. The dead session is the callback's to
+// close or release
+typedef NetBuf_t *(*ftp_ota_reconnect_t)(NetBuf_t *dead, void *arg);
+
+typedef struct {
+  const char *path;      // Firmware image on the server
+  const char *sha256;    // Expected digest as 64 hex digits, NULL to skip
+  const char *partition; // App slot label, NULL for the next OTA slot. On the
+                         // host build the slot is a file of that name
+  int retries;           // Resumes after a broken transfer
+  ftp_ota_reconnect_t reconnect; // NULL to resume on the same session
+  void *reconnect_arg;
+  bool set_boot;     // Boot the new image on the next restart
+  bool skip_running; // Stop if the image has the version already running
+} ftp_ota_config_t;
+
+typedef struct {
+  uint32_t size;      // Image bytes written to the slot
+  uint32_t resumes;   // Transfers restarted where they broke
+  uint8_t sha256[32]; // Digest of what was written
+} ftp_ota_stats_t;
+
+// Stream a firmware image from the server into an app slot, without a
+// staging copy on the filesystem. Flash is written in whole chunks and
+// hashed on the way, a broken transfer is resumed with REST from the last
+// chunk written. *conn is replaced when the reconnect callback runs.
+// Returns ESP_ERR_INVALID_CRC when the digest does not match, the slot is
+// then left unbootable, and ESP_ERR_INVALID_VERSION when skip_running
+// found nothing new
+esp_err_t ftp_ota_run(NetBuf_t **conn, const ftp_ota_config_t *config,
+                      ftp_ota_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_OTA_H_ */
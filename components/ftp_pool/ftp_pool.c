@@ -0,0 +1,280 @@
+#include "ftp_pool.h"
+#include "esp_log.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Menuconfig ----------------------------
+#define POOL_MAX_SESSIONS CONFIG_FTP_POOL_MAX_SESSIONS
+#define POOL_KEEPALIVE_S CONFIG_FTP_POOL_KEEPALIVE_INTERVAL
+#define POOL_MAX_IDLE_S CONFIG_FTP_POOL_MAX_IDLE
+#define POOL_VALIDATE_MS CONFIG_FTP_POOL_VALIDATE_AFTER
+#define POOL_TASK_STACK CONFIG_FTP_POOL_TASK_STACK
+// Menuconfig ----------------------------
+
+#define POOL_STOP BIT0
+#define POOL_HOME_MAX 128
+
+static const char *POOL_TAG = "FTP pool";
+
+typedef struct {
+  NetBuf_t *conn;
+  char home[POOL_HOME_MAX]; // Directory after login, restored on release
+  TickType_t last_used;
+  TickType_t last_seen; // Last traffic, use or keep-alive
+  bool in_use;
+} ftp_slot_t;
+
+struct ftp_pool {
+  char *host;
+  uint16_t port;
+  char *user;
+  char *password;
+  int max_sessions;
+
+  SemaphoreHandle_t lock;
+  SemaphoreHandle_t available;
+  SemaphoreHandle_t exited;
+  EventGroupHandle_t events;
+  ftp_pool_stats_t stats;
+
+  ftp_slot_t slots[];
+};
+
+static TickType_t idle_for(const ftp_slot_t *slot) {
+  return xTaskGetTickCount() - slot->last_used;
+}
+
+static TickType_t quiet_for(const ftp_slot_t *slot) {
+  return xTaskGetTickCount() - slot->last_seen;
+}
+
+static void slot_close(ftp_slot_t *slot) {
+  // A dead session would only wait for a reply to QUIT
+  FtpClose(slot->conn);
+  slot->conn = NULL;
+}
+
+static bool slot_alive(ftp_slot_t *slot) {
+  FtpCommand_t noop = {"NOOP", '2', 0};
+  return FtpPipeline(&noop, 1, slot->conn);
+}
+
+static bool slot_connect(ftp_pool_t *pool, ftp_slot_t *slot) {
+  if (!FtpConnect(pool->host, pool->port, &slot->conn)) {
+    ESP_LOGE(POOL_TAG, "Connection failed");
+    slot->conn = NULL;
+    return false;
+  }
+  if (!FtpLogin(pool->user, pool->password, slot->conn)) {
+    ESP_LOGE(POOL_TAG, "Login failed: %s", FtpGetLastResponse(slot->conn));
+    FtpQuit(slot->conn);
+    slot->conn = NULL;
+    return false;
+  }
+  if (!FtpPwd(slot->home, sizeof(slot->home), slot->conn))
+    slot->home[0] = '\0';
+  return true;
+}
+
+// Runs every half keep-alive interval. Idle sessions past the interval get
+// a NOOP, sessions idle past the maximum are closed
+static void keepalive_task(void *arg) {
+  ftp_pool_t *pool = arg;
+  TickType_t interval = pdMS_TO_TICKS(POOL_KEEPALIVE_S * 1000);
+  TickType_t max_idle = pdMS_TO_TICKS(POOL_MAX_IDLE_S * 1000);
+
+  while (!(xEventGroupWaitBits(pool->events, POOL_STOP, pdFALSE, pdTRUE,
+                               interval / 2) &
+           POOL_STOP)) {
+    for (int i = 0; i < pool->max_sessions; i++) {
+      ftp_slot_t *slot = &pool->slots[i];
+
+      // A slot is only claimed with its count taken, like acquire does, so
+      // an acquire never finds the count free and every slot in use. All
+      // sessions busy means nothing is due
+      if (xSemaphoreTake(pool->available, 0) != pdTRUE)
+        break;
+      xSemaphoreTake(pool->lock, portMAX_DELAY);
+      bool due = !slot->in_use && slot->conn != NULL &&
+                 quiet_for(slot) >= interval;
+      if (due)
+        slot->in_use = true;
+      xSemaphoreGive(pool->lock);
+      if (!due) {
+        xSemaphoreGive(pool->available);
+        continue;
+      }
+
+      bool expired = POOL_MAX_IDLE_S > 0 && idle_for(slot) >= max_idle;
+      bool alive = !expired && slot_alive(slot);
+      if (expired) {
+        ESP_LOGI(POOL_TAG, "Closing session idle for %d s", POOL_MAX_IDLE_S);
+        FtpQuit(slot->conn);
+        slot->conn = NULL;
+      } else if (!alive) {
+        ESP_LOGW(POOL_TAG, "Keep-alive failed: %s",
+                 FtpGetLastResponse(slot->conn));
+        slot_close(slot);
+      }
+
+      // The idle time keeps counting from the last use, not the NOOP
+      xSemaphoreTake(pool->lock, portMAX_DELAY);
+      pool->stats.keepalives += alive;
+      pool->stats.dropped += !alive;
+      slot->last_seen = xTaskGetTickCount();
+      slot->in_use = false;
+      xSemaphoreGive(pool->lock);
+      xSemaphoreGive(pool->available);
+    }
+  }
+
+  xSemaphoreGive(pool->exited);
+  vTaskDelete(NULL);
+}
+
+static void pool_free(ftp_pool_t *pool) {
+  if (pool->lock != NULL)
+    vSemaphoreDelete(pool->lock);
+  if (pool->available != NULL)
+    vSemaphoreDelete(pool->available);
+  if (pool->exited != NULL)
+    vSemaphoreDelete(pool->exited);
+  if (pool->events != NULL)
+    vEventGroupDelete(pool->events);
+  free(pool->host);
+  free(pool->user);
+  free(pool->password);
+  free(pool);
+}
+
+esp_err_t ftp_pool_create(const ftp_pool_config_t *config, ftp_pool_t **pool) {
+  int sessions =
+      config->max_sessions > 0 ? config->max_sessions : POOL_MAX_SESSIONS;
+
+  ftp_pool_t *p = calloc(1, sizeof(ftp_pool_t) + sessions * sizeof(ftp_slot_t));
+  if (p == NULL)
+    return ESP_ERR_NO_MEM;
+
+  p->port = config->port;
+  p->max_sessions = sessions;
+  p->host = strdup(config->host);
+  p->user = strdup(config->user);
+  p->password = strdup(config->password);
+  p->lock = xSemaphoreCreateMutex();
+  p->available = xSemaphoreCreateCounting(sessions, sessions);
+  p->exited = xSemaphoreCreateBinary();
+  p->events = xEventGroupCreate();
+  if (p->host == NULL || p->user == NULL || p->password == NULL ||
+      p->lock == NULL || p->available == NULL || p->exited == NULL ||
+      p->events == NULL) {
+    pool_free(p);
+    return ESP_ERR_NO_MEM;
+  }
+
+  if (xTaskCreate(keepalive_task, "ftp_keepalive", POOL_TASK_STACK, p,
+                  tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+    ESP_LOGE(POOL_TAG, "Failed to create the keep-alive task");
+    pool_free(p);
+    return ESP_ERR_NO_MEM;
+  }
+
+  *pool = p;
+  return ESP_OK;
+}
+
+esp_err_t ftp_pool_acquire(ftp_pool_t *pool, NetBuf_t **conn,
+                           TickType_t timeout) {
+  if (xSemaphoreTake(pool->available, timeout) != pdTRUE)
+    return ESP_ERR_TIMEOUT;
+
+  // Prefer the most recently used session, the others can age out
+  xSemaphoreTake(pool->lock, portMAX_DELAY);
+  ftp_slot_t *slot = NULL;
+  for (int i = 0; i < pool->max_sessions; i++) {
+    ftp_slot_t *s = &pool->slots[i];
+    if (s->in_use)
+      continue;
+    if (slot == NULL || (s->conn != NULL &&
+                         (slot->conn == NULL || idle_for(s) < idle_for(slot))))
+      slot = s;
+  }
+  slot->in_use = true;
+  xSemaphoreGive(pool->lock);
+
+  if (slot->conn != NULL &&
+      quiet_for(slot) >= pdMS_TO_TICKS(POOL_VALIDATE_MS) && !slot_alive(slot)) {
+    ESP_LOGW(POOL_TAG, "Dropping dead session: %s",
+             FtpGetLastResponse(slot->conn));
+    slot_close(slot);
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    pool->stats.dropped++;
+    xSemaphoreGive(pool->lock);
+  }
+
+  bool reused = slot->conn != NULL;
+  if (!reused && !slot_connect(pool, slot)) {
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    slot->in_use = false;
+    xSemaphoreGive(pool->lock);
+    xSemaphoreGive(pool->available);
+    return ESP_FAIL;
+  }
+
+  xSemaphoreTake(pool->lock, portMAX_DELAY);
+  if (reused)
+    pool->stats.reused++;
+  else
+    pool->stats.connected++;
+  xSemaphoreGive(pool->lock);
+
+  *conn = slot->conn;
+  return ESP_OK;
+}
+
+void ftp_pool_release(ftp_pool_t *pool, NetBuf_t *conn, bool healthy) {
+  ftp_slot_t *slot = NULL;
+  for (int i = 0; i < pool->max_sessions; i++)
+    if (pool->slots[i].in_use && pool->slots[i].conn == conn)
+      slot = &pool->slots[i];
+  if (slot == NULL) {
+    ESP_LOGE(POOL_TAG, "Released a session the pool does not own");
+    return;
+  }
+
+  // The next user starts where login left it. FtpPwd() answers from its
+  // cache until the directory changes, so CWD is only sent when it did
+  char cwd[sizeof(slot->home)];
+  if (healthy && slot->home[0] != '\0' &&
+      (!FtpPwd(cwd, sizeof(cwd), slot->conn) ||
+       (strcmp(cwd, slot->home) != 0 &&
+        !FtpChangeDir(slot->home, slot->conn))))
+    healthy = false;
+  if (!healthy)
+    slot_close(slot);
+
+  xSemaphoreTake(pool->lock, portMAX_DELAY);
+  slot->last_used = slot->last_seen = xTaskGetTickCount();
+  slot->in_use = false;
+  xSemaphoreGive(pool->lock);
+  xSemaphoreGive(pool->available);
+}
+
+void ftp_pool_get_stats(ftp_pool_t *pool, ftp_pool_stats_t *stats) {
+  xSemaphoreTake(pool->lock, portMAX_DELAY);
+  *stats = pool->stats;
+  xSemaphoreGive(pool->lock);
+}
+
+void ftp_pool_destroy(ftp_pool_t *pool) {
+  xEventGroupSetBits(pool->events, POOL_STOP);
+  xSemaphoreTake(pool->exited, portMAX_DELAY);
+
+  for (int i = 0; i < pool->max_sessions; i++)
+    if (pool->slots[i].conn != NULL)
+      FtpQuit(pool->slots[i].conn);
+
+  pool_free(pool);
+}
@@ -0,0 +1,51 @@
+#ifndef FTP_POOL_H_
+#define FTP_POOL_H_
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "ftplib.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  const char *host;
+  uint16_t port;
+  const char *user;
+  const char *password;
+  int max_sessions; // 0 for the Kconfig default
+} ftp_pool_config_t;
+
+typedef struct {
+  uint32_t reused;     // Acquired a warm session
+  uint32_t connected;  // Had to connect and log in
+  uint32_t keepalives; // NOOPs sent by the idle timer
+  uint32_t dropped;    // Sessions found dead or expired
+} ftp_pool_stats_t;
+
+typedef struct ftp_pool ftp_pool_t;
+
+// Create the pool and start its keep-alive task, no session is opened yet
+esp_err_t ftp_pool_create(const ftp_pool_config_t *config, ftp_pool_t **pool);
+
+// Hand out a logged in session, reusing an idle one when possible. Blocks up
+// to timeout while all sessions are in use
+esp_err_t ftp_pool_acquire(ftp_pool_t *pool, NetBuf_t **conn,
+                           TickType_t timeout);
+
+// Give a session back. Sessions returned as not healthy are closed
+void ftp_pool_release(ftp_pool_t *pool, NetBuf_t *conn, bool healthy);
+
+void ftp_pool_get_stats(ftp_pool_t *pool, ftp_pool_stats_t *stats);
+
+// Close all sessions and free the pool, every session must be released
+void ftp_pool_destroy(ftp_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_POOL_H_ */
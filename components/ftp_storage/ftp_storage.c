@@ -0,0 +1,111 @@
+#include "ftp_storage.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#if defined CONFIG_FTP_STORAGE_SPIFFS
+#include "esp_spiffs.h"
+#elif defined CONFIG_FTP_STORAGE_LITTLEFS
+#include "esp_littlefs.h"
+#elif defined CONFIG_FTP_STORAGE_FATFS
+#include "esp_vfs_fat.h"
+#include "wear_levelling.h"
+#endif
+
+// Menuconfig ----------------------------
+#define STORAGE_BASE_PATH CONFIG_FTP_STORAGE_BASE_PATH
+#define STORAGE_PARTITION CONFIG_FTP_STORAGE_PARTITION
+#define STORAGE_MAX_FILES CONFIG_FTP_STORAGE_MAX_FILES
+#ifdef CONFIG_FTP_STORAGE_FORMAT
+#define STORAGE_FORMAT true
+#else
+#define STORAGE_FORMAT false
+#endif
+// Menuconfig ----------------------------
+
+static const char *STORAGE_TAG = "Storage";
+
+#if defined CONFIG_FTP_STORAGE_FATFS
+static wl_handle_t wl_handle = WL_INVALID_HANDLE;
+#endif
+
+esp_err_t ftp_storage_mount(void) {
+#if defined CONFIG_FTP_STORAGE_SPIFFS
+  esp_vfs_spiffs_conf_t conf = {
+      .base_path = STORAGE_BASE_PATH,
+      .partition_label = STORAGE_PARTITION,
+      .max_files = STORAGE_MAX_FILES,
+      .format_if_mount_failed = STORAGE_FORMAT,
+  };
+  esp_err_t err = esp_vfs_spiffs_register(&conf);
+#elif defined CONFIG_FTP_STORAGE_LITTLEFS
+  // Open files are only bounded by the heap, there is no max_files
+  esp_vfs_littlefs_conf_t conf = {
+      .base_path = STORAGE_BASE_PATH,
+      .partition_label = STORAGE_PARTITION,
+      .format_if_mount_failed = STORAGE_FORMAT,
+  };
+  esp_err_t err = esp_vfs_littlefs_register(&conf);
+#elif defined CONFIG_FTP_STORAGE_FATFS
+  esp_vfs_fat_mount_config_t conf = {
+      .max_files = STORAGE_MAX_FILES,
+      .format_if_mount_failed = STORAGE_FORMAT,
+      .allocation_unit_size = CONFIG_WL_SECTOR_SIZE,
+  };
+  esp_err_t err = esp_vfs_fat_spiflash_mount_rw_wl(
+      STORAGE_BASE_PATH, STORAGE_PARTITION, &conf, &wl_handle);
+#endif
+  if (err != ESP_OK) {
+    ESP_LOGE(STORAGE_TAG, "Failed to mount %s on %s: %s",
+             ftp_storage_backend(), STORAGE_BASE_PATH, esp_err_to_name(err));
+    return err;
+  }
+
+  uint64_t total = 0, used = 0;
+  if (ftp_storage_info(&total, &used) == ESP_OK)
+    ESP_LOGI(STORAGE_TAG, "%s on %s: total %llu, used %llu",
+             ftp_storage_backend(), STORAGE_BASE_PATH,
+             (unsigned long long)total, (unsigned long long)used);
+  return ESP_OK;
+}
+
+void ftp_storage_unmount(void) {
+#if defined CONFIG_FTP_STORAGE_SPIFFS
+  esp_vfs_spiffs_unregister(STORAGE_PARTITION);
+#elif defined CONFIG_FTP_STORAGE_LITTLEFS
+  esp_vfs_littlefs_unregister(STORAGE_PARTITION);
+#elif defined CONFIG_FTP_STORAGE_FATFS
+  esp_vfs_fat_spiflash_unmount_rw_wl(STORAGE_BASE_PATH, wl_handle);
+  wl_handle = WL_INVALID_HANDLE;
+#endif
+}
+
+esp_err_t ftp_storage_info(uint64_t *total, uint64_t *used) {
+#if defined CONFIG_FTP_STORAGE_SPIFFS
+  size_t t = 0, u = 0;
+  esp_err_t err = esp_spiffs_info(STORAGE_PARTITION, &t, &u);
+  *total = t;
+  *used = u;
+  return err;
+#elif defined CONFIG_FTP_STORAGE_LITTLEFS
+  size_t t = 0, u = 0;
+  esp_err_t err = esp_littlefs_info(STORAGE_PARTITION, &t, &u);
+  *total = t;
+  *used = u;
+  return err;
+#elif defined CONFIG_FTP_STORAGE_FATFS
+  uint64_t free_bytes = 0;
+  esp_err_t err = esp_vfs_fat_info(STORAGE_BASE_PATH, total, &free_bytes);
+  *used = *total - free_bytes;
+  return err;
+#endif
+}
+
+const char *ftp_storage_backend(void) {
+#if defined CONFIG_FTP_STORAGE_SPIFFS
+  return "SPIFFS";
+#elif defined CONFIG_FTP_STORAGE_LITTLEFS
+  return "LittleFS";
+#elif defined CONFIG_FTP_STORAGE_FATFS
+  return "FATFS";
+#endif
+}
@@ -0,0 +1,29 @@
+#ifndef FTP_STORAGE_H_
+#define FTP_STORAGE_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Mount the filesystem chosen in Kconfig (SPIFFS, LittleFS or wear levelled
+// FATFS) on the storage partition. Everything above it, ftplib included,
+// goes through the VFS with plain stdio on the base path
+esp_err_t ftp_storage_mount(void);
+void ftp_storage_unmount(void);
+esp_err_t ftp_storage_info(uint64_t *total, uint64_t *used);
+const char *ftp_storage_backend(void);
+
+// Time sequential writes and reads of a file_size file in dir at several
+// chunk sizes, with the filesystem first empty and then filled to 50, 75
+// and 90% of capacity by filler files. Prints a table, removes its files.
+// Plain stdio, so it runs on the host too
+void ftp_storage_bench(const char *dir, long file_size, long capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_STORAGE_H_ */
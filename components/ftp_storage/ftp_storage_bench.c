@@ -0,0 +1,142 @@
+#include "ftp_storage.h"
+#include "esp_log.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PATH_MAX 128
+#define BENCH_FILL_CHUNK (16 * 1024)
+#define BENCH_FILLERS 16 // Filler files making up the whole capacity
+
+static const char *BENCH_TAG = "Storage bench";
+
+static const int bench_chunks[] = {256, 1024, 4096, 16384};
+static const int bench_levels[] = {0, 50, 75, 90}; // % of capacity
+
+#define BENCH_CHUNKS (int)(sizeof(bench_chunks) / sizeof(bench_chunks[0]))
+#define BENCH_LEVELS (int)(sizeof(bench_levels) / sizeof(bench_levels[0]))
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Unbuffered, so every chunk is one write() into the filesystem, and synced
+// before the clock stops. Returns the time taken, negative on error
+static double timed_write(const char *path, char *buf, int chunk, long size) {
+  double t = now();
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return -1;
+  setvbuf(f, NULL, _IONBF, 0);
+  bool ok = true;
+  for (long o = 0; ok && o < size; o += chunk) {
+    int len = size - o < chunk ? (int)(size - o) : chunk;
+    ok = fwrite(buf, 1, len, f) == (size_t)len;
+  }
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if (fclose(f) != 0 || !ok)
+    return -1;
+  return now() - t;
+}
+
+static double timed_read(const char *path, char *buf, int chunk, long size) {
+  double t = now();
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return -1;
+  setvbuf(f, NULL, _IONBF, 0);
+  long total = 0;
+  size_t len;
+  while ((len = fread(buf, 1, chunk, f)) > 0)
+    total += len;
+  fclose(f);
+  return total == size ? now() - t : -1;
+}
+
+// Add filler files of up to piece bytes until fill bytes of them exist,
+// stops early when the filesystem is full. Returns the bytes filled
+static long fill_to(const char *dir, char *buf, long filled, long fill,
+                    long piece, int *fillers) {
+  char path[BENCH_PATH_MAX];
+  while (filled < fill && *fillers < 2 * BENCH_FILLERS) {
+    snprintf(path, sizeof(path), "%s/fsb_fill%d.bin", dir, *fillers);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+      break;
+    (*fillers)++;
+    long want = fill - filled < piece ? fill - filled : piece;
+    long done = 0;
+    while (done < want) {
+      long len = want - done;
+      if (len > BENCH_FILL_CHUNK)
+        len = BENCH_FILL_CHUNK;
+      if (fwrite(buf, 1, len, f) != (size_t)len)
+        break;
+      done += len;
+    }
+    bool full = fclose(f) != 0 || done < want;
+    filled += done;
+    if (full)
+      break;
+  }
+  return filled;
+}
+
+void ftp_storage_bench(const char *dir, long file_size, long capacity) {
+  int max_chunk = bench_chunks[BENCH_CHUNKS - 1];
+  int buf_size = max_chunk > BENCH_FILL_CHUNK ? max_chunk : BENCH_FILL_CHUNK;
+  char *buf = malloc(buf_size);
+  if (buf == NULL) {
+    ESP_LOGE(BENCH_TAG, "Out of memory");
+    return;
+  }
+  // Not all zeros, some filesystems and flash controllers shortcut those
+  for (int i = 0; i < buf_size; i++)
+    buf[i] = (char)(i * 31 + 7);
+
+  char path[BENCH_PATH_MAX];
+  snprintf(path, sizeof(path), "%s/fsb_data.bin", dir);
+
+  printf("\nsequential I/O, %ld byte file in %s, capacity %ld\n", file_size,
+         dir, capacity);
+  printf("  fill  chunk   write KB/s    read KB/s\n");
+  long filled = 0;
+  int fillers = 0;
+  for (int l = 0; l < BENCH_LEVELS; l++) {
+    long want = capacity / 100 * bench_levels[l];
+    if (want + file_size > capacity)
+      want = capacity - file_size;
+    filled = fill_to(dir, buf, filled, want, capacity / BENCH_FILLERS + 1,
+                     &fillers);
+    int level = capacity > 0 ? (int)(100 * filled / capacity) : 0;
+
+    for (int c = 0; c < BENCH_CHUNKS; c++) {
+      double tw = timed_write(path, buf, bench_chunks[c], file_size);
+      double tr =
+          tw < 0 ? -1 : timed_read(path, buf, bench_chunks[c], file_size);
+      if (tw < 0 || tr < 0) {
+        printf("  %3d%%  %5d  failed: %s\n", level, bench_chunks[c],
+               strerror(errno));
+        remove(path);
+        continue;
+      }
+      printf("  %3d%%  %5d  %11.1f  %11.1f\n", level, bench_chunks[c],
+             file_size / tw / 1024, file_size / tr / 1024);
+      fflush(stdout);
+      // Rewriting in place would measure overwrites, not fresh allocation
+      remove(path);
+    }
+  }
+
+  for (int i = 0; i < fillers; i++) {
+    snprintf(path, sizeof(path), "%s/fsb_fill%d.bin", dir, i);
+    remove(path);
+  }
+  free(buf);
+}
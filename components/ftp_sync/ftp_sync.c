@@ -0,0 +1,480 @@
+#include "ftp_sync.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Menuconfig ----------------------------
+#define SYNC_MAX_FILES CONFIG_FTP_SYNC_MAX_FILES
+// Menuconfig ----------------------------
+
+#define SYNC_PATH_MAX 256
+#define SYNC_CRC_CHUNK 1024
+#define SYNC_INDEX_MAGIC 0x31594e53 // "SNY1"
+#define SYNC_MTIME_SLACK 120         // s the server's clock may be behind
+
+static const char *SYNC_TAG = "FTP sync";
+
+// One index record, 16 bytes on flash. Paths are only stored as a hash, a
+// collision would at worst skip a changed file until its size changes
+typedef struct {
+  uint32_t hash;
+  uint32_t size;
+  uint32_t mtime;
+  uint32_t crc;
+} sync_record_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t count;
+} sync_header_t;
+
+typedef struct {
+  char *path; // Relative to local_dir
+  uint32_t size;
+  uint32_t mtime;
+} sync_file_t;
+
+typedef struct {
+  uint32_t hash; // Of the entry name
+  int64_t size;
+  time_t mtime; // 0 if unknown
+} sync_remote_t;
+
+typedef struct {
+  const ftp_sync_config_t *config;
+  NetBuf_t *conn;
+  ftp_sync_stats_t *stats;
+
+  sync_record_t *old; // Loaded index, sorted by hash
+  uint32_t old_count;
+
+  sync_file_t *files; // Local scan, sorted by path
+  uint32_t file_count;
+  uint32_t file_cap;
+
+  char dir[SYNC_PATH_MAX]; // Remote directory the listing below belongs to
+  bool listed;             // False when the listing failed, use SIZE instead
+  sync_remote_t *remote;
+  uint32_t remote_count;
+  uint32_t remote_cap;
+} sync_ctx_t;
+
+// FNV-1a, cheap and good enough to tell a few hundred paths apart
+static uint32_t path_hash(const char *path) {
+  uint32_t hash = 2166136261u;
+  while (*path != '\0') {
+    hash ^= (uint8_t)*path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int record_cmp(const void *a, const void *b) {
+  uint32_t x = ((const sync_record_t *)a)->hash;
+  uint32_t y = ((const sync_record_t *)b)->hash;
+  return (x > y) - (x < y);
+}
+
+static int remote_cmp(const void *a, const void *b) {
+  uint32_t x = ((const sync_remote_t *)a)->hash;
+  uint32_t y = ((const sync_remote_t *)b)->hash;
+  return (x > y) - (x < y);
+}
+
+static int file_cmp(const void *a, const void *b) {
+  return strcmp(((const sync_file_t *)a)->path, ((const sync_file_t *)b)->path);
+}
+
+static bool file_crc(const char *path, uint32_t *crc) {
+  FILE *fd = fopen(path, "rb");
+  if (fd == NULL)
+    return false;
+
+  uint8_t *buf = malloc(SYNC_CRC_CHUNK);
+  if (buf == NULL) {
+    fclose(fd);
+    return false;
+  }
+
+  uint32_t c = 0;
+  size_t n;
+  while ((n = fread(buf, 1, SYNC_CRC_CHUNK, fd)) > 0)
+    c = esp_rom_crc32_le(c, buf, n);
+  bool ok = !ferror(fd);
+
+  free(buf);
+  fclose(fd);
+  *crc = c;
+  return ok;
+}
+
+// A missing or damaged index only means everything is uploaded once more
+static void index_load(sync_ctx_t *ctx) {
+  FILE *fd = fopen(ctx->config->index, "rb");
+  if (fd == NULL)
+    return;
+
+  sync_header_t header;
+  if (fread(&header, sizeof(header), 1, fd) != 1 ||
+      header.magic != SYNC_INDEX_MAGIC || header.count > SYNC_MAX_FILES) {
+    ESP_LOGW(SYNC_TAG, "Ignoring invalid index %s", ctx->config->index);
+    fclose(fd);
+    return;
+  }
+
+  // An empty tree was synced, there is nothing to compare against
+  if (header.count == 0) {
+    fclose(fd);
+    return;
+  }
+
+  ctx->old = malloc(header.count * sizeof(sync_record_t));
+  if (ctx->old != NULL &&
+      fread(ctx->old, sizeof(sync_record_t), header.count, fd) ==
+          header.count) {
+    ctx->old_count = header.count;
+    qsort(ctx->old, ctx->old_count, sizeof(sync_record_t), record_cmp);
+  } else {
+    ESP_LOGW(SYNC_TAG, "Ignoring truncated index %s", ctx->config->index);
+  }
+  fclose(fd);
+}
+
+// Written next to the old one and renamed over it, a reset while saving
+// leaves the previous index in place
+static esp_err_t index_save(const char *index, const sync_record_t *records,
+                            uint32_t count) {
+  char tmp[SYNC_PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", index);
+
+  FILE *fd = fopen(tmp, "wb");
+  if (fd == NULL) {
+    ESP_LOGE(SYNC_TAG, "Failed to create %s", tmp);
+    return ESP_FAIL;
+  }
+
+  sync_header_t header = {SYNC_INDEX_MAGIC, count};
+  bool ok = fwrite(&header, sizeof(header), 1, fd) == 1 &&
+            (count == 0 ||
+             fwrite(records, sizeof(sync_record_t), count, fd) == count);
+  ok = fclose(fd) == 0 && ok;
+
+  // SPIFFS cannot rename over an existing file
+  if (ok) {
+    remove(index);
+    ok = rename(tmp, index) == 0;
+  }
+  if (!ok) {
+    ESP_LOGE(SYNC_TAG, "Failed to write %s", index);
+    remove(tmp);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static bool is_index(const sync_ctx_t *ctx, const char *path) {
+  size_t len = strlen(ctx->config->index);
+  return strncmp(path, ctx->config->index, len) == 0 &&
+         (path[len] == '\0' || strcmp(path + len, ".tmp") == 0);
+}
+
+// SPIFFS has no directories, its readdir returns names containing slashes,
+// real subdirectories are only found on other filesystems
+static esp_err_t scan_dir(sync_ctx_t *ctx, const char *rel) {
+  char path[SYNC_PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s%s", ctx->config->local_dir,
+           rel[0] != '\0' ? "/" : "", rel);
+
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    ESP_LOGE(SYNC_TAG, "Failed to open %s", path);
+    return ESP_FAIL;
+  }
+
+  esp_err_t err = ESP_OK;
+  struct dirent *entry;
+  while (err == ESP_OK && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    char child[SYNC_PATH_MAX];
+    char full[SYNC_PATH_MAX];
+    snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] != '\0' ? "/" : "",
+             entry->d_name);
+    if (snprintf(full, sizeof(full), "%s/%s", ctx->config->local_dir, child) >=
+        (int)sizeof(full)) {
+      ESP_LOGW(SYNC_TAG, "Skipping %s, path too long", child);
+      continue;
+    }
+
+    struct stat st;
+    if (stat(full, &st) != 0 || is_index(ctx, full))
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      err = scan_dir(ctx, child);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode))
+      continue;
+
+    if (ctx->file_count == SYNC_MAX_FILES) {
+      ESP_LOGE(SYNC_TAG, "More than %d files to sync", SYNC_MAX_FILES);
+      err = ESP_ERR_INVALID_SIZE;
+      break;
+    }
+    if (ctx->file_count == ctx->file_cap) {
+      uint32_t cap = ctx->file_cap > 0 ? ctx->file_cap * 2 : 32;
+      sync_file_t *files = realloc(ctx->files, cap * sizeof(sync_file_t));
+      if (files == NULL) {
+        err = ESP_ERR_NO_MEM;
+        break;
+      }
+      ctx->files = files;
+      ctx->file_cap = cap;
+    }
+
+    sync_file_t *file = &ctx->files[ctx->file_count];
+    file->path = strdup(child);
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    if (file->path == NULL) {
+      err = ESP_ERR_NO_MEM;
+      break;
+    }
+    ctx->file_count++;
+  }
+
+  closedir(dir);
+  return err;
+}
+
+static void remote_path(const sync_ctx_t *ctx, const char *rel, char *buf,
+                        size_t len) {
+  const char *root = ctx->config->remote_dir;
+  if (root == NULL || root[0] == '\0')
+    snprintf(buf, len, "%s", rel);
+  else
+    snprintf(buf, len, "%s%s%s", root, rel[0] != '\0' ? "/" : "", rel);
+}
+
+static int collect_remote(const FtpEntry_t *entry, void *arg) {
+  sync_ctx_t *ctx = arg;
+
+  if (entry->type != FTPLIB_ENTRY_FILE)
+    return 1;
+  if (ctx->remote_count == ctx->remote_cap) {
+    uint32_t cap = ctx->remote_cap > 0 ? ctx->remote_cap * 2 : 32;
+    sync_remote_t *remote = realloc(ctx->remote, cap * sizeof(sync_remote_t));
+    if (remote == NULL)
+      return 0;
+    ctx->remote = remote;
+    ctx->remote_cap = cap;
+  }
+  ctx->remote[ctx->remote_count++] =
+      (sync_remote_t){path_hash(entry->name), entry->size, entry->mtime};
+  return 1;
+}
+
+// List each remote directory once, the files come sorted by path so all the
+// files of a directory are checked against the same listing
+static void list_remote(sync_ctx_t *ctx, const char *dir) {
+  if (ctx->dir[0] != '\0' && strcmp(ctx->dir + 1, dir) == 0)
+    return;
+
+  // The leading '/' tells the empty relative directory from no listing yet
+  snprintf(ctx->dir, sizeof(ctx->dir), "/%s", dir);
+  ctx->remote_count = 0;
+
+  char path[SYNC_PATH_MAX];
+  remote_path(ctx, dir, path, sizeof(path));
+  ctx->listed = FtpListEntries(path[0] != '\0' ? path : ".", collect_remote,
+                               ctx, ctx->conn) != 0;
+
+  // LIST refused too, the directory is not there yet
+  if (!ctx->listed && FtpGetLastResponse(ctx->conn)[0] == '5') {
+    ctx->listed = true;
+    ctx->remote_count = 0;
+  }
+  if (ctx->listed)
+    qsort(ctx->remote, ctx->remote_count, sizeof(sync_remote_t), remote_cmp);
+}
+
+// The server stamps an upload with its own time, a copy older than the local
+// file is one the server had before it changed. Unknown times, or a device
+// clock that was never set, leave it to the size
+static bool remote_fresh(time_t remote, uint32_t local) {
+  return remote <= 0 || remote + SYNC_MTIME_SLACK >= (time_t)local;
+}
+
+static bool remote_matches(sync_ctx_t *ctx, const sync_file_t *file) {
+  const char *slash = strrchr(file->path, '/');
+  const char *name = slash != NULL ? slash + 1 : file->path;
+  char dir[SYNC_PATH_MAX];
+  snprintf(dir, sizeof(dir), "%.*s", (int)(name - file->path - (slash != NULL)),
+           file->path);
+
+  list_remote(ctx, dir);
+  if (ctx->listed) {
+    sync_remote_t key = {path_hash(name), 0, 0};
+    sync_remote_t *found = bsearch(&key, ctx->remote, ctx->remote_count,
+                                   sizeof(sync_remote_t), remote_cmp);
+    return found != NULL &&
+           (found->size < 0 || found->size == file->size) &&
+           remote_fresh(found->mtime, file->mtime);
+  }
+
+  // Listing refused, ask for this one file. Servers without MDTM are left to
+  // the size
+  char path[SYNC_PATH_MAX];
+  unsigned int size = 0;
+  time_t mtime = 0;
+  remote_path(ctx, file->path, path, sizeof(path));
+  if (!FtpGetFileSize(path, &size, FTPLIB_IMAGE, ctx->conn) ||
+      size != file->size)
+    return false;
+  return !FtpGetModTime(path, &mtime, ctx->conn) ||
+         remote_fresh(mtime, file->mtime);
+}
+
+// Create every directory on the way to path, the ones that exist fail
+static void make_remote_dirs(sync_ctx_t *ctx, const char *path) {
+  char dir[SYNC_PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+
+  for (char *slash = strchr(dir + 1, '/'); slash != NULL;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    FtpMakeDir(dir, ctx->conn);
+    *slash = '/';
+  }
+}
+
+static bool upload(sync_ctx_t *ctx, const sync_file_t *file) {
+  char local[SYNC_PATH_MAX];
+  char remote[SYNC_PATH_MAX];
+  snprintf(local, sizeof(local), "%s/%s", ctx->config->local_dir, file->path);
+  remote_path(ctx, file->path, remote, sizeof(remote));
+
+  // Directories are only created when the upload says they are missing
+  bool ok = FtpPut(local, remote, FTPLIB_IMAGE, ctx->conn);
+  if (!ok && strchr(remote + 1, '/') != NULL) {
+    make_remote_dirs(ctx, remote);
+    ok = FtpPut(local, remote, FTPLIB_IMAGE, ctx->conn);
+  }
+
+  if (!ok) {
+    ESP_LOGE(SYNC_TAG, "Failed to upload %s: %s", file->path,
+             FtpGetLastResponse(ctx->conn));
+    return false;
+  }
+  ESP_LOGI(SYNC_TAG, "Uploaded %s (%" PRIu32 " bytes)", file->path,
+           file->size);
+  return true;
+}
+
+// Decide what to do with one local file and fill in its new index record.
+// Returns false when the file is left out of the index
+static bool sync_file(sync_ctx_t *ctx, const sync_file_t *file,
+                      sync_record_t *record, bool *dirty) {
+  char local[SYNC_PATH_MAX];
+  snprintf(local, sizeof(local), "%s/%s", ctx->config->local_dir, file->path);
+
+  sync_record_t key = {path_hash(file->path), 0, 0, 0};
+  sync_record_t *old = bsearch(&key, ctx->old, ctx->old_count,
+                               sizeof(sync_record_t), record_cmp);
+  *record = key;
+  record->size = file->size;
+  record->mtime = file->mtime;
+
+  // Same size and mtime is trusted, unless the filesystem keeps no mtime
+  bool same = old != NULL && old->size == file->size &&
+              old->mtime == file->mtime && file->mtime != 0;
+  if (same) {
+    record->crc = old->crc;
+  } else {
+    if (!file_crc(local, &record->crc)) {
+      ESP_LOGE(SYNC_TAG, "Failed to read %s", local);
+      return false;
+    }
+    // Touched but not modified, only the index needs the new mtime
+    same = old != NULL && old->size == file->size && old->crc == record->crc;
+    *dirty |= old == NULL || old->mtime != record->mtime || !same;
+  }
+
+  if (same && (!ctx->config->verify_remote || remote_matches(ctx, file))) {
+    ctx->stats->unchanged++;
+    return true;
+  }
+
+  if (!upload(ctx, file)) {
+    ctx->stats->failed++;
+    *dirty = true;
+    return false;
+  }
+  if (same)
+    ctx->stats->repaired++;
+  else
+    ctx->stats->uploaded++;
+  ctx->stats->bytes += file->size;
+  return true;
+}
+
+static void ctx_free(sync_ctx_t *ctx) {
+  for (uint32_t i = 0; i < ctx->file_count; i++)
+    free(ctx->files[i].path);
+  free(ctx->files);
+  free(ctx->old);
+  free(ctx->remote);
+}
+
+esp_err_t ftp_sync_run(NetBuf_t *conn, const ftp_sync_config_t *config,
+                       ftp_sync_stats_t *stats) {
+  sync_ctx_t ctx = {.config = config, .conn = conn, .stats = stats};
+  memset(stats, 0, sizeof(*stats));
+
+  index_load(&ctx);
+  esp_err_t err = scan_dir(&ctx, "");
+  if (err != ESP_OK) {
+    ctx_free(&ctx);
+    return err;
+  }
+  qsort(ctx.files, ctx.file_count, sizeof(sync_file_t), file_cmp);
+  stats->scanned = ctx.file_count;
+
+  // An empty tree still writes an empty index, with no records to allocate
+  sync_record_t *records = NULL;
+  if (ctx.file_count > 0 &&
+      (records = malloc(ctx.file_count * sizeof(sync_record_t))) == NULL) {
+    ctx_free(&ctx);
+    return ESP_ERR_NO_MEM;
+  }
+
+  uint32_t count = 0;
+  bool dirty = false;
+  for (uint32_t i = 0; i < ctx.file_count; i++)
+    if (sync_file(&ctx, &ctx.files[i], &records[count], &dirty))
+      count++;
+
+  // Files deleted locally drop out of the index, the server keeps them
+  dirty |= count != ctx.old_count;
+  if (dirty)
+    err = index_save(config->index, records, count);
+
+  ESP_LOGI(SYNC_TAG,
+           "%" PRIu32 " files: %" PRIu32 " unchanged, %" PRIu32
+           " uploaded, %" PRIu32 " repaired, %" PRIu32 " failed",
+           stats->scanned, stats->unchanged, stats->uploaded, stats->repaired,
+           stats->failed);
+
+  free(records);
+  ctx_free(&ctx);
+  if (err == ESP_OK && stats->failed > 0)
+    err = ESP_FAIL;
+  return err;
+}
@@ -0,0 +1,42 @@
+#ifndef FTP_SYNC_H_
+#define FTP_SYNC_H_
+
+#include "esp_err.h"
+#include "ftplib.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  const char *local_dir;  // Tree to upload, e.g. "/storage"
+  const char *remote_dir; // Where it goes on the server, NULL or "" for cwd
+  const char *index;      // Index of the last sync, a file on flash
+  bool verify_remote;     // Check unchanged files still exist on the server
+} ftp_sync_config_t;
+
+typedef struct {
+  uint32_t scanned;   // Local files looked at
+  uint32_t unchanged; // Skipped, the server already has them
+  uint32_t uploaded;  // New or changed since the last sync
+  uint32_t repaired;  // Unchanged locally but missing or different remotely
+  uint32_t failed;    // Uploads that failed, retried on the next sync
+  uint64_t bytes;     // Bytes uploaded
+} ftp_sync_stats_t;
+
+// Upload the files of local_dir that changed since the last sync. Files are
+// matched by size and mtime against the index, a CRC is computed only when
+// those differ, so an unchanged tree costs no transfer at all. With
+// verify_remote every remote directory is listed once and files the server
+// lost are uploaded again. Returns ESP_FAIL when some upload failed, the
+// index is saved either way
+esp_err_t ftp_sync_run(NetBuf_t *conn, const ftp_sync_config_t *config,
+                       ftp_sync_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_SYNC_H_ */
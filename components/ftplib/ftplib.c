@@ -25,20 +25,95 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/unistd.h>
+#include <arpa/inet.h>
 #include "ftplib.h"
+#include "ftplib_priv.h"
 
 #include "netdb.h"
 
 #include "esp_log.h"
 
+#if defined ESP_PLATFORM
+#include "sdkconfig.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#else
+#include <sys/mman.h>
+#endif
+
+/* compressed transfers need zlib, the host build finds it by itself */
+#if defined CONFIG_FTPLIB_COMPRESSION
+#define FTPLIB_ZLIB 1
+#endif
+#if FTPLIB_ZLIB
+#include "zlib.h"
+#endif
+
+#if !defined ESP_PLATFORM
+/* host build: plain POSIX sockets are closed like any other descriptor */
+#define closesocket(s)					close(s)
+#endif
+
 #if !defined FTPLIB_DEFAULT_MODE
 #define FTPLIB_DEFAULT_MODE			FTPLIB_PASSIVE
 #endif
 
+#if defined CONFIG_FTPLIB_CONNECT_TIMEOUT
+#define FTPLIB_DEFAULT_CONNECT_TIMEOUT	CONFIG_FTPLIB_CONNECT_TIMEOUT
+#define FTPLIB_DEFAULT_CONNECT_STAGGER	CONFIG_FTPLIB_CONNECT_STAGGER
+#define FTPLIB_DEFAULT_DNS_TTL			CONFIG_FTPLIB_DNS_CACHE_TTL
+#define FTPLIB_DEFAULT_DNS_ENTRIES		CONFIG_FTPLIB_DNS_CACHE_SIZE
+#else
+#define FTPLIB_DEFAULT_CONNECT_TIMEOUT	FTPLIB_CONNECT_TIMEOUT
+#define FTPLIB_DEFAULT_CONNECT_STAGGER	FTPLIB_CONNECT_STAGGER
+#define FTPLIB_DEFAULT_DNS_TTL			FTPLIB_DNS_CACHE_TTL
+#define FTPLIB_DEFAULT_DNS_ENTRIES		FTPLIB_DNS_CACHE_SIZE
+#endif
+#if defined CONFIG_FTPLIB_PIPELINE_DEPTH
+#define FTPLIB_DEFAULT_PIPELINE			CONFIG_FTPLIB_PIPELINE_DEPTH
+#else
+#define FTPLIB_DEFAULT_PIPELINE			FTPLIB_PIPELINE_DEPTH
+#endif
+#if defined CONFIG_FTPLIB_COMPRESSION
+#define FTPLIB_DEFAULT_COMPRESS_WINDOW	CONFIG_FTPLIB_COMPRESSION_WINDOW
+#define FTPLIB_DEFAULT_MODEZ			CONFIG_FTPLIB_MODEZ_LEVEL
+#else
+#define FTPLIB_DEFAULT_COMPRESS_WINDOW	FTPLIB_COMPRESS_WINDOW
+#define FTPLIB_DEFAULT_MODEZ			0
+#endif
+#if defined CONFIG_FTPLIB_METRICS_LOG
+#define FTPLIB_DEFAULT_METRICS_LOG		1
+#else
+#define FTPLIB_DEFAULT_METRICS_LOG		0
+#endif
+/* servers pick their own MODE Z window, inflate must take the largest */
+#define FTPLIB_MODEZ_WINDOW				15
+#define FTPLIB_HOST_SIZE				64
+
+/* where the buffer pool lives, NetBufs always stay in internal RAM */
+#if defined CONFIG_FTPLIB_POOL_SPIRAM
+#define poolMalloc(n)	heap_caps_malloc(n, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#elif defined CONFIG_FTPLIB_POOL_DMA
+#define poolMalloc(n)	heap_caps_malloc(n, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL)
+#else
+#define poolMalloc(n)	malloc(n)
+#endif
+#define FTPLIB_POOL_MAX					32
+/* FtpWrite() size from memory, callbacks still see the transfer move */
+#define FTPLIB_SEND_STEP				(64 * 1024)
+
 #define FTPLIB_CONTROL					0
 #define FTPLIB_READ						1
 #define FTPLIB_WRITE					2
@@ -49,6 +124,7 @@ struct NetBuf {
 	int handle;
 	int cavail, cleft;
 	char* buf;
+	int bufsize;
 	int dir;
 	NetBuf_t* ctrl;
 	NetBuf_t* data;
@@ -59,19 +135,242 @@ struct NetBuf {
 	unsigned long int xfered;
 	unsigned long int cbbytes;
 	unsigned long int xfered1;
-	char response[FTPLIB_RESPONSE_BUFFER_SIZE];
+	/* session state cache, control connection only */
+	char type;
+	char* cwd;
+	char syst[FTPLIB_SYST_SIZE];
+	int feat;
+	int ext;	/* EPSV/EPRT: -1 not tried yet, 0 refused, 1 accepted */
+	/* sizes for the data connections, control connection only */
+	int xfersize;
+	int pipeline;	/* buffers between network and file in xfer(), 0 serial */
+	int rcvbuf;
+	int sndbuf;
+	int respsize;
+	char* response;
+	/* gzip stage and MODE Z, see FtpSetOptions() */
+	int zlevel;		/* control connection: gzip level, 0 off */
+	int zmodez;		/* control connection: MODE Z level, 0 off */
+	int zwindow;	/* control connection: window bits */
+	char xmode;		/* control connection: 'S', 'Z', 0 not known */
+	/* see FtpGetMetrics(); the data connection fills in its transfer and
+	 * hands it to the control connection when it closes */
+	FtpMetrics_t metrics;
+	int mlog;			/* control connection: log every transfer */
+	long long mstart;	/* data connection: us at FtpAccess() */
+	long long mcmd;		/* data connection: us the command went out */
+	long long mwindow;	/* data connection: us the peak sample began */
+	uint64_t mwinbytes;	/* data connection: bytes before the sample */
+#if FTPLIB_ZLIB
+	z_stream* zs;	/* data connection: NULL if not compressed */
+	char* zbuf;		/* data connection: compressed side, bufsize bytes */
+	int zdone;		/* data connection: a whole stream was inflated */
+#endif
+};
+
+/* fixed blocks handed out by a bitmap, see FtpPoolInit() */
+struct BlockPool {
+	char* base;
+	int size;
+	int count;
+	atomic_uint used;
+};
+
+static struct BlockPool netbufPool;
+static struct BlockPool bufferPool;
+static atomic_int poolState;	/* 0 no pool, 1 being set up, 2 ready */
+
+/* resolved host names, see ftplibResolveHost() */
+struct HostEntry {
+	char host[FTPLIB_HOST_SIZE];
+	int count;
+	SockAddr_t addr[FTPLIB_HOST_ADDRS];
+	long long expires;	/* ms, monotonic */
+	long long used;
+};
+
+static struct HostEntry hostCache[FTPLIB_DEFAULT_DNS_ENTRIES];
+static pthread_mutex_t hostLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ring of buffers between xfer() and its file task, see pipeXfer() */
+struct Pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char* slot[FTPLIB_PIPELINE_MAX];
+	int len[FTPLIB_PIPELINE_MAX];
+	int count;
+	int size;
+	int head;		/* next slot to fill */
+	int tail;		/* next slot to drain */
+	int filled;
+	int eof;		/* the producer has no more data */
+	int failed;		/* either side gave up */
+	int download;
+	FILE* local;
+	long long fileTime;	/* us, file task only */
 };
 
 /*Internal use functions*/
+static void* poolTake(struct BlockPool* pool);
+static int poolGive(struct BlockPool* pool, void* block);
+static NetBuf_t* netbufAlloc(void);
+static void netbufFree(NetBuf_t* nBuf);
+static long long nowMs(void);
+static long long nowUs(void);
+static int lookupHost(const char* host, SockAddr_t* addrs, int max);
+static int connectAny(SockAddr_t* addrs, int count, uint16_t port,
+	int* tried);
 static int socketWait(NetBuf_t* ctl);
 static int readResponse(char c, NetBuf_t* nControl);
+static int readReply(char c, void (*line)(const char* l, NetBuf_t* nControl),
+	NetBuf_t* nControl);
 static int readLine(char* buffer, int max, NetBuf_t* ctl);
 static int sendCommand(const char* cmd, char expresp, NetBuf_t* nControl);
+static int sendCommands(FtpCommand_t* cmds, int n, NetBuf_t* nControl);
 static int xfer(const char* localfile, const char* path,
-	NetBuf_t* nControl, int typ, int mode);
-static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir);
+	NetBuf_t* nControl, int typ, int mode, unsigned int offset, int keep);
+static int pipeFill(struct Pipe* p);
+static void pipePush(struct Pipe* p, int len);
+static int pipeTake(struct Pipe* p);
+static void pipeDone(struct Pipe* p);
+static void pipeStop(struct Pipe* p, int ok);
+static void* pipeFileTask(void* arg);
+static int pipeXfer(FILE* local, int download, NetBuf_t* nData);
+static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir,
+	const char* lead);
+static int sendExtended(const char* cmd, const char** lead, int required,
+	NetBuf_t* nControl);
+static int askPassive(struct sockaddr* sa, socklen_t* l, const char* lead,
+	NetBuf_t* nControl);
+static int askActive(const struct sockaddr* sa, const char* lead,
+	NetBuf_t* nControl);
 static int writeLine(const char* buf, int len, NetBuf_t* nData);
 static int acceptConnection(NetBuf_t* nData, NetBuf_t* nControl);
+static int readBlock(char** block, char* landing, NetBuf_t* nData);
+static int convertText(char* dst, int max, int eof, NetBuf_t* nData);
+static int readText(char* buf, int max, NetBuf_t* nData);
+static int recvFull(char* buf, int max, NetBuf_t* nData);
+static int sendAll(const char* buf, int len, NetBuf_t* nData);
+static int recvData(char* buf, int max, NetBuf_t* nData);
+static int sendData(const char* buf, int len, NetBuf_t* nData);
+static int countXfer(int len, NetBuf_t* nData);
+static void meterStart(const char* cmd, NetBuf_t* nControl);
+static void meterBytes(int len, NetBuf_t* nData);
+static void meterEnd(FtpMetrics_t* m, long long start, int ok,
+	NetBuf_t* nControl);
+static int sendMemory(const char* buf, unsigned int len, NetBuf_t* nData);
+static void forgetState(const char* cmd, NetBuf_t* nControl);
+static void parseFeature(const char* l, NetBuf_t* nControl);
+static time_t makeTime(int year, int mon, int day, int hour, int min,
+	int sec);
+static int parseMlsd(char* line, FtpEntry_t* entry);
+static int parseList(char* line, FtpEntry_t* entry);
+#if FTPLIB_ZLIB
+static int zlibStart(int window, int level, NetBuf_t* nData);
+static int zlibSend(NetBuf_t* nData);
+static int zlibWrite(const char* buf, int len, NetBuf_t* nData);
+static int zlibRead(char* buf, int max, int full, NetBuf_t* nData);
+static int zlibEnd(NetBuf_t* nData);
+static int setMode(char mode, NetBuf_t* nControl);
+#endif
+
+/*
+ * poolTake - claim a free block of a pool
+ *
+ * return the block, NULL if the pool is not set up or all blocks are taken
+ */
+static void* poolTake(struct BlockPool* pool)
+{
+	if (atomic_load(&poolState) != 2)
+		return NULL;
+	unsigned int all = (pool->count == FTPLIB_POOL_MAX) ?
+		~0u : (1u << pool->count) - 1;
+	unsigned int used = atomic_load(&pool->used);
+	while ((used & all) != all) {
+		int i = __builtin_ctz(~used & all);
+		if (atomic_compare_exchange_weak(&pool->used, &used, used | (1u << i)))
+			return pool->base + i * pool->size;
+	}
+	return NULL;
+}
+
+
+
+/*
+ * poolGive - return a block to the pool it came from
+ *
+ * return 1 if the block belongs to the pool, 0 otherwise
+ */
+static int poolGive(struct BlockPool* pool, void* block)
+{
+	char* b = block;
+	if ((pool->base == NULL) || (b < pool->base)
+			|| (b >= pool->base + pool->count * pool->size))
+		return 0;
+	atomic_fetch_and(&pool->used, ~(1u << ((b - pool->base) / pool->size)));
+	return 1;
+}
+
+
+
+/*
+ * netbufAlloc - get a zeroed NetBuf, from the pool while it has some left
+ */
+static NetBuf_t* netbufAlloc(void)
+{
+	NetBuf_t* nBuf = poolTake(&netbufPool);
+	if (nBuf == NULL)
+		return calloc(1, sizeof(NetBuf_t));
+	memset(nBuf, 0, sizeof(NetBuf_t));
+	return nBuf;
+}
+
+
+
+static void netbufFree(NetBuf_t* nBuf)
+{
+	if (!poolGive(&netbufPool, nBuf))
+		free(nBuf);
+}
+
+
+
+/*
+ * ftplibPoolSetup - set up the pool of menuconfig on the first connect
+ */
+void ftplibPoolSetup(void)
+{
+#if defined CONFIG_FTPLIB_POOL
+	if (atomic_load(&poolState) == 0)
+		FtpPoolInit(CONFIG_FTPLIB_POOL_NETBUFS, CONFIG_FTPLIB_POOL_BUFFERS,
+			FTPLIB_DEFAULT_BUFFER_SIZE);
+#endif
+}
+
+
+
+/*
+ * ftplibBufAlloc - get a data buffer, from the pool when it fits a block
+ */
+char* ftplibBufAlloc(int size)
+{
+	char* buf = NULL;
+	if (size <= bufferPool.size)
+		buf = poolTake(&bufferPool);
+	if (buf == NULL)
+		buf = malloc(size);
+	return buf;
+}
+
+
+
+void ftplibBufFree(char* buf)
+{
+	if (!poolGive(&bufferPool, buf))
+		free(buf);
+}
+
+
 
 /*
  * socket_wait - wait for socket to receive or flush data
@@ -102,7 +401,7 @@ static int socketWait(NetBuf_t* ctl)
 		if (rv == -1) {
 			rv = 0;
 			strncpy(ctl->ctrl->response, strerror(errno),
-						sizeof(ctl->ctrl->response));
+						ctl->ctrl->respsize);
 			break;
 		}
 		else if (rv > 0) {
@@ -161,7 +460,7 @@ static int readLine(char* buffer, int max, NetBuf_t* ctl)
 		if (ctl->cput == ctl->cget) {
 			ctl->cput = ctl->cget = ctl->buf;
 			ctl->cavail = 0;
-			ctl->cleft = FTPLIB_BUFFER_SIZE;
+			ctl->cleft = ctl->bufsize;
 		}
 		if (eof) {
 			if (retval == 0)
@@ -195,10 +494,25 @@ static int readLine(char* buffer, int max, NetBuf_t* ctl)
  * return 1 if first char matches
  */
 static int readResponse(char c, NetBuf_t* nControl)
+{
+	return readReply(c, NULL, nControl);
+}
+
+
+
+/*
+ * read a response from the server, passing the lines of a multi-line
+ * reply between its first and last line to line() when not NULL
+ *
+ * return 0 if first char doesn't match
+ * return 1 if first char matches
+ */
+static int readReply(char c, void (*line)(const char* l, NetBuf_t* nControl),
+	NetBuf_t* nControl)
 {
 	char match[5];
 	if (readLine(nControl->response,
-			FTPLIB_RESPONSE_BUFFER_SIZE, nControl) == -1) {
+			nControl->respsize, nControl) == -1) {
 		#if FTPLIB_DEBUG
 		perror("FTP Client Error: readResponse, read failed");
 		#endif
@@ -214,7 +528,7 @@ static int readResponse(char c, NetBuf_t* nControl)
 		match[4] = '\0';
 		do {
 			if (readLine(nControl->response,
-					FTPLIB_RESPONSE_BUFFER_SIZE, nControl) == -1) {
+					nControl->respsize, nControl) == -1) {
 				#if FTPLIB_DEBUG
 				perror("FTP Client Error: readResponse, read failed");
 				#endif
@@ -223,6 +537,8 @@ static int readResponse(char c, NetBuf_t* nControl)
 			#if FTPLIB_DEBUG == 2
 			printf("FTP Client Response: %s\n\r", nControl->response);
 			#endif
+			if ((line != NULL) && strncmp(nControl->response, match, 4))
+				line(nControl->response, nControl);
 		}
 		while (strncmp(nControl->response, match, 4));
 	}
@@ -240,23 +556,281 @@ static int readResponse(char c, NetBuf_t* nControl)
  * return 1 if proper response received, 0 otherwise
  */
 static int sendCommand(const char* cmd, char expresp, NetBuf_t* nControl)
+{
+	FtpCommand_t c = { cmd, expresp, 0 };
+	return sendCommands(&c, 1, nControl);
+}
+
+
+
+/*
+ * sendCommands - pipeline commands and match their replies in order
+ *
+ * Commands are packed into as few writes as possible.  Every reply is
+ * read back, also after a mismatch, so the control connection stays in
+ * step.  A command too long to send is skipped and gets reply code 0.
+ *
+ * return 1 if every command got its expected response, 0 otherwise
+ */
+static int sendCommands(FtpCommand_t* cmds, int n, NetBuf_t* nControl)
 {
 	char buf[FTPLIB_TEMP_BUFFER_SIZE];
 	if (nControl->dir != FTPLIB_CONTROL)
 		return 0;
-	#if FTPLIB_DEBUG == 2
-	printf("FTP Client sendCommand: %s\n\r", cmd);
-	#endif
-	if ((strlen(cmd) + 3) > sizeof(buf))
-		return 0;
-	sprintf(buf, "%s\r\n", cmd);
-	if (send(nControl->handle, buf, strlen(buf), 0) <= 0) {
+	int rv = 1;
+	int i = 0;
+	while (i < n) {
+		int first = i;
+		size_t l = 0;
+		for (; i < n; i++) {
+			size_t c = strlen(cmds[i].cmd);
+			cmds[i].reply = 0;
+			if ((c + 3) > sizeof(buf)) {
+				if (i > first)
+					break;
+				rv = 0;
+				continue;
+			}
+			if ((l + c + 2) > sizeof(buf))
+				break;
+			#if FTPLIB_DEBUG == 2
+			printf("FTP Client sendCommand: %s\n\r", cmds[i].cmd);
+			#endif
+			forgetState(cmds[i].cmd, nControl);
+			memcpy(&buf[l], cmds[i].cmd, c);
+			l += c;
+			buf[l++] = '\r';
+			buf[l++] = '\n';
+		}
+		if (l == 0)
+			continue;
+		if (send(nControl->handle, buf, l, 0) != (ssize_t) l) {
+			#if FTPLIB_DEBUG
+			perror("FTP Client sendCommand: write");
+			#endif
+			return 0;
+		}
+		for (int j = first; j < i; j++) {
+			if (strlen(cmds[j].cmd) + 3 > sizeof(buf))
+				continue;
+			if (!readResponse(cmds[j].expresp, nControl))
+				rv = 0;
+			cmds[j].reply = atoi(nControl->response);
+		}
+	}
+	return rv;
+}
+
+
+
+/*
+ * pipeFill - wait for a free slot of the ring
+ *
+ * return the slot to fill, -1 if the other side gave up
+ */
+static int pipeFill(struct Pipe* p)
+{
+	pthread_mutex_lock(&p->lock);
+	while ((p->filled == p->count) && !p->failed)
+		pthread_cond_wait(&p->cond, &p->lock);
+	int i = p->failed ? -1 : p->head;
+	pthread_mutex_unlock(&p->lock);
+	return i;
+}
+
+
+
+/*
+ * pipePush - hand the slot returned by pipeFill() to the consumer
+ */
+static void pipePush(struct Pipe* p, int len)
+{
+	pthread_mutex_lock(&p->lock);
+	p->len[p->head] = len;
+	p->head = (p->head + 1) % p->count;
+	p->filled++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+
+/*
+ * pipeTake - wait for a filled slot of the ring
+ *
+ * return the slot to drain, -1 at the end of the data or if the other
+ * side gave up
+ */
+static int pipeTake(struct Pipe* p)
+{
+	pthread_mutex_lock(&p->lock);
+	while ((p->filled == 0) && !p->eof && !p->failed)
+		pthread_cond_wait(&p->cond, &p->lock);
+	int i = (p->failed || (p->filled == 0)) ? -1 : p->tail;
+	pthread_mutex_unlock(&p->lock);
+	return i;
+}
+
+
+
+/*
+ * pipeDone - give the slot returned by pipeTake() back to the producer
+ */
+static void pipeDone(struct Pipe* p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->tail = (p->tail + 1) % p->count;
+	p->filled--;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+
+/*
+ * pipeStop - end the data, or with ok clear give up the transfer
+ *
+ * The producer ends the data once it has pushed the last slot, either
+ * side gives up when it fails and the other one stops at its next call.
+ */
+static void pipeStop(struct Pipe* p, int ok)
+{
+	pthread_mutex_lock(&p->lock);
+	if (ok)
+		p->eof = 1;
+	else
+		p->failed = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+
+/*
+ * pipeFileTask - the file side of a pipelined transfer
+ *
+ * Writes the received slots to the local file, or fills slots from it
+ * for an upload, while xfer() is busy with the network.
+ */
+static void* pipeFileTask(void* arg)
+{
+	struct Pipe* p = arg;
+	int i;
+	if (p->download) {
+		while ((i = pipeTake(p)) != -1) {
+			long long t = nowUs();
+			size_t w = fwrite(p->slot[i], 1, p->len[i], p->local);
+			p->fileTime += nowUs() - t;
+			if (w != (size_t) p->len[i]) {
+				#if FTPLIB_DEBUG
+				perror("FTP Client pipeFileTask localfile write");
+				#endif
+				pipeStop(p, 0);
+				break;
+			}
+			pipeDone(p);
+		}
+	}
+	else {
+		while ((i = pipeFill(p)) != -1) {
+			long long t = nowUs();
+			int l = fread(p->slot[i], 1, p->size, p->local);
+			p->fileTime += nowUs() - t;
+			if (l <= 0) {
+				pipeStop(p, !ferror(p->local));
+				break;
+			}
+			pipePush(p, l);
+		}
+	}
+	return NULL;
+}
+
+
+
+/*
+ * pipeXfer - move the data of an open transfer through a ring of buffers
+ *
+ * The calling task only does network I/O and a file task only does
+ * file I/O, so the radio is busy while flash erases and programs and
+ * the other way around.  Either side runs up to the ring size ahead.
+ *
+ * return 1 if successful, 0 otherwise, -1 if the ring or the task could
+ * not be set up and the transfer has not started
+ */
+static int pipeXfer(FILE* local, int download, NetBuf_t* nData)
+{
+	struct Pipe p;
+	memset(&p, 0, sizeof(p));
+	p.count = nData->ctrl->pipeline;
+	p.size = nData->bufsize;
+	p.download = download;
+	p.local = local;
+	for (int i = 0; i < p.count; i++)
+		if ((p.slot[i] = ftplibBufAlloc(p.size)) == NULL)
+			p.count = 0;
+
+	int rv = -1;
+	pthread_t task;
+	pthread_attr_t attr;
+	if ((p.count > 0) && (pthread_attr_init(&attr) == 0)) {
+		#if defined CONFIG_FTPLIB_PIPELINE_STACK
+		pthread_attr_setstacksize(&attr, CONFIG_FTPLIB_PIPELINE_STACK);
+		#endif
+		pthread_mutex_init(&p.lock, NULL);
+		pthread_cond_init(&p.cond, NULL);
+		if (pthread_create(&task, &attr, pipeFileTask, &p) == 0)
+			rv = 1;
+		else {
+			pthread_mutex_destroy(&p.lock);
+			pthread_cond_destroy(&p.cond);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	if (rv == -1) {
 		#if FTPLIB_DEBUG
-		perror("FTP Client sendCommand: write");
+		perror("FTP Client pipeXfer setup");
 		#endif
-		return 0;
+		for (int i = 0; i < FTPLIB_PIPELINE_MAX; i++)
+			if (p.slot[i] != NULL)
+				ftplibBufFree(p.slot[i]);
+		return -1;
+	}
+
+	int i;
+	if (download) {
+		while ((i = pipeFill(&p)) != -1) {
+			int l = FtpReadFull(p.slot[i], p.size, nData);
+			if (l <= 0) {
+				pipeStop(&p, l == 0);
+				break;
+			}
+			pipePush(&p, l);
+		}
+	}
+	else {
+		while ((i = pipeTake(&p)) != -1) {
+			if (FtpWrite(p.slot[i], p.len[i], nData) < p.len[i]) {
+				#if FTPLIB_DEBUG
+				perror("FTP Client pipeXfer short write");
+				#endif
+				pipeStop(&p, 0);
+				break;
+			}
+			pipeDone(&p);
+		}
 	}
-	return readResponse(expresp, nControl);
+	pthread_join(task, NULL);
+	nData->metrics.fileTime += p.fileTime;
+	if (p.failed)
+		rv = 0;
+
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.cond);
+	for (i = 0; i < FTPLIB_PIPELINE_MAX; i++)
+		if (p.slot[i] != NULL)
+			ftplibBufFree(p.slot[i]);
+	return rv;
 }
 
 
@@ -264,10 +838,15 @@ static int sendCommand(const char* cmd, char expresp, NetBuf_t* nControl)
 /*
  * Xfer - issue a command and transfer data
  *
+ * A non zero offset restarts the transfer at that byte of both files.
+ * With keep set a failed download leaves the partial local file in place
+ * so it can be resumed later.  With FTPLIB_PIPELINE set the file is read
+ * or written by a second task, see pipeXfer().
+ *
  * return 1 if successful, 0 otherwise
  */
 static int xfer(const char* localfile, const char* path,
-	NetBuf_t* nControl, int typ, int mode)
+	NetBuf_t* nControl, int typ, int mode, unsigned int offset, int keep)
 {
 	FILE* local = NULL;
 	NetBuf_t* nData;
@@ -275,139 +854,300 @@ static int xfer(const char* localfile, const char* path,
 	if (localfile != NULL) {
 		char ac[4];
 		memset( ac, 0, sizeof(ac) );
-		if (typ == FTPLIB_FILE_WRITE)
+		if ((typ == FTPLIB_FILE_WRITE) || (typ == FTPLIB_FILE_APPEND))
 			ac[0] = 'r';
 		else
 			ac[0] = 'w';
 		if (mode == FTPLIB_IMAGE)
 			ac[1] = 'b';
+		if ((offset > 0) && (ac[0] == 'w')) {
+			ac[0] = 'r';
+			ac[strlen(ac)] = '+';
+		}
 		local = fopen(localfile, ac);
 		if (local == NULL) {
 			strncpy(nControl->response, strerror(errno),
-						sizeof(nControl->response));
+						nControl->respsize);
+			return 0;
+		}
+		if ((offset > 0) && (fseek(local, offset, SEEK_SET) != 0)) {
+			strncpy(nControl->response, strerror(errno),
+						nControl->respsize);
+			fclose(local);
 			return 0;
 		}
 	}
+	else if (offset > 0) {
+		sprintf(nControl->response, "Restart needs a local file\n");
+		return 0;
+	}
 	if(local == NULL)
-		local = (typ == FTPLIB_FILE_WRITE) ? stdin : stdout;
-	if (!FtpAccess(path, typ, mode, nControl, &nData)) {
+		local = ((typ == FTPLIB_FILE_WRITE) || (typ == FTPLIB_FILE_APPEND)) ?
+			stdin : stdout;
+	if (!FtpAccessAt(path, typ, mode, offset, nControl, &nData)) {
 		if (localfile) {
 			fclose(local);
-			if (typ == FTPLIB_FILE_READ)
+			if ((typ == FTPLIB_FILE_READ) && !keep)
 				unlink(localfile);
 		}
 		return 0;
 	}
 
-	int rv = 1;
-	int l = 0;
-	char* dbuf = malloc(FTPLIB_BUFFER_SIZE);
-	if (dbuf != NULL) {
-		if (typ == FTPLIB_FILE_WRITE) {
-			while ((l = fread(dbuf, 1, FTPLIB_BUFFER_SIZE, local)) > 0) {
-				int c = FtpWrite(dbuf, l, nData);
-				if (c < l) {
-					#if FTPLIB_DEBUG
-					//printf("Ftp Client xfer short write: passed %d, wrote %d\n", l, c);
-					char tempbuf[128];
-					sprintf(tempbuf, "Ftp Client xfer short write: passed %d, wrote %d\n", l, c);
-					perror(tempbuf);
-					#endif
-					rv = 0;
-					break;
+	int upload = (typ == FTPLIB_FILE_WRITE) || (typ == FTPLIB_FILE_APPEND);
+	int rv = -1;
+	if (nControl->pipeline > 1)
+		rv = pipeXfer(local, !upload, nData);
+	/* no ring, or it could not be set up: one buffer, one task */
+	if (rv == -1) {
+		int l = 0;
+		int size = nData->bufsize;
+		char* dbuf = ftplibBufAlloc(size);
+		if (dbuf != NULL) {
+			rv = 1;
+			long long t = nowUs();
+			if (upload) {
+				while ((l = fread(dbuf, 1, size, local)) > 0) {
+					nData->metrics.fileTime += nowUs() - t;
+					int c = FtpWrite(dbuf, l, nData);
+					if (c < l) {
+						#if FTPLIB_DEBUG
+						//printf("Ftp Client xfer short write: passed %d, wrote %d\n", l, c);
+						char tempbuf[128];
+						sprintf(tempbuf, "Ftp Client xfer short write: passed %d, wrote %d\n", l, c);
+						perror(tempbuf);
+						#endif
+						rv = 0;
+						break;
+					}
+					t = nowUs();
 				}
 			}
-		}
-		else {
-			while ((l = FtpRead(dbuf, FTPLIB_BUFFER_SIZE, nData)) > 0) {
-				if (fwrite(dbuf, 1, l, local) == 0) {
-					#if FTPLIB_DEBUG
-					perror("FTP Client xfer localfile write");
-					#endif
-					rv = 0;
-					break;
+			else {
+				while ((l = FtpReadFull(dbuf, size, nData)) > 0) {
+					t = nowUs();
+					size_t w = fwrite(dbuf, 1, l, local);
+					nData->metrics.fileTime += nowUs() - t;
+					if (w == 0) {
+						#if FTPLIB_DEBUG
+						perror("FTP Client xfer localfile write");
+						#endif
+						rv = 0;
+						break;
+					}
 				}
+				if (l < 0)
+					rv = 0;
 			}
+			ftplibBufFree(dbuf);
+		} else {
+			#if FTPLIB_DEBUG
+			perror("FTP Client xfer malloc dbuf");
+			#endif
+			rv = 0;
 		}
-		free(dbuf);
-	} else {
-		#if FTPLIB_DEBUG
-		perror("FTP Client xfer malloc dbuf");
-		#endif
-		rv = 0;
 	}
+	/* the final reply, and for compressed files the end of the stream,
+	 * decide whether the transfer was complete */
+	if (!FtpClose(nData))
+		rv = 0;
 	fflush(local);
 	if(localfile != NULL){
 		fclose(local);
-		if(rv != 1)
+		if((rv != 1) && (typ == FTPLIB_FILE_READ) && !keep)
 			unlink(localfile);
 	}
-	FtpClose(nData);
 	return rv;
 }
 
 
 
 /*
- * openPort - set up data connection
+ * sendExtended - send EPSV or EPRT, lead first if not NULL
  *
- * return 1 if successful, 0 otherwise
+ * A server that does not understand the command is remembered and never
+ * asked again.  Unless the command is required (IPv6), the caller then
+ * falls back to PASV or PORT; lead has been answered and is cleared.
+ *
+ * return 1 if successful, -1 to fall back, 0 otherwise
  */
-static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
+static int sendExtended(const char* cmd, const char** lead, int required,
+	NetBuf_t* nControl)
 {
-	union
-	{
-		struct sockaddr sa;
-		struct sockaddr_in in;
-	} sin;
-
-	if (nControl->dir != FTPLIB_CONTROL)
-		return -1;
-	if ((dir != FTPLIB_READ) && (dir != FTPLIB_WRITE)) {
-		sprintf(nControl->response, "Invalid direction %d\n", dir);
-		return -1;
-	}
-	if ((mode != FTPLIB_ASCII) && (mode != FTPLIB_IMAGE)) {
-		sprintf(nControl->response, "Invalid mode %c\n", mode);
-		return -1;
-	}
-	//unsigned int l = sizeof(sin);
-	socklen_t l = sizeof(sin);
-	if (nControl->cmode == FTPLIB_PASSIVE) {
-		memset(&sin, 0, l);
-		sin.in.sin_family = AF_INET;
-		if (!sendCommand("PASV", '2', nControl))
-			return -1;
-		char* cp = strchr(nControl->response,'(');
-		if (cp == NULL)
-			return -1;
-		cp++;
-		unsigned int v[6];
-		sscanf(cp,"%u,%u,%u,%u,%u,%u",&v[2],&v[3],&v[4],&v[5],&v[0],&v[1]);
-		sin.sa.sa_data[2] = v[2];
-		sin.sa.sa_data[3] = v[3];
-		sin.sa.sa_data[4] = v[4];
-		sin.sa.sa_data[5] = v[5];
-		sin.sa.sa_data[0] = v[0];
-		sin.sa.sa_data[1] = v[1];
+	FtpCommand_t c[2] = { { *lead, '2', 0 }, { cmd, '2', 0 } };
+	if (sendCommands(*lead ? c : &c[1], *lead ? 2 : 1, nControl)) {
+		nControl->ext = 1;
+		return 1;
 	}
-	else {
-		if(getsockname(nControl->handle, &sin.sa, &l) < 0) {
-			#if FTPLIB_DEBUG
-			perror("FTP Client openPort: getsockname");
+	if ((*lead && ((c[0].reply / 100) != 2)) || ((c[1].reply / 100) != 5)
+			|| required || (nControl->ext == 1))
+		return 0;
+	nControl->ext = 0;
+	nControl->metrics.retries++;
+	*lead = NULL;
+	return -1;
+}
+
+
+
+/*
+ * askPassive - get the address of a passive data connection
+ *
+ * EPSV only names a port, the data connection goes to the address the
+ * control connection is connected to.  That also works through NAT
+ * gateways rewriting the PASV reply, so EPSV is tried first.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int askPassive(struct sockaddr* sa, socklen_t* l, const char* lead,
+	NetBuf_t* nControl)
+{
+	if (getpeername(nControl->handle, sa, l) < 0) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client openPort: getpeername");
+		#endif
+		return 0;
+	}
+	int v6 = (sa->sa_family == AF_INET6);
+	int rv = -1;
+	if (v6 || (nControl->ext != 0))
+		rv = sendExtended("EPSV", &lead, v6, nControl);
+	if (rv == 1) {
+		/* 229 Entering Extended Passive Mode (|||port|) */
+		char* cp = strchr(nControl->response, '(');
+		if ((cp == NULL) || (cp[1] == '\0') || (cp[2] != cp[1])
+				|| (cp[3] != cp[1]))
+			return 0;
+		char* e;
+		unsigned long port = strtoul(&cp[4], &e, 10);
+		if ((*e != cp[1]) || (port == 0) || (port > 65535))
+			return 0;
+		if (v6)
+			((struct sockaddr_in6*) sa)->sin6_port = htons(port);
+		else
+			((struct sockaddr_in*) sa)->sin_port = htons(port);
+		return 1;
+	}
+	if (rv == 0)
+		return 0;
+
+	FtpCommand_t c[2] = { { lead, '2', 0 }, { "PASV", '2', 0 } };
+	if (!sendCommands(lead ? c : &c[1], lead ? 2 : 1, nControl))
+		return 0;
+	/* 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2) */
+	char* cp = strchr(nControl->response, '(');
+	unsigned int v[6];
+	if ((cp == NULL) || (sscanf(cp, "(%u,%u,%u,%u,%u,%u", &v[0], &v[1],
+			&v[2], &v[3], &v[4], &v[5]) != 6))
+		return 0;
+	for (int i = 0; i < 6; i++)
+		if (v[i] > 255)
+			return 0;
+	struct sockaddr_in* in = (struct sockaddr_in*) sa;
+	memset(in, 0, sizeof(*in));
+	in->sin_family = AF_INET;
+	in->sin_addr.s_addr = htonl((v[0] << 24) | (v[1] << 16) | (v[2] << 8)
+		| v[3]);
+	in->sin_port = htons((v[4] << 8) | v[5]);
+	*l = sizeof(*in);
+	return 1;
+}
+
+
+
+/*
+ * askActive - tell the server where to connect the data connection
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int askActive(const struct sockaddr* sa, const char* lead,
+	NetBuf_t* nControl)
+{
+	char buf[FTPLIB_TEMP_BUFFER_SIZE];
+	int v6 = (sa->sa_family == AF_INET6);
+	const struct sockaddr_in* in = (const struct sockaddr_in*) sa;
+	const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) sa;
+	int rv = -1;
+	if (v6 || (nControl->ext != 0)) {
+		char host[INET6_ADDRSTRLEN];
+		if (inet_ntop(sa->sa_family, v6 ? (const void*) &in6->sin6_addr
+				: (const void*) &in->sin_addr, host, sizeof(host)) == NULL)
+			return 0;
+		sprintf(buf, "EPRT |%d|%s|%u|", v6 ? 2 : 1, host,
+			ntohs(v6 ? in6->sin6_port : in->sin_port));
+		rv = sendExtended(buf, &lead, v6, nControl);
+	}
+	if (rv != -1)
+		return rv;
+
+	uint32_t a = ntohl(in->sin_addr.s_addr);
+	unsigned int port = ntohs(in->sin_port);
+	sprintf(buf, "PORT %u,%u,%u,%u,%u,%u", (unsigned int) (a >> 24),
+		(unsigned int) ((a >> 16) & 0xff), (unsigned int) ((a >> 8) & 0xff),
+		(unsigned int) (a & 0xff), port >> 8, port & 0xff);
+	FtpCommand_t c[2] = { { lead, '2', 0 }, { buf, '2', 0 } };
+	return sendCommands(lead ? c : &c[1], lead ? 2 : 1, nControl);
+}
+
+
+
+/*
+ * openPort - set up data connection
+ *
+ * lead, if not NULL, is pipelined in front of EPSV/PASV or EPRT/PORT and
+ * must get a positive completion reply as well.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir,
+	const char* lead)
+{
+	SockAddr_t sin;
+
+	if (nControl->dir != FTPLIB_CONTROL)
+		return -1;
+	if ((dir != FTPLIB_READ) && (dir != FTPLIB_WRITE)) {
+		sprintf(nControl->response, "Invalid direction %d\n", dir);
+		return -1;
+	}
+	if ((mode != FTPLIB_ASCII) && (mode != FTPLIB_IMAGE)) {
+		sprintf(nControl->response, "Invalid mode %c\n", mode);
+		return -1;
+	}
+	socklen_t l = sizeof(sin);
+	if (nControl->cmode == FTPLIB_PASSIVE) {
+		if (!askPassive(&sin.sa, &l, lead, nControl))
+			return -1;
+	}
+	else {
+		if(getsockname(nControl->handle, &sin.sa, &l) < 0) {
+			#if FTPLIB_DEBUG
+			perror("FTP Client openPort: getsockname");
 			#endif
 			return -1;
 		}
 	}
-	int sData = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int sData = socket(sin.sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
 	if (sData == -1) {
 		#if FTPLIB_DEBUG
 		perror("FTP Client openPort: socket");
 		#endif
 		return -1;
 	}
+	/* before connect or listen, the window scale is settled in the SYN */
+	if ((nControl->rcvbuf > 0) && (setsockopt(sData, SOL_SOCKET, SO_RCVBUF,
+			&nControl->rcvbuf, sizeof(nControl->rcvbuf)) == -1)) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client openPort: SO_RCVBUF");
+		#endif
+	}
+	if ((nControl->sndbuf > 0) && (setsockopt(sData, SOL_SOCKET, SO_SNDBUF,
+			&nControl->sndbuf, sizeof(nControl->sndbuf)) == -1)) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client openPort: SO_SNDBUF");
+		#endif
+	}
 	if (nControl->cmode == FTPLIB_PASSIVE) {
-		if (connect(sData, &sin.sa, sizeof(sin.sa)) == -1) {
+		if (connect(sData, &sin.sa, l) == -1) {
 			#if FTPLIB_DEBUG
 			perror("FTP Client openPort: connect");
 			#endif
@@ -416,8 +1156,11 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 		}
 	}
 	else {
-		sin.in.sin_port = 0;
-		if (bind(sData, &sin.sa, sizeof(sin)) == -1) {
+		if (sin.sa.sa_family == AF_INET6)
+			sin.in6.sin6_port = 0;
+		else
+			sin.in.sin_port = 0;
+		if (bind(sData, &sin.sa, l) == -1) {
 			#if FTPLIB_DEBUG
 			perror("FTP Client openPort: bind");
 			#endif
@@ -431,22 +1174,13 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 			closesocket(sData);
 			return -1;
 		}
-		if (getsockname(sData, &sin.sa, &l) < 0)
-			return -1;
-		char buf[FTPLIB_TEMP_BUFFER_SIZE];
-		sprintf(buf, "PORT %d,%d,%d,%d,%d,%d",
-			(unsigned char) sin.sa.sa_data[2],
-			(unsigned char) sin.sa.sa_data[3],
-			(unsigned char) sin.sa.sa_data[4],
-			(unsigned char) sin.sa.sa_data[5],
-			(unsigned char) sin.sa.sa_data[0],
-			(unsigned char) sin.sa.sa_data[1]);
-		if (!sendCommand(buf, '2', nControl)) {
+		if ((getsockname(sData, &sin.sa, &l) < 0)
+				|| !askActive(&sin.sa, lead, nControl)) {
 			closesocket(sData);
 			return -1;
 		}
 	}
-	NetBuf_t* ctrl = calloc(1, sizeof(NetBuf_t));
+	NetBuf_t* ctrl = netbufAlloc();
 	if (ctrl == NULL) {
 		#if FTPLIB_DEBUG
 		perror("FTP Client openPort: calloc ctrl");
@@ -454,12 +1188,13 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 		closesocket(sData);
 		return -1;
 	}
-	if ((mode == 'A') && ((ctrl->buf = malloc(FTPLIB_BUFFER_SIZE)) == NULL)) {
+	ctrl->bufsize = nControl->xfersize;
+	if ((mode == 'A') && ((ctrl->buf = ftplibBufAlloc(ctrl->bufsize)) == NULL)) {
 		#if FTPLIB_DEBUG
 		perror("FTP Client openPort: malloc ctrl->buf");
 		#endif
 		closesocket(sData);
-		free(ctrl);
+		netbufFree(ctrl);
 		return -1;
 	}
 	ctrl->handle = sData;
@@ -469,6 +1204,7 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 	ctrl->xfered = 0;
 	ctrl->xfered1 = 0;
 	ctrl->cbbytes = nControl->cbbytes;
+	ctrl->metrics = nControl->metrics;
 	ctrl->ctrl = nControl;
 	if (ctrl->idletime.tv_sec || ctrl->idletime.tv_usec || ctrl->cbbytes)
 		ctrl->idlecb = nControl->idlecb;
@@ -494,31 +1230,42 @@ static int writeLine(const char* buf, int len, NetBuf_t* nData)
 	int nb = 0;
 	int w = 0;
 	const char* ubp = buf;
+	const char* end = buf + len;
 	char lc = 0;
-	int x = 0;
-
-	for (x = 0; x < len; x++) {
-		if ((*ubp == '\n') && (lc != '\r')) {
-			if (nb == FTPLIB_BUFFER_SIZE) {
-				if (!socketWait(nData))
-					return x;
-				w = send(nData->handle, nbp, FTPLIB_BUFFER_SIZE, 0);
-				if (w != FTPLIB_BUFFER_SIZE) {
-					#if FTPLIB_DEBUG
-					printf("Ftp client write line: net_write(1) returned %d, errno = %d\n",
-							w, errno);
-					#endif
-					return(-1);
-				}
-				nb = 0;
+
+	while (ubp < end) {
+		/* the run up to the next LF goes over unchanged */
+		const char* nl = memchr(ubp, '\n', end - ubp);
+		const char* run = (nl != NULL) ? nl : end;
+		while (ubp < run) {
+			int n = run - ubp;
+			if (n > nData->bufsize - nb)
+				n = nData->bufsize - nb;
+			memcpy(&nbp[nb], ubp, n);
+			nb += n;
+			ubp += n;
+			lc = ubp[-1];
+			if (nb < nData->bufsize)
+				continue;
+			if (!socketWait(nData))
+				return ubp - buf;
+			w = sendData(nbp, nb, nData);
+			if (w != nb) {
+				#if FTPLIB_DEBUG
+				printf("Ftp client write line: net_write(1) returned %d, errno = %d\n",
+						w, errno);
+				#endif
+				return(-1);
 			}
-			nbp[nb++] = '\r';
+			nb = 0;
 		}
-		if (nb == FTPLIB_BUFFER_SIZE) {
+		if (nl == NULL)
+			break;
+		if (nb > nData->bufsize - 2) {
 			if (!socketWait(nData))
-				return x;
-			w = send(nData->handle, nbp, FTPLIB_BUFFER_SIZE, 0);
-			if (w != FTPLIB_BUFFER_SIZE) {
+				return ubp - buf;
+			w = sendData(nbp, nb, nData);
+			if (w != nb) {
 				#if FTPLIB_DEBUG
 				printf("Ftp client write line: net_write(2) returned %d, errno = %d\n",
 						w, errno);
@@ -527,12 +1274,14 @@ static int writeLine(const char* buf, int len, NetBuf_t* nData)
 			}
 			nb = 0;
 		}
+		if (lc != '\r')
+			nbp[nb++] = '\r';
 		nbp[nb++] = lc = *ubp++;
 	}
 	if (nb){
 		if (!socketWait(nData))
-			return x;
-		w = send(nData->handle, nbp, nb, 0);
+			return ubp - buf;
+		w = sendData(nbp, nb, nData);
 		if (w != nb) {
 			#if FTPLIB_DEBUG
 			printf("Ftp client write line: net_write(3) returned %d, errno = %d\n",
@@ -547,534 +1296,2388 @@ static int writeLine(const char* buf, int len, NetBuf_t* nData)
 
 
 /*
- * acceptConnection - accept connection from server
+ * readBlock - receive data and return it where it landed
  *
- * return 1 if successful, 0 otherwise
+ * Binary data is received straight into landing.  ASCII data is received
+ * into the data connection buffer and its CRLF line endings are converted
+ * to LF in place; a trailing CR is held back until the next block shows
+ * whether it starts a line ending.
+ *
+ * return -1 on error, 0 on eof, otherwise bytecount at *block
  */
-static int acceptConnection(NetBuf_t* nData, NetBuf_t* nControl)
+static int readBlock(char** block, char* landing, NetBuf_t* nData)
 {
-	int rv = 0;
-	fd_set mask;
-	FD_ZERO(&mask);
-	FD_SET(nControl->handle, &mask);
-	FD_SET(nData->handle, &mask);
-	struct timeval tv;
-	tv.tv_usec = 0;
-	tv.tv_sec = FTPLIB_ACCEPT_TIMEOUT ;
-	int i = nControl->handle;
-	if (i < nData->handle)
-		i = nData->handle;
-	i = select(i+1, &mask, NULL, NULL, &tv);
-	if (i == -1) {
-		strncpy(nControl->response, strerror(errno),
-				sizeof(nControl->response));
-		closesocket(nData->handle);
-		nData->handle = 0;
-		rv = 0;
-	}
-	else if (i == 0) {
-		strcpy(nControl->response, "FTP Client accept connection "
-				"timed out waiting for connection");
-		closesocket(nData->handle);
-		nData->handle = 0;
-		rv = 0;
+	if (nData->dir != FTPLIB_READ)
+		return -1;
+	if (nData->buf == NULL) {
+		*block = landing;
+		#if FTPLIB_ZLIB
+		if (nData->zs != NULL)
+			return zlibRead(landing, nData->bufsize, 1, nData);
+		#endif
+		return recvFull(landing, nData->bufsize, nData);
 	}
-	else {
-		if (FD_ISSET(nData->handle, &mask)) {
-			struct sockaddr addr;
-			//unsigned int l = sizeof(addr);
-			socklen_t l = sizeof(addr);
-			int sData = accept(nData->handle, &addr, &l);
-			i = errno;
-			closesocket(nData->handle);
-			if (sData > 0) {
-				rv = 1;
-				nData->handle = sData;
-			}
-			else {
-				strncpy(nControl->response, strerror(i),
-								sizeof(nControl->response));
-				nData->handle = 0;
-				rv = 0;
-			}
-		}
-		else if (FD_ISSET(nControl->handle, &mask)) {
-			closesocket(nData->handle);
-			nData->handle = 0;
-			readResponse('2', nControl);
-			rv = 0;
-		}
+
+	int l = 0;
+	while (l == 0) {
+		if (nData->cavail > 0)
+			memmove(nData->buf, nData->cget, nData->cavail);
+		nData->cget = nData->buf;
+		nData->cput = nData->buf + nData->cavail;
+		nData->cleft = nData->bufsize - nData->cavail;
+		int x = recvData(nData->cput, nData->cleft, nData);
+		if (x == -1)
+			return -1;
+		nData->cavail += x;
+		nData->cput += x;
+		nData->cleft -= x;
+		if (nData->cavail == 0)
+			return 0;
+		l = convertText(nData->buf, nData->bufsize, x == 0, nData);
 	}
-	return rv;
+	*block = nData->buf;
+	return l;
 }
 
 
 
 /*
- * FtpSite - send a SITE command
+ * convertText - move received ASCII data to dst, CRLF becoming LF
  *
- * return 1 if command successful, 0 otherwise
+ * Whole runs without a CR are moved at once; memchr and memmove work a
+ * word (or a vector on the host) at a time instead of testing each byte.
+ * A CR ending the received data is kept back until the next byte shows
+ * whether it starts a CRLF, unless eof is set.  dst may be nData->buf.
+ *
+ * return the number of bytes stored at dst
  */
-int FtpSite(const char* cmd, NetBuf_t* nControl)
+static int convertText(char* dst, int max, int eof, NetBuf_t* nData)
 {
-	char buf[FTPLIB_TEMP_BUFFER_SIZE];
-	if ((strlen(cmd) + 7) > sizeof(buf))
-		return 0;
-	sprintf(buf, "SITE %s", cmd);
-	if (!sendCommand(buf, '2', nControl))
-		return 0;
-	else
-		return 1;
+	char* s = nData->cget;
+	char* e = s + nData->cavail;
+	if (!eof && (s < e) && (e[-1] == '\r'))
+		e--;
+	int l = 0;
+	while ((s < e) && (l < max)) {
+		char* cr = memchr(s, '\r', e - s);
+		int n = ((cr != NULL) ? cr : e) - s;
+		if (n > max - l)
+			n = max - l;
+		memmove(&dst[l], s, n);
+		l += n;
+		s += n;
+		if ((s != cr) || (l == max))
+			continue;
+		if ((s + 1 < e) && (s[1] == '\n'))
+			s++;
+		else
+			dst[l++] = *s++;
+	}
+	nData->cavail -= s - nData->cget;
+	nData->cget = s;
+	return l;
 }
 
 
 
 /*
- * FtpGetLastResponse - return a pointer to the last response received
+ * recvFull - receive until buf is full or the data connection ends
+ *
+ * Without an idle callback the whole buffer is asked for at once with
+ * MSG_WAITALL, so the stack only wakes us when it is full.
+ *
+ * return the number of bytes received, 0 at the end of the data, -1 on
+ * error, also when part of buf was received
  */
-char* FtpGetLastResponse(NetBuf_t* nControl)
+static int recvFull(char* buf, int max, NetBuf_t* nData)
 {
-	if ((nControl) && (nControl->dir == FTPLIB_CONTROL))
-		return nControl->response;
-	else
-		return NULL;
+	int flags = 0;
+	#if defined MSG_WAITALL
+	if (nData->idlecb == NULL)
+		flags = MSG_WAITALL;
+	#endif
+	int l = 0;
+	while (l < max) {
+		if (!socketWait(nData))
+			return -1;
+		int x = recv(nData->handle, &buf[l], max - l, flags);
+		nData->metrics.recvCalls++;
+		if ((x == -1) && (errno == EINTR)) {
+			nData->metrics.retries++;
+			continue;
+		}
+		if (x == -1)
+			return -1;
+		if (x == 0)
+			break;
+		l += x;
+	}
+	return l;
 }
 
 
 
 /*
- * FtpGetSysType - send a SYST command
+ * sendAll - send len bytes, following up on short sends
  *
- * Fills in the user buffer with the remote system type.  If more
- * information from the response is required, the user can parse
- * it out of the response buffer returned by FtpLastResponse().
+ * return the number of bytes sent, short if the idle callback gave up,
+ * -1 on error
+ */
+static int sendAll(const char* buf, int len, NetBuf_t* nData)
+{
+	int l = 0;
+	while (l < len) {
+		int x = send(nData->handle, &buf[l], len - l, 0);
+		nData->metrics.sendCalls++;
+		if ((x == -1) && (errno == EINTR)) {
+			nData->metrics.retries++;
+			continue;
+		}
+		if (x == -1)
+			return -1;
+		l += x;
+		if ((l < len) && !socketWait(nData))
+			break;
+	}
+	return l;
+}
+
+
+
+/*
+ * recvData - receive what the data connection has, inflated in MODE Z
  *
- * return 1 if command successful, 0 otherwise
+ * return the number of bytes received, 0 at the end of the data, -1 on
+ * error
  */
-int FtpGetSysType(char* buf, int max, NetBuf_t* nControl)
+static int recvData(char* buf, int max, NetBuf_t* nData)
 {
-	if (!sendCommand("SYST", '2', nControl))
-		return 0;
-	char* s = &nControl->response[4];
-	int l = max;
-	char* b = buf;
-	while ((--l) && (*s != ' '))
-		*b++ = *s++;
-	*b++ = '\0';
-	return 1;
+	#if FTPLIB_ZLIB
+	/* the stream may hold data the socket no longer shows */
+	if (nData->zs != NULL)
+		return zlibRead(buf, max, 0, nData);
+	#endif
+	if (!socketWait(nData))
+		return -1;
+	nData->metrics.recvCalls++;
+	return recv(nData->handle, buf, max, 0);
 }
 
 
 
 /*
- * FtpGetFileSize - determine the size of a remote file
+ * sendData - send len bytes, deflated in MODE Z
  *
- * return 1 if successful, 0 otherwise
+ * return the number of bytes taken, -1 on error
  */
-int FtpGetFileSize(const char* path,
-		unsigned int* size, char mode, NetBuf_t* nControl)
+static int sendData(const char* buf, int len, NetBuf_t* nData)
 {
-	char cmd[FTPLIB_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 7) > sizeof(cmd))
-		return 0;
-	sprintf(cmd, "TYPE %c", mode);
-	if (!sendCommand(cmd, '2', nControl))
-		return 0;
-	int rv = 1;
-	sprintf(cmd,"SIZE %s", path);
-	if(!sendCommand(cmd, '2', nControl))
-		rv = 0;
-	else {
-		int resp;
-		unsigned int sz;
-		if (sscanf(nControl->response, "%d %u", &resp, &sz) == 2)
-			*size = sz;
-		else
-			rv = 0;
-	}
-	return rv;
+	#if FTPLIB_ZLIB
+	if (nData->zs != NULL)
+		return zlibWrite(buf, len, nData);
+	#endif
+	return sendAll(buf, len, nData);
 }
 
 
 
 /*
- * FtpGetModDate - determine the modification date of a remote file
+ * readText - read as much converted ASCII data as fits into buf
  *
- * return 1 if successful, 0 otherwise
+ * return the number of bytes stored, 0 at the end of the data, -1 on error
  */
-int FtpGetModDate(const char* path, char* dt,
-		int max, NetBuf_t* nControl)
+static int readText(char* buf, int max, NetBuf_t* nData)
 {
-	char buf[FTPLIB_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 7) > sizeof(buf))
+	int eof = 0;
+	if (max <= 0)
 		return 0;
-	sprintf(buf, "MDTM %s", path);
-	int rv = 1;
-	if (!sendCommand(buf, '2', nControl))
-		rv = 0;
-	else
-		strncpy(dt, &nControl->response[4], max);
-	return rv;
+	while (1) {
+		int l = convertText(buf, max, eof, nData);
+		if ((l > 0) || eof)
+			return l;
+		/* at most a held back CR is left */
+		if (nData->cavail > 0)
+			memmove(nData->buf, nData->cget, nData->cavail);
+		nData->cget = nData->buf;
+		nData->cput = nData->buf + nData->cavail;
+		nData->cleft = nData->bufsize - nData->cavail;
+		int x = recvData(nData->cput, nData->cleft, nData);
+		if (x == -1)
+			return -1;
+		eof = (x == 0);
+		nData->cavail += x;
+		nData->cput += x;
+		nData->cleft -= x;
+	}
 }
 
 
 
-int FtpSetCallback(const FtpCallbackOptions_t* opt, NetBuf_t* nControl)
+/*
+ * countXfer - account transferred bytes and run the byte count callback
+ *
+ * return 0 if the callback asked to abort, 1 otherwise
+ */
+static int countXfer(int len, NetBuf_t* nData)
 {
-   nControl->idlecb = opt->cbFunc;
-   nControl->idlearg = opt->cbArg;
-   nControl->idletime.tv_sec = opt->idleTime / 1000;
-   nControl->idletime.tv_usec = (opt->idleTime % 1000) * 1000;
-   nControl->cbbytes = opt->bytesXferred;
-   return 1;
+	meterBytes(len, nData);
+	nData->xfered += len;
+	if (nData->idlecb && nData->cbbytes) {
+		nData->xfered1 += len;
+		if (nData->xfered1 > nData->cbbytes) {
+			if (nData->idlecb(nData, nData->xfered, nData->idlearg) == 0)
+				return 0;
+			nData->xfered1 = 0;
+		}
+	}
+	return 1;
 }
 
 
 
-int FtpClearCallback(NetBuf_t* nControl)
+/*
+ * meterStart - clear the last transfer of a session's metrics
+ *
+ * The session's own timings stay, the transfer fields are filled in by
+ * the data connection from here on.
+ */
+static void meterStart(const char* cmd, NetBuf_t* nControl)
 {
-   nControl->idlecb = NULL;
-   nControl->idlearg = NULL;
-   nControl->idletime.tv_sec = 0;
-   nControl->idletime.tv_usec = 0;
-   nControl->cbbytes = 0;
-   return 1;
+	FtpMetrics_t* m = &nControl->metrics;
+	*m = (FtpMetrics_t) { .dnsTime = m->dnsTime,
+		.connectTime = m->connectTime, .loginTime = m->loginTime,
+		.connects = m->connects };
+	snprintf(m->cmd, sizeof(m->cmd), "%.*s", (int) sizeof(m->cmd) - 1, cmd);
 }
 
 
 
 /*
- * FtpConnect - connect to remote server
+ * meterBytes - account len bytes of a data connection in its metrics
  *
- * return 1 if connected, 0 if not
+ * The peak rate is sampled over FTPLIB_METRICS_WINDOW ms, starting when
+ * the first byte moved.
  */
-int FtpConnect(const char* host, uint16_t port, NetBuf_t** nControl)
+static void meterBytes(int len, NetBuf_t* nData)
 {
-	ESP_LOGD(__FUNCTION__, "host=%s", host);
-	struct sockaddr_in sin;
-	memset(&sin,0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = inet_addr(host);
-	ESP_LOGD(__FUNCTION__, "sin.sin_addr.s_addr=%"PRIx32, sin.sin_addr.s_addr);
-	if (sin.sin_addr.s_addr == 0xffffffff) {
-		struct hostent *hp;
-		hp = gethostbyname(host);
-		if (hp == NULL) {
-			#if FTPLIB_DEBUG
-			perror("FTP Client Error: Connect, gethostbyname");
-			#endif
-			return 0;
-		}
-		struct ip4_addr *ip4_addr;
-		ip4_addr = (struct ip4_addr *)hp->h_addr;
-		sin.sin_addr.s_addr = ip4_addr->addr;
-		ESP_LOGD(__FUNCTION__, "sin.sin_addr.s_addr=%"PRIx32, sin.sin_addr.s_addr);
+	if (len <= 0)
+		return;
+	FtpMetrics_t* m = &nData->metrics;
+	long long now = nowUs();
+	m->bytes += len;
+	if (m->bytes == (uint64_t) len) {
+		m->firstByteTime = now - nData->mcmd;
+		nData->mwindow = now;
+		nData->mwinbytes = m->bytes;
+	}
+	else if (now - nData->mwindow >= FTPLIB_METRICS_WINDOW * 1000LL) {
+		uint64_t rate = (m->bytes - nData->mwinbytes) * 1000000
+			/ (now - nData->mwindow);
+		if (rate > m->peakRate)
+			m->peakRate = rate;
+		nData->mwindow = now;
+		nData->mwinbytes = m->bytes;
 	}
+}
 
-	int sControl = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	ESP_LOGD(__FUNCTION__, "sControl=%d", sControl);
-	if (sControl == -1) {
-		#if FTPLIB_DEBUG
-		perror("FTP Client Error: Connect, socket");
-		#endif
+
+
+/*
+ * meterEnd - finish the metrics of a closed data connection
+ *
+ * They become the session's last transfer, and are logged in one line
+ * with FTPLIB_METRICSLOG set.
+ */
+static void meterEnd(FtpMetrics_t* m, long long start, int ok,
+	NetBuf_t* nControl)
+{
+	m->ok = ok;
+	m->wallTime = nowUs() - start;
+	if (m->wallTime > 0)
+		m->avgRate = m->bytes * 1000000 / m->wallTime;
+	/* shorter than one sample */
+	if (m->peakRate < m->avgRate)
+		m->peakRate = m->avgRate;
+	#if defined ESP_PLATFORM
+	m->heapLow = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+	#endif
+	nControl->metrics = *m;
+	if (nControl->mlog)
+		ESP_LOGI("ftplib", "%s %s %" PRIu64 " B in %.1f ms: open %.1f, "
+			"first byte %.1f, file %.1f ms, %" PRIu32 "/%" PRIu32
+			" KB/s avg/peak, %" PRIu32 " recv, %" PRIu32 " send, %" PRIu32
+			" retries, heap low %" PRIu32, m->cmd, ok ? "ok" : "failed",
+			m->bytes, m->wallTime / 1e3, m->openTime / 1e3,
+			m->firstByteTime / 1e3, m->fileTime / 1e3, m->avgRate / 1024,
+			m->peakRate / 1024, m->recvCalls, m->sendCalls, m->retries,
+			m->heapLow);
+}
+
+
+
+#if FTPLIB_ZLIB
+/*
+ * zlibStart - put a deflate or inflate stream in front of a data connection
+ *
+ * window is passed on to zlib, 16 added for gzip framing.  The deflate
+ * memory level follows the window so a small window keeps the whole
+ * stream small: about 2^(window+3) bytes to compress and 2^window to
+ * decompress, plus the compressed side buffer.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int zlibStart(int window, int level, NetBuf_t* nData)
+{
+	int bits = window & 15;
+	int memLevel = (bits > 7) ? bits - 7 : 1;
+	nData->zs = calloc(1, sizeof(z_stream));
+	nData->zbuf = ftplibBufAlloc(nData->bufsize);
+	if ((nData->zs == NULL) || (nData->zbuf == NULL)) {
+		free(nData->zs);
+		if (nData->zbuf != NULL)
+			ftplibBufFree(nData->zbuf);
+		nData->zs = NULL;
+		nData->zbuf = NULL;
 		return 0;
 	}
-	if(connect(sControl, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
-		#if FTPLIB_DEBUG
-		perror("FTP Client Error: Connect, connect");
-		#endif
-		closesocket(sControl);
-		return 0;
+	int r;
+	if (nData->dir == FTPLIB_WRITE) {
+		r = deflateInit2(nData->zs, level, Z_DEFLATED, window, memLevel,
+			Z_DEFAULT_STRATEGY);
+		nData->zs->next_out = (Bytef*) nData->zbuf;
+		nData->zs->avail_out = nData->bufsize;
 	}
-	NetBuf_t* ctrl = calloc(1, sizeof(NetBuf_t));
-	if (ctrl == NULL) {
-		#if FTPLIB_DEBUG
-		perror("FTP Client Error: Connect, calloc ctrl");
-		#endif
-		closesocket(sControl);
+	else
+		r = inflateInit2(nData->zs, window);
+	if (r != Z_OK) {
+		free(nData->zs);
+		ftplibBufFree(nData->zbuf);
+		nData->zs = NULL;
+		nData->zbuf = NULL;
 		return 0;
 	}
-	ctrl->buf = malloc(FTPLIB_BUFFER_SIZE);
-	if (ctrl->buf == NULL) {
-		#if FTPLIB_DEBUG
-		perror("FTP Client Error: Connect, malloc ctrl->buf");
-		#endif
-		closesocket(sControl);
-		free(ctrl);
+	nData->zdone = 0;
+	return 1;
+}
+
+
+
+/*
+ * zlibSend - send the compressed data gathered so far
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int zlibSend(NetBuf_t* nData)
+{
+	int n = (char*) nData->zs->next_out - nData->zbuf;
+	nData->zs->next_out = (Bytef*) nData->zbuf;
+	nData->zs->avail_out = nData->bufsize;
+	if (n == 0)
+		return 1;
+	if (!socketWait(nData))
 		return 0;
+	return sendAll(nData->zbuf, n, nData) == n;
+}
+
+
+
+/*
+ * zlibWrite - compress len bytes onto the data connection
+ *
+ * Compressed data leaves in full buffers, what is left is sent by
+ * zlibEnd().
+ *
+ * return len if successful, -1 otherwise
+ */
+static int zlibWrite(const char* buf, int len, NetBuf_t* nData)
+{
+	z_stream* zs = nData->zs;
+	zs->next_in = (Bytef*) buf;
+	zs->avail_in = len;
+	while (zs->avail_in > 0) {
+		if (deflate(zs, Z_NO_FLUSH) == Z_STREAM_ERROR)
+			return -1;
+		if ((zs->avail_out == 0) && !zlibSend(nData))
+			return -1;
 	}
-	ctrl->handle = sControl;
-	ctrl->dir = FTPLIB_CONTROL;
-	ctrl->ctrl = NULL;
-	ctrl->data = NULL;
-	ctrl->cmode = FTPLIB_DEFAULT_MODE;
-	ctrl->idlecb = NULL;
-	ctrl->idletime.tv_sec = ctrl->idletime.tv_usec = 0;
-	ctrl->idlearg = NULL;
-	ctrl->xfered = 0;
-	ctrl->xfered1 = 0;
-	ctrl->cbbytes = 0;
-	if (readResponse('2', ctrl) == 0) {
-		closesocket(sControl);
-		free(ctrl->buf);
-		free(ctrl);
-		return 0;
+	return len;
+}
+
+
+
+/*
+ * zlibRead - receive compressed data and inflate it into buf
+ *
+ * Unless full is set it returns as soon as some data is ready.  Several
+ * gzip members one after the other, as left by appending to a file, are
+ * read as one stream.  The connection ending inside a member is an error.
+ *
+ * return the number of bytes stored, 0 at the end of the data, -1 on error
+ */
+static int zlibRead(char* buf, int max, int full, NetBuf_t* nData)
+{
+	z_stream* zs = nData->zs;
+	zs->next_out = (Bytef*) buf;
+	zs->avail_out = max;
+	while (zs->avail_out > 0) {
+		if (!full && ((int) zs->avail_out < max))
+			break;
+		if (zs->avail_in == 0) {
+			if (!socketWait(nData))
+				return -1;
+			int x = recv(nData->handle, nData->zbuf, nData->bufsize, 0);
+			nData->metrics.recvCalls++;
+			if ((x == -1) && (errno == EINTR)) {
+				nData->metrics.retries++;
+				continue;
+			}
+			if (x == -1)
+				return -1;
+			if (x == 0) {
+				if (!nData->zdone)
+					return -1;
+				break;
+			}
+			zs->next_in = (Bytef*) nData->zbuf;
+			zs->avail_in = x;
+		}
+		nData->zdone = 0;
+		int r = inflate(zs, Z_NO_FLUSH);
+		if (r == Z_STREAM_END) {
+			nData->zdone = 1;
+			inflateReset(zs);
+		}
+		else if ((r != Z_OK) && (r != Z_BUF_ERROR))
+			return -1;
 	}
-	*nControl = ctrl;
-	return 1;
+	return max - zs->avail_out;
 }
 
+
+
 /*
- * FtpLogin - log in to remote server
+ * zlibEnd - finish the compressed stream and free it
  *
- * return 1 if logged in, 0 otherwise
+ * A download is complete when the data ended right after a gzip member,
+ * a truncated or damaged file only shows up here.
+ *
+ * return 1 if the stream was complete, 0 otherwise
  */
-int FtpLogin(const char* user, const char* pass, NetBuf_t* nControl)
+static int zlibEnd(NetBuf_t* nData)
 {
-	char tempbuf[64];
-	if (((strlen(user) + 7) > sizeof(tempbuf)) ||
-			((strlen(pass) + 7) > sizeof(tempbuf)))
-		return 0;
-	sprintf(tempbuf,"USER %s",user);
-	if (!sendCommand(tempbuf, '3', nControl)) {
-		if (nControl->response[0] == '2')
-			return 1;
-		return 0;
+	z_stream* zs = nData->zs;
+	int rv = 1;
+	if (nData->dir == FTPLIB_WRITE) {
+		int r = Z_OK;
+		zs->next_in = NULL;
+		zs->avail_in = 0;
+		while (r == Z_OK) {
+			r = deflate(zs, Z_FINISH);
+			if (((r == Z_OK) || (r == Z_STREAM_END)) && !zlibSend(nData))
+				r = Z_STREAM_ERROR;
+		}
+		rv = (r == Z_STREAM_END);
+		deflateEnd(zs);
 	}
-	sprintf(tempbuf, "PASS %s", pass);
-	return sendCommand(tempbuf, '2', nControl);
+	else {
+		rv = nData->zdone;
+		inflateEnd(zs);
+	}
+	free(zs);
+	ftplibBufFree(nData->zbuf);
+	nData->zs = NULL;
+	nData->zbuf = NULL;
+	return rv;
 }
 
 
 
 /*
- * FtpQuit - disconnect from remote
+ * setMode - switch the session to MODE S or MODE Z
  *
- * return 1 if successful, 0 otherwise
+ * The mode stays until changed, so a command is only sent when it differs.
+ * A server refusing MODE Z is not asked again and the session stays in
+ * MODE S.  The level is only a wish, a server may ignore OPTS MODE Z.
+ *
+ * return 1 if the session is in that mode, 0 otherwise
  */
-void FtpQuit(NetBuf_t* nControl)
+static int setMode(char mode, NetBuf_t* nControl)
 {
-	if (nControl->dir != FTPLIB_CONTROL)
-		return;
-	sendCommand("QUIT", '2', nControl);
-	closesocket(nControl->handle);
-	free(nControl->buf);
-	free(nControl);
+	if (nControl->xmode == mode)
+		return 1;
+	char cmd[32];
+	sprintf(cmd, "MODE %c", mode);
+	if (!sendCommand(cmd, '2', nControl)) {
+		if ((mode == 'Z') && (nControl->response[0] == '5'))
+			nControl->feat &= ~FTPLIB_FEAT_MODEZ;
+		return 0;
+	}
+	nControl->xmode = mode;
+	if (mode == 'Z') {
+		sprintf(cmd, "OPTS MODE Z LEVEL %d", nControl->zmodez);
+		sendCommand(cmd, '2', nControl);
+	}
+	return 1;
 }
+#endif
 
 
 
 /*
- * FtpSetOptions - change connection options
+ * forgetState - drop cached session state a command may change
+ */
+static void forgetState(const char* cmd, NetBuf_t* nControl)
+{
+	if (!strncasecmp(cmd, "TYPE", 4))
+		nControl->type = 0;
+	else if (!strncasecmp(cmd, "CWD", 3) || !strncasecmp(cmd, "CDUP", 4)
+			|| !strncasecmp(cmd, "XCWD", 4) || !strncasecmp(cmd, "XCUP", 4)
+			|| !strncasecmp(cmd, "USER", 4) || !strncasecmp(cmd, "REIN", 4)) {
+		free(nControl->cwd);
+		nControl->cwd = NULL;
+		if (!strncasecmp(cmd, "USER", 4) || !strncasecmp(cmd, "REIN", 4)) {
+			nControl->type = 0;
+			nControl->xmode = 0;
+		}
+	}
+}
+
+
+
+/*
+ * parseFeature - record one line of a FEAT reply
+ */
+static void parseFeature(const char* l, NetBuf_t* nControl)
+{
+	static const struct {
+		const char* name;
+		int bit;
+	} feats[] = {
+		{ "SIZE", FTPLIB_FEAT_SIZE },
+		{ "MDTM", FTPLIB_FEAT_MDTM },
+		{ "REST STREAM", FTPLIB_FEAT_REST },
+		{ "MLST", FTPLIB_FEAT_MLST },
+		{ "EPSV", FTPLIB_FEAT_EPSV },
+		{ "UTF8", FTPLIB_FEAT_UTF8 },
+		{ "MODE Z", FTPLIB_FEAT_MODEZ },
+	};
+	while (*l == ' ')
+		l++;
+	for (unsigned int i = 0; i < sizeof(feats) / sizeof(feats[0]); i++)
+		if (!strncasecmp(l, feats[i].name, strlen(feats[i].name)))
+			nControl->feat |= feats[i].bit;
+}
+
+
+
+/*
+ * acceptConnection - accept connection from server
  *
- * returns 1 if successful, 0 on error
+ * return 1 if successful, 0 otherwise
  */
-int FtpSetOptions(int opt, long val, NetBuf_t* nControl)
+static int acceptConnection(NetBuf_t* nData, NetBuf_t* nControl)
 {
-	int v,rv = 0;
-	switch (opt)
-	{
-		case FTPLIB_CONNMODE:
-		{
-			v = (int) val;
-			if ((v == FTPLIB_PASSIVE)
-					|| (v == FTPLIB_ACTIVE)) {
-				nControl->cmode = v;
+	int rv = 0;
+	fd_set mask;
+	FD_ZERO(&mask);
+	FD_SET(nControl->handle, &mask);
+	FD_SET(nData->handle, &mask);
+	struct timeval tv;
+	tv.tv_usec = 0;
+	tv.tv_sec = FTPLIB_ACCEPT_TIMEOUT ;
+	int i = nControl->handle;
+	if (i < nData->handle)
+		i = nData->handle;
+	i = select(i+1, &mask, NULL, NULL, &tv);
+	if (i == -1) {
+		strncpy(nControl->response, strerror(errno),
+				nControl->respsize);
+		closesocket(nData->handle);
+		nData->handle = 0;
+		rv = 0;
+	}
+	else if (i == 0) {
+		strcpy(nControl->response, "FTP Client accept connection "
+				"timed out waiting for connection");
+		closesocket(nData->handle);
+		nData->handle = 0;
+		rv = 0;
+	}
+	else {
+		if (FD_ISSET(nData->handle, &mask)) {
+			struct sockaddr_storage addr;
+			//unsigned int l = sizeof(addr);
+			socklen_t l = sizeof(addr);
+			int sData = accept(nData->handle, (struct sockaddr*) &addr, &l);
+			i = errno;
+			closesocket(nData->handle);
+			if (sData > 0) {
 				rv = 1;
+				nData->handle = sData;
+			}
+			else {
+				strncpy(nControl->response, strerror(i),
+								nControl->respsize);
+				nData->handle = 0;
+				rv = 0;
 			}
 		}
-		break;
-
-		case FTPLIB_CALLBACK:
-		{
-			nControl->idlecb = (FtpCallback_t) val;
-			rv = 1;
+		else if (FD_ISSET(nControl->handle, &mask)) {
+			closesocket(nData->handle);
+			nData->handle = 0;
+			readResponse('2', nControl);
+			rv = 0;
 		}
-		break;
+	}
+	return rv;
+}
 
-		case FTPLIB_IDLETIME:
-		{
-			v = (int) val;
-			rv = 1;
-			nControl->idletime.tv_sec = v / 1000;
-			nControl->idletime.tv_usec = (v % 1000) * 1000;
-		}
-		break;
 
-		case FTPLIB_CALLBACKARG:
-		{
-			rv = 1;
-			nControl->idlearg = (void *) val;
-		}
-		break;
 
-		case FTPLIB_CALLBACKBYTES:
-		{
-			rv = 1;
-			nControl->cbbytes = (int) val;
-		}
-		break;
-	}
-	return rv;
+/*
+ * FtpSite - send a SITE command
+ *
+ * return 1 if command successful, 0 otherwise
+ */
+int FtpSite(const char* cmd, NetBuf_t* nControl)
+{
+	char buf[FTPLIB_TEMP_BUFFER_SIZE];
+	if ((strlen(cmd) + 7) > sizeof(buf))
+		return 0;
+	sprintf(buf, "SITE %s", cmd);
+	if (!sendCommand(buf, '2', nControl))
+		return 0;
+	else
+		return 1;
+}
+
+
+
+/*
+ * FtpPipeline - send a batch of commands without waiting for each reply
+ *
+ * The commands leave in as few writes as possible and their replies are
+ * matched in order; each entry receives its reply code.  Only commands
+ * answered by a single final reply belong in a batch, no data transfers.
+ *
+ * return 1 if every command got its expected response, 0 otherwise
+ */
+int FtpPipeline(FtpCommand_t* cmds, int count, NetBuf_t* nControl)
+{
+	return sendCommands(cmds, count, nControl);
+}
+
+
+
+/*
+ * FtpGetLastResponse - return a pointer to the last response received
+ */
+char* FtpGetLastResponse(NetBuf_t* nControl)
+{
+	if ((nControl) && (nControl->dir == FTPLIB_CONTROL))
+		return nControl->response;
+	else
+		return NULL;
+}
+
+
+
+/*
+ * FtpGetSysType - send a SYST command
+ *
+ * Fills in the user buffer with the remote system type.  If more
+ * information from the response is required, the user can parse
+ * it out of the response buffer returned by FtpLastResponse() after
+ * the first call; later calls answer from the session cache.
+ *
+ * return 1 if command successful, 0 otherwise
+ */
+int FtpGetSysType(char* buf, int max, NetBuf_t* nControl)
+{
+	if (nControl->syst[0] == '\0') {
+		if (!sendCommand("SYST", '2', nControl))
+			return 0;
+		char* s = &nControl->response[4];
+		int l = sizeof(nControl->syst);
+		char* b = nControl->syst;
+		while ((--l) && (*s) && (*s != ' ') && (*s != '\n'))
+			*b++ = *s++;
+		*b++ = '\0';
+	}
+	strncpy(buf, nControl->syst, max);
+	if (max > 0)
+		buf[max - 1] = '\0';
+	return 1;
+}
+
+
+
+/*
+ * FtpGetFeatures - report the extensions announced by FEAT
+ *
+ * FEAT is only sent once per session, later calls answer from the cache.
+ * A server that does not know FEAT has no extensions.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpGetFeatures(int* features, NetBuf_t* nControl)
+{
+	if (nControl->dir != FTPLIB_CONTROL)
+		return 0;
+	if (nControl->feat == -1) {
+		#if FTPLIB_DEBUG == 2
+		printf("FTP Client sendCommand: FEAT\n\r");
+		#endif
+		if (send(nControl->handle, "FEAT\r\n", 6, 0) != 6) {
+			#if FTPLIB_DEBUG
+			perror("FTP Client FtpGetFeatures: write");
+			#endif
+			return 0;
+		}
+		nControl->feat = 0;
+		if (!readReply('2', parseFeature, nControl)
+				&& (nControl->response[0] != '5')) {
+			nControl->feat = -1;
+			return 0;
+		}
+	}
+	*features = nControl->feat;
+	return 1;
+}
+
+
+
+/*
+ * FtpGetFileSize - determine the size of a remote file
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpGetFileSize(const char* path,
+		unsigned int* size, char mode, NetBuf_t* nControl)
+{
+	char cmd[FTPLIB_TEMP_BUFFER_SIZE];
+	if ((strlen(path) + 7) > sizeof(cmd))
+		return 0;
+	char type[8];
+	sprintf(type, "TYPE %c", mode);
+	sprintf(cmd,"SIZE %s", path);
+	FtpCommand_t c[2] = { { type, '2', 0 }, { cmd, '2', 0 } };
+	int cached = (nControl->type == mode);
+	int rv = sendCommands(cached ? &c[1] : c, cached ? 1 : 2, nControl);
+	if ((c[0].reply / 100) == 2)
+		nControl->type = mode;
+	/* the SIZE reply is the last one read, with or without TYPE */
+	int resp;
+	unsigned int sz;
+	if (((c[1].reply / 100) != 2)
+			|| (sscanf(nControl->response, "%d %u", &resp, &sz) != 2))
+		return 0;
+	*size = sz;
+	return rv;
+}
+
+
+
+/*
+ * FtpGetModDate - determine the modification date of a remote file
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpGetModDate(const char* path, char* dt,
+		int max, NetBuf_t* nControl)
+{
+	char buf[FTPLIB_TEMP_BUFFER_SIZE];
+	if ((strlen(path) + 7) > sizeof(buf))
+		return 0;
+	sprintf(buf, "MDTM %s", path);
+	int rv = 1;
+	if (!sendCommand(buf, '2', nControl))
+		rv = 0;
+	else
+		strncpy(dt, &nControl->response[4], max);
+	return rv;
+}
+
+
+
+/*
+ * FtpGetModTime - modification time of a remote file, seconds since the epoch
+ *
+ * Parses the MDTM reply, YYYYMMDDHHMMSS in UTC.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpGetModTime(const char* path, time_t* mtime, NetBuf_t* nControl)
+{
+	char dt[32] = "";
+	int t[6];
+	if (!FtpGetModDate(path, dt, sizeof(dt) - 1, nControl)
+			|| (sscanf(dt, "%4d%2d%2d%2d%2d%2d", &t[0], &t[1], &t[2], &t[3],
+				&t[4], &t[5]) != 6) || (t[1] < 1) || (t[1] > 12))
+		return 0;
+	*mtime = makeTime(t[0], t[1], t[2], t[3], t[4], t[5]);
+	return 1;
+}
+
+
+
+int FtpSetCallback(const FtpCallbackOptions_t* opt, NetBuf_t* nControl)
+{
+   nControl->idlecb = opt->cbFunc;
+   nControl->idlearg = opt->cbArg;
+   nControl->idletime.tv_sec = opt->idleTime / 1000;
+   nControl->idletime.tv_usec = (opt->idleTime % 1000) * 1000;
+   nControl->cbbytes = opt->bytesXferred;
+   return 1;
+}
+
+
+
+int FtpClearCallback(NetBuf_t* nControl)
+{
+   nControl->idlecb = NULL;
+   nControl->idlearg = NULL;
+   nControl->idletime.tv_sec = 0;
+   nControl->idletime.tv_usec = 0;
+   nControl->cbbytes = 0;
+   return 1;
+}
+
+
+
+/*
+ * FtpPoolInit - preallocate NetBufs and data buffers
+ *
+ * Sets aside netbufs NetBufs and buffers data buffers of bufsize bytes, up
+ * to 32 of each, once for the life of the program.  Data connections and
+ * transfers, asynchronous ones included, take their NetBuf and buffer from
+ * here instead of the heap, so long uptimes do not fragment it; once a pool
+ * is used up, or a buffer is larger than bufsize, the heap is used as
+ * before.  The control
+ * connection's reply buffers always come from the heap.
+ *
+ * return 1 if successful, 0 if out of memory or already set up
+ */
+int FtpPoolInit(int netbufs, int buffers, int bufsize)
+{
+	int state = 0;
+	if ((netbufs < 1) || (netbufs > FTPLIB_POOL_MAX) || (buffers < 1)
+			|| (buffers > FTPLIB_POOL_MAX) || (bufsize < FTPLIB_MIN_BUFFER_SIZE)
+			|| !atomic_compare_exchange_strong(&poolState, &state, 1))
+		return 0;
+	bufsize = (bufsize + 3) & ~3;
+	netbufPool.size = sizeof(NetBuf_t);
+	netbufPool.count = netbufs;
+	netbufPool.base = malloc(netbufs * sizeof(NetBuf_t));
+	bufferPool.size = bufsize;
+	bufferPool.count = buffers;
+	bufferPool.base = poolMalloc(buffers * bufsize);
+	if ((netbufPool.base == NULL) || (bufferPool.base == NULL)) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client FtpPoolInit malloc");
+		#endif
+		free(netbufPool.base);
+		free(bufferPool.base);
+		memset(&netbufPool, 0, sizeof(netbufPool));
+		memset(&bufferPool, 0, sizeof(bufferPool));
+		atomic_store(&poolState, 0);
+		return 0;
+	}
+	atomic_store(&poolState, 2);
+	return 1;
+}
+
+
+
+/*
+ * FtpGetMetrics - timings of the session and of its last data connection
+ *
+ * The transfer fields describe the last data connection opened with
+ * FtpAccess() or any call built on it, filled in when it was closed;
+ * they are cleared when the next one is opened.
+ *
+ * return 1 if successful, 0 if nControl is not a control connection
+ */
+int FtpGetMetrics(FtpMetrics_t* metrics, NetBuf_t* nControl)
+{
+	if (nControl->dir != FTPLIB_CONTROL)
+		return 0;
+	*metrics = nControl->metrics;
+	return 1;
+}
+
+
+
+static long long nowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+
+static long long nowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+/*
+ * lookupHost - ask the resolver for up to max addresses of host
+ *
+ * The families alternate, starting with the resolver's first choice, so
+ * connectAny() races an IPv6 and an IPv4 address before trying more of
+ * the same kind.
+ *
+ * return the number of addresses, 0 if there are none
+ */
+static int lookupHost(const char* host, SockAddr_t* addrs, int max)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* res;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client Error: Connect, getaddrinfo");
+		#endif
+		return 0;
+	}
+	int n = 0;
+	int family = res->ai_family;
+	while (n < max) {
+		struct addrinfo* ai = res;
+		while ((ai != NULL) && ((ai->ai_family == AF_UNSPEC)
+				|| ((ai->ai_family != family) && (n > 0))))
+			ai = ai->ai_next;
+		if (ai == NULL) {
+			/* none of this family left, any other will do */
+			for (ai = res; (ai != NULL) && (ai->ai_family == AF_UNSPEC);
+					ai = ai->ai_next)
+				;
+			if (ai == NULL)
+				break;
+		}
+		if ((ai->ai_addrlen <= sizeof(SockAddr_t))
+				&& ((ai->ai_family == AF_INET) || (ai->ai_family == AF_INET6)))
+			memcpy(&addrs[n++], ai->ai_addr, ai->ai_addrlen);
+		family = (ai->ai_family == AF_INET6) ? AF_INET : AF_INET6;
+		ai->ai_family = AF_UNSPEC;	/* taken */
+	}
+	freeaddrinfo(res);
+	return n;
+}
+
+
+
+/*
+ * ftplibResolveHost - addresses of host, from the cache while they are fresh
+ *
+ * Numeric addresses are not cached.  getaddrinfo() does not tell the
+ * record's TTL, entries are kept for FTPLIB_DNS_CACHE_TTL seconds; an
+ * expired entry is still used when the resolver does not answer.
+ *
+ * return the number of addresses, 0 if there are none
+ */
+int ftplibResolveHost(const char* host, SockAddr_t* addrs)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	struct addrinfo* res;
+	if (getaddrinfo(host, NULL, &hints, &res) == 0) {
+		int n = (res->ai_addrlen <= sizeof(SockAddr_t));
+		if (n)
+			memcpy(addrs, res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+		return n;
+	}
+	if ((FTPLIB_DEFAULT_DNS_TTL <= 0) || (strlen(host) >= FTPLIB_HOST_SIZE))
+		return lookupHost(host, addrs, FTPLIB_HOST_ADDRS);
+
+	long long now = nowMs();
+	int n = 0;
+	pthread_mutex_lock(&hostLock);
+	struct HostEntry* e = NULL;
+	for (int i = 0; i < FTPLIB_DEFAULT_DNS_ENTRIES; i++)
+		if ((hostCache[i].count > 0) && !strcmp(hostCache[i].host, host))
+			e = &hostCache[i];
+	if ((e != NULL) && (now < e->expires)) {
+		n = e->count;
+		memcpy(addrs, e->addr, n * sizeof(SockAddr_t));
+		e->used = now;
+	}
+	pthread_mutex_unlock(&hostLock);
+	if (n > 0)
+		return n;
+
+	/* the lookup may take seconds, other hosts can be served meanwhile */
+	SockAddr_t fresh[FTPLIB_HOST_ADDRS];
+	n = lookupHost(host, fresh, FTPLIB_HOST_ADDRS);
+	pthread_mutex_lock(&hostLock);
+	e = NULL;
+	for (int i = 0; i < FTPLIB_DEFAULT_DNS_ENTRIES; i++)
+		if ((hostCache[i].count > 0) && !strcmp(hostCache[i].host, host))
+			e = &hostCache[i];
+	if (n > 0) {
+		if (e == NULL) {
+			e = &hostCache[0];
+			for (int i = 1; i < FTPLIB_DEFAULT_DNS_ENTRIES; i++)
+				if (hostCache[i].used < e->used)
+					e = &hostCache[i];
+			strcpy(e->host, host);
+		}
+		e->count = n;
+		memcpy(e->addr, fresh, n * sizeof(SockAddr_t));
+		e->expires = now + FTPLIB_DEFAULT_DNS_TTL * 1000LL;
+		e->used = now;
+		memcpy(addrs, fresh, n * sizeof(SockAddr_t));
+	}
+	else if (e != NULL) {
+		n = e->count;
+		memcpy(addrs, e->addr, n * sizeof(SockAddr_t));
+		e->used = now;
+	}
+	pthread_mutex_unlock(&hostLock);
+	return n;
+}
+
+
+
+/*
+ * ftplibForgetHost - drop a cache entry none of whose addresses answered
+ */
+void ftplibForgetHost(const char* host)
+{
+	pthread_mutex_lock(&hostLock);
+	for (int i = 0; i < FTPLIB_DEFAULT_DNS_ENTRIES; i++)
+		if ((hostCache[i].count > 0) && !strcmp(hostCache[i].host, host))
+			hostCache[i].count = 0;
+	pthread_mutex_unlock(&hostLock);
+}
+
+
+
+/*
+ * ftplibSetPort - set the port of an address
+ *
+ * return the length of the address
+ */
+socklen_t ftplibSetPort(SockAddr_t* addr, uint16_t port)
+{
+	if (addr->sa.sa_family == AF_INET6) {
+		addr->in6.sin6_port = htons(port);
+		return sizeof(addr->in6);
+	}
+	addr->in.sin_port = htons(port);
+	return sizeof(addr->in);
+}
+
+
+
+/*
+ * connectAny - connect to the first address that answers
+ *
+ * The next address is tried when the previous ones failed, or have not
+ * answered within FTPLIB_CONNECT_STAGGER ms, while the earlier attempts
+ * keep going (happy eyeballs, RFC 8305).  All attempts together are
+ * given FTPLIB_CONNECT_TIMEOUT ms.  The number of addresses tried is
+ * stored at tried.
+ *
+ * return the connected, blocking socket, -1 on failure
+ */
+static int connectAny(SockAddr_t* addrs, int count, uint16_t port,
+	int* tried)
+{
+	int s[FTPLIB_HOST_ADDRS];
+	int started = 0;
+	int pending = 0;
+	int winner = -1;
+	long long now = nowMs();
+	long long deadline = now + FTPLIB_DEFAULT_CONNECT_TIMEOUT;
+	long long next = now;
+
+	while (winner == -1) {
+		if ((started < count) && ((now >= next) || (pending == 0))) {
+			SockAddr_t* a = &addrs[started];
+			socklen_t l = ftplibSetPort(a, port);
+			int sd = socket(a->sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
+			int flags = (sd == -1) ? -1 : fcntl(sd, F_GETFL, 0);
+			s[started++] = -1;
+			if ((flags == -1) || (fcntl(sd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+				if (sd != -1)
+					closesocket(sd);
+				continue;
+			}
+			if (connect(sd, &a->sa, l) == 0) {
+				winner = sd;
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				closesocket(sd);
+				continue;
+			}
+			s[started - 1] = sd;
+			pending++;
+			next = now + FTPLIB_DEFAULT_CONNECT_STAGGER;
+		}
+		if ((pending == 0) && (started == count))
+			break;
+		now = nowMs();
+		if (now >= deadline)
+			break;
+
+		long long until = ((started < count) && (next < deadline)) ?
+			next : deadline;
+		if (until < now)
+			until = now;
+		struct timeval tv;
+		tv.tv_sec = (until - now) / 1000;
+		tv.tv_usec = ((until - now) % 1000) * 1000;
+		fd_set wfd;
+		FD_ZERO(&wfd);
+		int maxfd = -1;
+		for (int i = 0; i < started; i++) {
+			if (s[i] == -1)
+				continue;
+			FD_SET(s[i], &wfd);
+			if (s[i] > maxfd)
+				maxfd = s[i];
+		}
+		int rv = (maxfd == -1) ? 0 : select(maxfd + 1, NULL, &wfd, NULL, &tv);
+		if ((rv == -1) && (errno != EINTR))
+			break;
+		for (int i = 0; (rv > 0) && (i < started); i++) {
+			if ((s[i] == -1) || !FD_ISSET(s[i], &wfd))
+				continue;
+			int err = 0;
+			socklen_t el = sizeof(err);
+			if ((getsockopt(s[i], SOL_SOCKET, SO_ERROR, &err, &el) == 0)
+					&& (err == 0)) {
+				winner = s[i];
+				s[i] = -1;
+				break;
+			}
+			closesocket(s[i]);
+			s[i] = -1;
+			pending--;
+		}
+		now = nowMs();
+	}
+
+	for (int i = 0; i < started; i++)
+		if ((s[i] != -1) && (s[i] != winner))
+			closesocket(s[i]);
+	*tried = started;
+	if (winner != -1) {
+		int flags = fcntl(winner, F_GETFL, 0);
+		fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+	}
+	#if FTPLIB_DEBUG
+	else
+		perror("FTP Client Error: Connect, connect");
+	#endif
+	return winner;
+}
+
+
+
+/*
+ * FtpConnect - connect to remote server
+ *
+ * return 1 if connected, 0 if not
+ */
+int FtpConnect(const char* host, uint16_t port, NetBuf_t** nControl)
+{
+	ftplibPoolSetup();
+	ESP_LOGD(__FUNCTION__, "host=%s", host);
+	long long t = nowUs();
+	SockAddr_t addrs[FTPLIB_HOST_ADDRS];
+	int count = ftplibResolveHost(host, addrs);
+	if (count == 0)
+		return 0;
+	long long resolved = nowUs();
+	int tried;
+	int sControl = connectAny(addrs, count, port, &tried);
+	ESP_LOGD(__FUNCTION__, "addresses=%d sControl=%d", count, sControl);
+	if (sControl == -1) {
+		ftplibForgetHost(host);
+		return 0;
+	}
+	NetBuf_t* ctrl = netbufAlloc();
+	if (ctrl == NULL) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client Error: Connect, calloc ctrl");
+		#endif
+		closesocket(sControl);
+		return 0;
+	}
+	/* replies are short, the control connection reads in response sized
+	 * chunks */
+	ctrl->respsize = ctrl->bufsize = FTPLIB_DEFAULT_RESPONSE_SIZE;
+	ctrl->buf = malloc(ctrl->bufsize);
+	ctrl->response = malloc(ctrl->respsize);
+	if ((ctrl->buf == NULL) || (ctrl->response == NULL)) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client Error: Connect, malloc ctrl->buf");
+		#endif
+		closesocket(sControl);
+		free(ctrl->buf);
+		free(ctrl->response);
+		netbufFree(ctrl);
+		return 0;
+	}
+	ctrl->response[0] = '\0';
+	ctrl->handle = sControl;
+	ctrl->dir = FTPLIB_CONTROL;
+	ctrl->ctrl = NULL;
+	ctrl->data = NULL;
+	ctrl->cmode = FTPLIB_DEFAULT_MODE;
+	ctrl->idlecb = NULL;
+	ctrl->idletime.tv_sec = ctrl->idletime.tv_usec = 0;
+	ctrl->idlearg = NULL;
+	ctrl->xfered = 0;
+	ctrl->xfered1 = 0;
+	ctrl->cbbytes = 0;
+	ctrl->type = 0;
+	ctrl->cwd = NULL;
+	ctrl->syst[0] = '\0';
+	ctrl->feat = -1;
+	ctrl->ext = -1;
+	ctrl->xfersize = FTPLIB_DEFAULT_BUFFER_SIZE;
+	ctrl->pipeline = FTPLIB_DEFAULT_PIPELINE;
+	ctrl->rcvbuf = FTPLIB_DEFAULT_RCVBUF;
+	ctrl->sndbuf = FTPLIB_DEFAULT_SNDBUF;
+	ctrl->zlevel = 0;
+	ctrl->zmodez = FTPLIB_DEFAULT_MODEZ;
+	ctrl->zwindow = FTPLIB_DEFAULT_COMPRESS_WINDOW;
+	ctrl->xmode = 'S';
+	ctrl->mlog = FTPLIB_DEFAULT_METRICS_LOG;
+	if (readResponse('2', ctrl) == 0) {
+		closesocket(sControl);
+		free(ctrl->buf);
+		free(ctrl->response);
+		netbufFree(ctrl);
+		return 0;
+	}
+	ctrl->metrics.dnsTime = resolved - t;
+	ctrl->metrics.connectTime = nowUs() - resolved;
+	ctrl->metrics.connects = tried;
+	*nControl = ctrl;
+	return 1;
+}
+
+/*
+ * FtpLogin - log in to remote server
+ *
+ * return 1 if logged in, 0 otherwise
+ */
+int FtpLogin(const char* user, const char* pass, NetBuf_t* nControl)
+{
+	char tempbuf[64];
+	if (((strlen(user) + 7) > sizeof(tempbuf)) ||
+			((strlen(pass) + 7) > sizeof(tempbuf)))
+		return 0;
+	long long t = nowUs();
+	/* PASS only goes out once the server asked for it */
+	sprintf(tempbuf,"USER %s",user);
+	int rv = sendCommand(tempbuf, '3', nControl);
+	if (rv) {
+		sprintf(tempbuf, "PASS %s", pass);
+		rv = sendCommand(tempbuf, '2', nControl);
+	}
+	else
+		rv = (nControl->response[0] == '2');
+	FtpMetrics_t* m = &nControl->metrics;
+	m->loginTime = nowUs() - t;
+	if (rv && nControl->mlog)
+		ESP_LOGI("ftplib", "session: dns %.1f ms, connect %.1f ms to %" PRIu32
+			" address(es), login %.1f ms", m->dnsTime / 1e3,
+			m->connectTime / 1e3, m->connects, m->loginTime / 1e3);
+	return rv;
+}
+
+
+
+/*
+ * FtpQuit - disconnect from remote
+ *
+ * return 1 if successful, 0 otherwise
+ */
+void FtpQuit(NetBuf_t* nControl)
+{
+	if (nControl->dir != FTPLIB_CONTROL)
+		return;
+	sendCommand("QUIT", '2', nControl);
+	closesocket(nControl->handle);
+	free(nControl->buf);
+	free(nControl->cwd);
+	free(nControl->response);
+	netbufFree(nControl);
+}
+
+
+
+/*
+ * FtpSetOptions - change connection options
+ *
+ * returns 1 if successful, 0 on error
+ */
+int FtpSetOptions(int opt, long val, NetBuf_t* nControl)
+{
+	int v,rv = 0;
+	switch (opt)
+	{
+		case FTPLIB_CONNMODE:
+		{
+			v = (int) val;
+			if ((v == FTPLIB_PASSIVE)
+					|| (v == FTPLIB_ACTIVE)) {
+				nControl->cmode = v;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTPLIB_CALLBACK:
+		{
+			nControl->idlecb = (FtpCallback_t) val;
+			rv = 1;
+		}
+		break;
+
+		case FTPLIB_IDLETIME:
+		{
+			v = (int) val;
+			rv = 1;
+			nControl->idletime.tv_sec = v / 1000;
+			nControl->idletime.tv_usec = (v % 1000) * 1000;
+		}
+		break;
+
+		case FTPLIB_CALLBACKARG:
+		{
+			rv = 1;
+			nControl->idlearg = (void *) val;
+		}
+		break;
+
+		case FTPLIB_CALLBACKBYTES:
+		{
+			rv = 1;
+			nControl->cbbytes = (int) val;
+		}
+		break;
+
+		case FTPLIB_BUFSIZE:
+		{
+			if ((nControl->dir == FTPLIB_CONTROL)
+					&& (val >= FTPLIB_MIN_BUFFER_SIZE) && (val <= INT32_MAX)) {
+				nControl->xfersize = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTPLIB_RESPSIZE:
+		{
+			char* r;
+			if ((nControl->dir == FTPLIB_CONTROL)
+					&& (val >= FTPLIB_MIN_BUFFER_SIZE) && (val <= INT32_MAX)
+					&& ((r = realloc(nControl->response, val)) != NULL)) {
+				r[val - 1] = '\0';
+				nControl->response = r;
+				nControl->respsize = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTPLIB_RCVBUF:
+		case FTPLIB_SNDBUF:
+		{
+			if ((nControl->dir == FTPLIB_CONTROL) && (val >= 0)
+					&& (val <= INT32_MAX)) {
+				if (opt == FTPLIB_RCVBUF)
+					nControl->rcvbuf = (int) val;
+				else
+					nControl->sndbuf = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTPLIB_PIPELINE:
+		{
+			if ((nControl->dir == FTPLIB_CONTROL) && (val >= 0)
+					&& (val <= FTPLIB_PIPELINE_MAX)) {
+				nControl->pipeline = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTPLIB_METRICSLOG:
+		{
+			if (nControl->dir == FTPLIB_CONTROL) {
+				nControl->mlog = (val != 0);
+				rv = 1;
+			}
+		}
+		break;
+
+#if FTPLIB_ZLIB
+		case FTPLIB_COMPRESS:
+		{
+			if ((nControl->dir == FTPLIB_CONTROL) && (val >= 0) && (val <= 9)) {
+				nControl->zlevel = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTPLIB_MODEZ:
+		{
+			if ((nControl->dir == FTPLIB_CONTROL) && (val >= 0) && (val <= 9)) {
+				nControl->zmodez = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTPLIB_COMPRESSWIN:
+		{
+			if ((nControl->dir == FTPLIB_CONTROL) && (val >= 9) && (val <= 15)) {
+				nControl->zwindow = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+#endif
+	}
+	return rv;
+}
+
+
+
+/*
+ * FtpChangeDir - change path at remote
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpChangeDir(const char* path, NetBuf_t* nControl)
+{
+	char buf[FTPLIB_TEMP_BUFFER_SIZE];
+	if ((strlen(path) + 6) > sizeof(buf))
+		return 0;
+	sprintf(buf, "CWD %s", path);
+	if (!sendCommand(buf, '2', nControl))
+		return 0;
+	else
+		return 1;
+}
+
+
+
+/*
+ * FtpMakeDir - create a directory at server
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpMakeDir(const char* path, NetBuf_t* nControl)
+{
+	char buf[FTPLIB_TEMP_BUFFER_SIZE];
+	if ((strlen(path) + 6) > sizeof(buf))
+		return 0;
+	sprintf(buf, "MKD %s", path);
+	if (!sendCommand(buf, '2', nControl))
+		return 0;
+	else
+		return 1;
+}
+
+
+
+/*
+ * FtpRemoveDir - remove directory at remote
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpRemoveDir(const char* path, NetBuf_t* nControl)
+{
+	char buf[FTPLIB_TEMP_BUFFER_SIZE];
+	if ((strlen(path) + 6) > sizeof(buf))
+		return 0;
+	sprintf(buf, "RMD %s", path);
+	if (!sendCommand(buf,'2',nControl))
+		return 0;
+	else
+		return 1;
+}
+
+
+
+/*
+ * FtpDir - issue a LIST command and write response to output
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpDir(const char* outputfile, const char* path, NetBuf_t* nControl)
+{
+	return xfer(outputfile, path, nControl, FTPLIB_DIR_VERBOSE, FTPLIB_ASCII,
+		0, 0);
+}
+
+
+
+/*
+ * FtpNlst - issue an NLST command and write response to output
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpNlst(const char* outputfile, const char* path,
+	NetBuf_t* nControl)
+{
+	return xfer(outputfile, path, nControl, FTPLIB_DIR, FTPLIB_ASCII, 0, 0);
+}
+
+
+
+/*
+ * FtpNlsd - issue an MLSD command and write response to output
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpMlsd(const char* outputfile, const char* path,
+	NetBuf_t* nControl)
+{
+	return xfer(outputfile, path, nControl, FTPLIB_MLSD, FTPLIB_ASCII, 0, 0);
+}
+
+
+
+/*
+ * makeTime - seconds since the epoch of a UTC date, month 1 to 12
+ */
+static time_t makeTime(int year, int mon, int day, int hour, int min,
+	int sec)
+{
+	/* days from the civil calendar, years start in March */
+	year -= (mon <= 2);
+	int era = ((year >= 0) ? year : year - 399) / 400;
+	int yoe = year - era * 400;
+	int doy = (153 * (mon + ((mon > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	long long days = (long long) era * 146097 + doe - 719468;
+	return (time_t) (days * 86400 + hour * 3600 + min * 60 + sec);
+}
+
+
+
+/*
+ * parseMlsd - split an MLSD line, "fact=value;fact=value; name"
+ *
+ * return 1 if the line is an entry, 0 for the directory itself and its
+ * parent or a malformed line
+ */
+static int parseMlsd(char* line, FtpEntry_t* entry)
+{
+	char* name = strchr(line, ' ');
+	if ((name == NULL) || (name[1] == '\0'))
+		return 0;
+	*name++ = '\0';
+	entry->name = name;
+	entry->type = FTPLIB_ENTRY_OTHER;
+	entry->size = -1;
+	entry->mtime = 0;
+	char* f = line;
+	while (*f) {
+		char* end = strchr(f, ';');
+		if (end != NULL)
+			*end = '\0';
+		char* v = strchr(f, '=');
+		if (v != NULL) {
+			*v++ = '\0';
+			int t[6];
+			if (!strcasecmp(f, "type")) {
+				if (!strcasecmp(v, "file"))
+					entry->type = FTPLIB_ENTRY_FILE;
+				else if (!strcasecmp(v, "dir"))
+					entry->type = FTPLIB_ENTRY_DIR;
+				else if (!strcasecmp(v, "cdir") || !strcasecmp(v, "pdir"))
+					return 0;
+				else if (!strncasecmp(v, "OS.unix=slink", 13)
+						|| !strcasecmp(v, "OS.unix=symlink"))
+					entry->type = FTPLIB_ENTRY_LINK;
+			}
+			else if (!strcasecmp(f, "size"))
+				entry->size = strtoll(v, NULL, 10);
+			else if (!strcasecmp(f, "modify") && (sscanf(v,
+					"%4d%2d%2d%2d%2d%2d", &t[0], &t[1], &t[2], &t[3], &t[4],
+					&t[5]) == 6))
+				entry->mtime = makeTime(t[0], t[1], t[2], t[3], t[4], t[5]);
+		}
+		if (end == NULL)
+			break;
+		f = end + 1;
+	}
+	return 1;
+}
+
+
+
+/*
+ * parseList - split a Unix ("-rw-r--r-- 1 owner group size Mon dd hh:mm
+ * name") or DOS ("mm-dd-yy hh:mmAM <DIR>|size name", also with yyyy-mm-dd
+ * and 24 hour times) style LIST line
+ *
+ * Times are taken as UTC.  Unix lines without a year are dated in the
+ * last twelve months.
+ *
+ * return 1 if the line is an entry, 0 otherwise
+ */
+static int parseList(char* line, FtpEntry_t* entry)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	entry->type = FTPLIB_ENTRY_OTHER;
+	entry->size = -1;
+	entry->mtime = 0;
+
+	int mon, day, year, hour, min, n = 0;
+	if ((sscanf(line, "%d-%d-%d %d:%d%n", &mon, &day, &year, &hour, &min,
+			&n) == 5) && (n > 0)) {
+		char* p = &line[n];
+		if ((*p == 'A') || (*p == 'a') || (*p == 'P') || (*p == 'p')) {
+			hour %= 12;
+			if ((*p == 'P') || (*p == 'p'))
+				hour += 12;
+			p += 2;
+		}
+		if (mon > 31) {
+			/* yyyy-mm-dd */
+			int y = mon;
+			mon = day;
+			day = year;
+			year = y;
+		}
+		year += (year < 70) ? 2000 : (year < 100) ? 1900 : 0;
+		entry->mtime = makeTime(year, mon, day, hour, min, 0);
+		p += strspn(p, " ");
+		if (!strncmp(p, "<DIR>", 5)) {
+			entry->type = FTPLIB_ENTRY_DIR;
+			p += 5;
+		}
+		else {
+			entry->type = FTPLIB_ENTRY_FILE;
+			entry->size = strtoll(p, &p, 10);
+		}
+		p += strspn(p, " ");
+		entry->name = p;
+		return *p != '\0';
+	}
+
+	/* Unix: the month name marks where size, date and name are */
+	char* tok[8];
+	int t = 0;
+	int m = -1;
+	char* p = line;
+	while ((t < 8) && (m == -1)) {
+		p += strspn(p, " ");
+		if (*p == '\0')
+			return 0;
+		tok[t] = p;
+		p += strcspn(p, " ");
+		if (*p)
+			*p++ = '\0';
+		const char* mp = (strlen(tok[t]) == 3) ? strstr(months, tok[t]) : NULL;
+		if ((t >= 3) && (mp != NULL) && (((mp - months) % 3) == 0))
+			m = t;
+		t++;
+	}
+	if (m == -1)
+		return 0;
+	mon = (strstr(months, tok[m]) - months) / 3 + 1;
+	char* d = p + strspn(p, " ");
+	char* tm = d + strcspn(d, " ");
+	tm += strspn(tm, " ");
+	char* name = tm + strcspn(tm, " ");
+	if (*name == '\0')
+		return 0;
+	name++;
+	day = atoi(d);
+	if (sscanf(tm, "%d:%d", &hour, &min) == 2) {
+		struct tm now;
+		time_t clock = time(NULL);
+		gmtime_r(&clock, &now);
+		year = now.tm_year + 1900;
+		entry->mtime = makeTime(year, mon, day, hour, min, 0);
+		if (entry->mtime > clock + 86400)
+			entry->mtime = makeTime(year - 1, mon, day, hour, min, 0);
+	}
+	else
+		entry->mtime = makeTime(atoi(tm), mon, day, 0, 0, 0);
+
+	switch (tok[0][0]) {
+		case 'd': entry->type = FTPLIB_ENTRY_DIR; break;
+		case '-': entry->type = FTPLIB_ENTRY_FILE; break;
+		case 'l': entry->type = FTPLIB_ENTRY_LINK; break;
+	}
+	entry->size = strtoll(tok[m - 1], NULL, 10);
+	if (entry->type == FTPLIB_ENTRY_LINK) {
+		char* arrow = strstr(name, " -> ");
+		if (arrow != NULL)
+			*arrow = '\0';
+	}
+	entry->name = name;
+	return strcmp(name, ".") && strcmp(name, "..");
+}
+
+
+
+/*
+ * FtpListEntries - list a directory entry by entry
+ *
+ * Uses MLSD when the server announces MLST and LIST otherwise, or when
+ * MLSD is refused.  The listing is parsed as it arrives, every entry is
+ * handed to cb without going through a file.  Lines longer than
+ * FTPLIB_TEMP_BUFFER_SIZE are cut.
+ *
+ * return 1 if the whole listing was read, 0 otherwise
+ */
+int FtpListEntries(const char* path, FtpEntryCb_t cb, void* arg,
+	NetBuf_t* nControl)
+{
+	if (cb == NULL) {
+		sprintf(nControl->response, "Missing callback for listing\n");
+		return 0;
+	}
+	int feat = 0;
+	int mlsd = FtpGetFeatures(&feat, nControl) && (feat & FTPLIB_FEAT_MLST);
+	NetBuf_t* nData;
+	if (!FtpAccess(path, mlsd ? FTPLIB_MLSD : FTPLIB_DIR_VERBOSE, FTPLIB_ASCII,
+			nControl, &nData)) {
+		if (!mlsd || (nControl->response[0] != '5'))
+			return 0;
+		mlsd = 0;
+		if (!FtpAccess(path, FTPLIB_DIR_VERBOSE, FTPLIB_ASCII, nControl,
+				&nData))
+			return 0;
+	}
+
+	char line[FTPLIB_TEMP_BUFFER_SIZE];
+	int ll = 0;
+	int rv = 1;
+	char* block;
+	int l;
+	while (rv && ((l = readBlock(&block, NULL, nData)) > 0)) {
+		if (!countXfer(l, nData)) {
+			rv = 0;
+			break;
+		}
+		char* p = block;
+		char* end = block + l;
+		while (p < end) {
+			char* nl = memchr(p, '\n', end - p);
+			int n = ((nl != NULL) ? nl : end) - p;
+			if (n > (int) sizeof(line) - 1 - ll)
+				n = sizeof(line) - 1 - ll;
+			memcpy(&line[ll], p, n);
+			ll += n;
+			if (nl == NULL)
+				break;
+			p = nl + 1;
+			if ((ll > 0) && (line[ll - 1] == '\r'))
+				ll--;
+			line[ll] = '\0';
+			ll = 0;
+			FtpEntry_t e;
+			if ((mlsd ? parseMlsd(line, &e) : parseList(line, &e))
+					&& !cb(&e, arg)) {
+				rv = 0;
+				break;
+			}
+		}
+	}
+	if (l == -1)
+		rv = 0;
+	if (rv && (ll > 0)) {
+		/* last line without a line ending */
+		line[ll] = '\0';
+		FtpEntry_t e;
+		if ((mlsd ? parseMlsd(line, &e) : parseList(line, &e)) && !cb(&e, arg))
+			rv = 0;
+	}
+	if (!FtpClose(nData))
+		rv = 0;
+	return rv;
+}
+
+
+
+/*
+ * FtpChangeDirUp - move to parent directory at remote
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpChangeDirUp(NetBuf_t* nControl)
+{
+	if (!sendCommand("CDUP", '2', nControl))
+		return 0;
+	else
+		return 1;
+}
+
+
+/*
+ * FtpPwd - get working directory at remote
+ *
+ * Only the first call after a directory change goes to the server.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpPwd(char* path, int max, NetBuf_t* nControl)
+{
+	if (nControl->cwd == NULL) {
+		if (!sendCommand("PWD",'2',nControl))
+			return 0;
+		char* s = strchr(nControl->response, '"');
+		if (s == NULL)
+			return 0;
+		s++;
+		char* e = strchr(s, '"');
+		if (e == NULL)
+			return 0;
+		if ((nControl->cwd = malloc(e - s + 1)) == NULL)
+			return 0;
+		memcpy(nControl->cwd, s, e - s);
+		nControl->cwd[e - s] = '\0';
+	}
+	int l = max;
+	char* s = nControl->cwd;
+	char* b = path;
+	while ((--l) && (*s))
+		*b++ = *s++;
+	*b++ = '\0';
+	return 1;
+}
+
+
+
+/*
+ * FtpGet - issue a GET command and write received data to output
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpGet(const char* outputfile, const char* path,
+		char mode, NetBuf_t* nControl)
+{
+	return xfer(outputfile, path, nControl, FTPLIB_FILE_READ, mode, 0, 0);
+}
+
+
+
+/*
+ * FtpPut - issue a PUT command and send data from input
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpPut(const char* inputfile, const char* path, char mode,
+	NetBuf_t* nControl)
+{
+	return xfer(inputfile, path, nControl, FTPLIB_FILE_WRITE, mode, 0, 0);
 }
 
 
 
 /*
- * FtpChangeDir - change path at remote
+ * FtpGetAt - issue a GET command starting at offset
+ *
+ * The received data overwrites outputfile from offset on.  A failed
+ * transfer keeps what was received so it can be resumed.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpChangeDir(const char* path, NetBuf_t* nControl)
+int FtpGetAt(const char* outputfile, const char* path, char mode,
+	unsigned int offset, NetBuf_t* nControl)
 {
-	char buf[FTPLIB_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 6) > sizeof(buf))
-		return 0;
-	sprintf(buf, "CWD %s", path);
-	if (!sendCommand(buf, '2', nControl))
-		return 0;
-	else
-		return 1;
+	return xfer(outputfile, path, nControl, FTPLIB_FILE_READ, mode, offset, 1);
 }
 
 
 
 /*
- * FtpMakeDir - create a directory at server
+ * FtpPutAt - issue a PUT command sending input from offset on
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpMakeDir(const char* path, NetBuf_t* nControl)
+int FtpPutAt(const char* inputfile, const char* path, char mode,
+	unsigned int offset, NetBuf_t* nControl)
 {
-	char buf[FTPLIB_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 6) > sizeof(buf))
-		return 0;
-	sprintf(buf, "MKD %s", path);
-	if (!sendCommand(buf, '2', nControl))
-		return 0;
-	else
-		return 1;
+	return xfer(inputfile, path, nControl, FTPLIB_FILE_WRITE, mode, offset, 1);
 }
 
 
 
 /*
- * FtpRemoveDir - remove directory at remote
+ * FtpGetResume - continue a download where a previous attempt stopped
+ *
+ * The local and remote sizes decide the restart offset.  A local file
+ * that is already complete is left alone, one that is longer than the
+ * remote file is fetched again from the start.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpRemoveDir(const char* path, NetBuf_t* nControl)
+int FtpGetResume(const char* outputfile, const char* path, char mode,
+	NetBuf_t* nControl)
 {
-	char buf[FTPLIB_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 6) > sizeof(buf))
+	unsigned int remote;
+	if (outputfile == NULL) {
+		sprintf(nControl->response, "Resume needs a local file\n");
 		return 0;
-	sprintf(buf, "RMD %s", path);
-	if (!sendCommand(buf,'2',nControl))
+	}
+	if (!FtpGetFileSize(path, &remote, mode, nControl))
 		return 0;
-	else
+	struct stat st;
+	unsigned int offset = 0;
+	if (stat(outputfile, &st) == 0)
+		offset = st.st_size;
+	if (offset == remote)
 		return 1;
+	if (offset > remote)
+		offset = 0;
+	return FtpGetAt(outputfile, path, mode, offset, nControl);
 }
 
 
 
 /*
- * FtpDir - issue a LIST command and write response to output
+ * FtpPutResume - continue an upload where a previous attempt stopped
+ *
+ * The remote size is the restart offset, a missing remote file starts
+ * from zero.  If the server does not implement REST the rest of the file
+ * is sent with APPE instead.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpDir(const char* outputfile, const char* path, NetBuf_t* nControl)
+int FtpPutResume(const char* inputfile, const char* path, char mode,
+	NetBuf_t* nControl)
 {
-	return xfer(outputfile, path, nControl, FTPLIB_DIR_VERBOSE, FTPLIB_ASCII);
+	struct stat st;
+	if ((inputfile == NULL) || (stat(inputfile, &st) != 0)) {
+		sprintf(nControl->response, "Resume needs a local file\n");
+		return 0;
+	}
+	unsigned int remote;
+	if (!FtpGetFileSize(path, &remote, mode, nControl))
+		remote = 0;
+	if (remote == (unsigned int) st.st_size)
+		return 1;
+	if (remote > (unsigned int) st.st_size)
+		remote = 0;
+	if (FtpPutAt(inputfile, path, mode, remote, nControl))
+		return 1;
+	/* 50x: REST not understood or not implemented */
+	if ((remote == 0) || (nControl->response[0] != '5')
+			|| (nControl->response[1] != '0'))
+		return 0;
+	return xfer(inputfile, path, nControl, FTPLIB_FILE_APPEND, mode, remote, 1);
 }
 
 
 
 /*
- * FtpNlst - issue an NLST command and write response to output
+ * FtpGetSegmented - download one file over several sessions at once
+ *
+ * The remote file is split into count byte ranges, range i is fetched
+ * with REST + RETR on nControls[i] and its data connection is dropped as
+ * soon as the range is complete.  All data connections are serviced from
+ * the calling task with select() and written at their own offset of the
+ * output file.  Ranges are never smaller than FTPLIB_SEGMENT_MIN, so
+ * small files use fewer sessions.  Transfers are always binary and every
+ * session must be logged in to the same server.  With an idle time set
+ * on the first session a download that receives nothing for that long
+ * calls its idle callback and fails unless the callback returns nonzero.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpNlst(const char* outputfile, const char* path,
-	NetBuf_t* nControl)
+int FtpGetSegmented(const char* outputfile, const char* path,
+	NetBuf_t** nControls, int count)
 {
-	return xfer(outputfile, path, nControl, FTPLIB_DIR, FTPLIB_ASCII);
+	if ((outputfile == NULL) || (count < 1)) {
+		sprintf(nControls[0]->response, "Segmented get needs a local file\n");
+		return 0;
+	}
+	unsigned int size;
+	if (!FtpGetFileSize(path, &size, FTPLIB_IMAGE, nControls[0]))
+		return 0;
+	if ((unsigned int) count > size / FTPLIB_SEGMENT_MIN)
+		count = size / FTPLIB_SEGMENT_MIN;
+	if (count <= 1)
+		return FtpGet(outputfile, path, FTPLIB_IMAGE, nControls[0]);
+
+	NetBuf_t* nData[count];
+	unsigned int pos[count];
+	unsigned int end[count];
+	memset(nData, 0, sizeof(nData));
+	FILE* local = fopen(outputfile, "wb+");
+	int chunk = nControls[0]->xfersize;
+	char* landing = ftplibBufAlloc(chunk);
+	int rv = (local != NULL) && (landing != NULL);
+	if (!rv) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client FtpGetSegmented");
+		#endif
+		snprintf(nControls[0]->response, nControls[0]->respsize,
+			"Cannot open local file %s\n", outputfile);
+	}
+	unsigned int span = size / count;
+	for (int i = 0; rv && (i < count); i++) {
+		pos[i] = i * span;
+		end[i] = (i == count - 1) ? size : pos[i] + span;
+		if (!FtpAccessAt(path, FTPLIB_FILE_READ, FTPLIB_IMAGE, pos[i],
+				nControls[i], &nData[i])) {
+			nData[i] = NULL;
+			rv = 0;
+		}
+	}
+
+	/* a stalled range ends the download like a stalled FtpRead() would,
+	 * after the idle time of the first session and its callback */
+	NetBuf_t* first = nControls[0];
+	int idle = first->idletime.tv_sec || first->idletime.tv_usec;
+	unsigned int got = 0;
+	int stalled = 0;
+	int active = rv ? count : 0;
+	unsigned int at = 0;
+	while (active > 0) {
+		fd_set fds;
+		struct timeval tv = first->idletime;
+		int maxfd = -1;
+		FD_ZERO(&fds);
+		for (int i = 0; i < count; i++) {
+			if (nData[i] == NULL)
+				continue;
+			FD_SET(nData[i]->handle, &fds);
+			if (nData[i]->handle > maxfd)
+				maxfd = nData[i]->handle;
+		}
+		int ready = select(maxfd + 1, &fds, NULL, NULL, idle ? &tv : NULL);
+		if (ready == -1) {
+			if (errno == EINTR)
+				continue;
+			rv = 0;
+			break;
+		}
+		if (ready == 0) {
+			if ((first->idlecb != NULL)
+					&& first->idlecb(first, got, first->idlearg))
+				continue;
+			stalled = 1;
+			rv = 0;
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			if ((nData[i] == NULL) || !FD_ISSET(nData[i]->handle, &fds))
+				continue;
+			int want = end[i] - pos[i];
+			if (want > chunk)
+				want = chunk;
+			int l = recv(nData[i]->handle, landing, want, 0);
+			nData[i]->metrics.recvCalls++;
+			if ((l <= 0) || ((at != pos[i])
+					&& (fseek(local, pos[i], SEEK_SET) != 0))
+					|| (fwrite(landing, 1, l, local) != (size_t) l)
+					|| !countXfer(l, nData[i])) {
+				rv = 0;
+				active = 0;
+				break;
+			}
+			pos[i] += l;
+			at = pos[i];
+			got += l;
+			if (pos[i] < end[i])
+				continue;
+			/* the last range ends with the file, the others are cut short
+			 * and answered with 426 or 226 depending on the server */
+			if (!FtpClose(nData[i]) && (i == count - 1))
+				rv = 0;
+			nData[i] = NULL;
+			active--;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+		if (nData[i] != NULL)
+			FtpClose(nData[i]);
+	ftplibBufFree(landing);
+	if (local != NULL)
+		if (fclose(local) != 0)
+			rv = 0;
+	if (!rv)
+		remove(outputfile);
+	/* after the replies to the closed data connections */
+	if (stalled)
+		snprintf(first->response, first->respsize,
+			"Segmented transfer timed out\n");
+	return rv;
 }
 
 
 
 /*
- * FtpNlsd - issue an MLSD command and write response to output
+ * FtpGetToSink - issue a GET command and hand received data to a sink
+ *
+ * The sink is called with each block where it was received, no copy is
+ * made between the socket and the sink.  It returns 0 to abort the
+ * transfer.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpMlsd(const char* outputfile, const char* path,
+int FtpGetToSink(const char* path, char mode, FtpSink_t sink, void* arg,
 	NetBuf_t* nControl)
 {
-	return xfer(outputfile, path, nControl, FTPLIB_MLSD, FTPLIB_ASCII);
+	if (sink == NULL) {
+		sprintf(nControl->response, "Missing sink for file transfer\n");
+		return 0;
+	}
+	NetBuf_t* nData;
+	if (!FtpAccess(path, FTPLIB_FILE_READ, mode, nControl, &nData))
+		return 0;
+
+	int rv = 1;
+	char* landing = NULL;
+	if ((nData->buf == NULL)
+			&& ((landing = ftplibBufAlloc(nData->bufsize)) == NULL)) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client FtpGetToSink malloc landing");
+		#endif
+		FtpClose(nData);
+		return 0;
+	}
+	char* block;
+	int l;
+	while ((l = readBlock(&block, landing, nData)) > 0) {
+		if (!countXfer(l, nData) || !sink(block, l, arg)) {
+			rv = 0;
+			break;
+		}
+	}
+	if (l == -1)
+		rv = 0;
+	ftplibBufFree(landing);
+	if (!FtpClose(nData))
+		rv = 0;
+	return rv;
 }
 
 
 
 /*
- * FtpChangeDirUp - move to parent directory at remote
+ * FtpPutFromSource - issue a PUT command and send data pulled from a source
+ *
+ * Whatever the source produces is gathered until a full buffer is ready,
+ * so small producer chunks still leave in as few sends as possible.  The
+ * source returns 0 at the end of the data and -1 to abort the transfer.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpChangeDirUp(NetBuf_t* nControl)
+int FtpPutFromSource(const char* path, char mode, FtpSource_t source,
+	void* arg, NetBuf_t* nControl)
 {
-	if (!sendCommand("CDUP", '2', nControl))
+	if (source == NULL) {
+		sprintf(nControl->response, "Missing source for file transfer\n");
 		return 0;
-	else
-		return 1;
+	}
+	int size = nControl->xfersize;
+	char* dbuf = ftplibBufAlloc(size);
+	if (dbuf == NULL) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client FtpPutFromSource malloc dbuf");
+		#endif
+		return 0;
+	}
+	NetBuf_t* nData;
+	if (!FtpAccess(path, FTPLIB_FILE_WRITE, mode, nControl, &nData)) {
+		ftplibBufFree(dbuf);
+		return 0;
+	}
+
+	int rv = 1;
+	int eof = 0;
+	while (!eof) {
+		int l = 0;
+		while (l < size) {
+			int c = source(&dbuf[l], size - l, arg);
+			if (c <= 0) {
+				if (c < 0)
+					rv = 0;
+				eof = 1;
+				break;
+			}
+			l += c;
+		}
+		if (rv == 0)
+			break;
+		if ((l > 0) && (FtpWrite(dbuf, l, nData) < l)) {
+			#if FTPLIB_DEBUG
+			perror("FTP Client FtpPutFromSource short write");
+			#endif
+			rv = 0;
+			break;
+		}
+	}
+	ftplibBufFree(dbuf);
+	if (!FtpClose(nData))
+		rv = 0;
+	return rv;
 }
 
 
+
 /*
- * FtpPwd - get working directory at remote
+ * sendMemory - send len bytes of buf on a data connection
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpPwd(char* path, int max, NetBuf_t* nControl)
+static int sendMemory(const char* buf, unsigned int len, NetBuf_t* nData)
 {
-	if (!sendCommand("PWD",'2',nControl))
-		return 0;
-	char* s = strchr(nControl->response, '"');
-	if (s == NULL)
-		return 0;
-	s++;
-	int l = max;
-	char* b = path;
-	while ((--l) && (*s) && (*s != '"'))
-		*b++ = *s++;
-	*b++ = '\0';
+	unsigned int sent = 0;
+	while (sent < len) {
+		int l = (len - sent < FTPLIB_SEND_STEP) ? (int) (len - sent)
+			: FTPLIB_SEND_STEP;
+		if (FtpWrite(&buf[sent], l, nData) < l) {
+			#if FTPLIB_DEBUG
+			perror("FTP Client sendMemory short write");
+			#endif
+			return 0;
+		}
+		sent += l;
+	}
 	return 1;
 }
 
 
 
 /*
- * FtpGet - issue a GET command and write received data to output
+ * FtpPutFromMemory - issue a PUT command and send len bytes from buf
+ *
+ * In binary mode without the gzip stage or MODE Z the bytes go from buf
+ * to send() as they are, no data buffer is taken and nothing is copied,
+ * so buf can be mapped flash.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpGet(const char* outputfile, const char* path,
-		char mode, NetBuf_t* nControl)
+int FtpPutFromMemory(const void* buf, unsigned int len, const char* path,
+	char mode, NetBuf_t* nControl)
 {
-	return xfer(outputfile, path, nControl, FTPLIB_FILE_READ, mode);
+	NetBuf_t* nData;
+	if (!FtpAccess(path, FTPLIB_FILE_WRITE, mode, nControl, &nData))
+		return 0;
+	int rv = sendMemory(buf, len, nData);
+	if (!FtpClose(nData))
+		rv = 0;
+	return rv;
 }
 
 
 
 /*
- * FtpPut - issue a PUT command and send data from input
+ * FtpPutMapped - issue a PUT command and send a mapped flash region
+ *
+ * On the device source is the label of a partition of any type, e.g. a
+ * core dump or raw data partition; on the host build it is a file.  The
+ * len bytes from offset, up to the end for a len of 0, are mapped
+ * FTPLIB_MAP_WINDOW bytes at a time and sent from the mapping with
+ * FtpPutFromMemory() semantics, so a multi-megabyte region needs neither
+ * a data buffer nor a read into one.  Transfers are always binary.
  *
  * return 1 if successful, 0 otherwise
  */
-int FtpPut(const char* inputfile, const char* path, char mode,
-	NetBuf_t* nControl)
+int FtpPutMapped(const char* source, unsigned int offset, unsigned int len,
+	const char* path, NetBuf_t* nControl)
 {
-	return xfer(inputfile, path, nControl, FTPLIB_FILE_WRITE, mode);
+	unsigned int size;
+	#if defined ESP_PLATFORM
+	const esp_partition_t* part = esp_partition_find_first(
+		ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, source);
+	if (part == NULL) {
+		snprintf(nControl->response, nControl->respsize,
+			"No partition %s\n", source);
+		return 0;
+	}
+	size = part->size;
+	#else
+	struct stat st;
+	int fd = open(source, O_RDONLY);
+	if ((fd == -1) || (fstat(fd, &st) == -1)) {
+		snprintf(nControl->response, nControl->respsize, "%s: %s\n",
+			source, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+	size = st.st_size;
+	#endif
+	if (len == 0)
+		len = (offset < size) ? size - offset : 0;
+	int rv = (offset <= size) && (len <= size - offset);
+	if (!rv)
+		snprintf(nControl->response, nControl->respsize,
+			"Region past the end of %s\n", source);
+
+	NetBuf_t* nData;
+	if (rv && !FtpAccess(path, FTPLIB_FILE_WRITE, FTPLIB_IMAGE, nControl,
+			&nData))
+		rv = 0;
+	unsigned int pos = offset;
+	unsigned int end = offset + len;
+	int opened = rv;
+	int mapped = 1;
+	while (rv && (pos < end)) {
+		/* windows start aligned for the MMU pages or mmap() */
+		unsigned int base = pos - pos % FTPLIB_MAP_WINDOW;
+		unsigned int wlen = (end - base < FTPLIB_MAP_WINDOW) ? end - base
+			: FTPLIB_MAP_WINDOW;
+		const char* map;
+		#if defined ESP_PLATFORM
+		esp_partition_mmap_handle_t handle;
+		if (esp_partition_mmap(part, base, wlen, ESP_PARTITION_MMAP_DATA,
+				(const void**) &map, &handle) != ESP_OK) {
+			rv = mapped = 0;
+			break;
+		}
+		#else
+		map = mmap(NULL, wlen, PROT_READ, MAP_SHARED, fd, base);
+		if (map == MAP_FAILED) {
+			rv = mapped = 0;
+			break;
+		}
+		#endif
+		rv = sendMemory(&map[pos - base], wlen - (pos - base), nData);
+		#if defined ESP_PLATFORM
+		esp_partition_munmap(handle);
+		#else
+		munmap((void*) map, wlen);
+		#endif
+		pos = base + wlen;
+	}
+	if (opened && !FtpClose(nData))
+		rv = 0;
+	/* after FtpClose(), which leaves the server's reply */
+	if (!mapped)
+		snprintf(nControl->response, nControl->respsize,
+			"Cannot map %s at %u\n", source, pos);
+	#if !defined ESP_PLATFORM
+	close(fd);
+	#endif
+	return rv;
 }
 
 
@@ -1109,11 +3712,11 @@ int FtpRename(const char* src, const char* dst, NetBuf_t* nControl)
 	if (((strlen(src) + 7) > sizeof(cmd)) ||
 		((strlen(dst) + 7) > sizeof(cmd)))
 		return 0;
+	char to[FTPLIB_TEMP_BUFFER_SIZE];
 	sprintf(cmd, "RNFR %s", src);
-	if (!sendCommand(cmd, '3', nControl))
-		return 0;
-	sprintf(cmd,"RNTO %s",dst);
-	if (!sendCommand(cmd, '2', nControl))
+	sprintf(to,"RNTO %s",dst);
+	FtpCommand_t c[2] = { { cmd, '3', 0 }, { to, '2', 0 } };
+	if (!sendCommands(c, 2, nControl))
 		return 0;
 	else
 		return 1;
@@ -1128,17 +3731,40 @@ int FtpRename(const char* src, const char* dst, NetBuf_t* nControl)
  */
 int FtpAccess(const char* path, int typ, int mode, NetBuf_t* nControl,
 	NetBuf_t** nData)
+{
+	return FtpAccessAt(path, typ, mode, 0, nControl, nData);
+}
+
+
+
+/*
+ * FtpAccessAt - return a handle for a data stream starting at offset
+ *
+ * TYPE is only sent when the session is in another mode, and then it is
+ * pipelined with PASV or PORT to save a round trip.
+ * A non zero offset is sent with REST right before RETR or STOR.  APPE
+ * always appends at the end of the remote file and ignores it.
+ * With FTPLIB_COMPRESS set, files are gzip compressed on the way up and
+ * decompressed on the way down; they are stored compressed on the server.
+ * Such transfers are binary and cannot start at an offset.
+ * Otherwise, with FTPLIB_MODEZ set and MODE Z in the server's FEAT reply,
+ * every transfer, listings included, is deflated on the wire only.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpAccessAt(const char* path, int typ, int mode, unsigned int offset,
+	NetBuf_t* nControl, NetBuf_t** nData)
 {
 	if ((path == NULL) &&
-		((typ == FTPLIB_FILE_WRITE) || (typ == FTPLIB_FILE_READ))) {
+		((typ == FTPLIB_FILE_WRITE) || (typ == FTPLIB_FILE_READ)
+			|| (typ == FTPLIB_FILE_APPEND))) {
 		sprintf(nControl->response,
 					"Missing path argument for file transfer\n");
 		return 0;
 	}
 	char buf[FTPLIB_TEMP_BUFFER_SIZE];
-	sprintf(buf, "TYPE %c", mode);
-	if (!sendCommand(buf, '2', nControl))
-		return 0;
+	char type[8];
+	sprintf(type, "TYPE %c", mode);
 	int dir;
 	switch (typ) {
 		case FTPLIB_DIR:
@@ -1176,6 +3802,13 @@ int FtpAccess(const char* path, int typ, int mode, NetBuf_t* nControl,
 		}
 		break;
 
+		case FTPLIB_FILE_APPEND:
+		{
+			strcpy(buf, "APPE");
+			dir = FTPLIB_WRITE;
+		}
+		break;
+
 		default:
 		{
 			sprintf(nControl->response, "Invalid open type %d\n", typ);
@@ -1183,6 +3816,17 @@ int FtpAccess(const char* path, int typ, int mode, NetBuf_t* nControl,
 		}
 	}
 
+	long long start = nowUs();
+	meterStart(buf, nControl);
+
+	int compress = (nControl->zlevel > 0) && ((typ == FTPLIB_FILE_READ)
+		|| (typ == FTPLIB_FILE_WRITE) || (typ == FTPLIB_FILE_APPEND));
+	if (compress && ((mode != FTPLIB_IMAGE) || (offset > 0))) {
+		sprintf(nControl->response,
+					"Compressed transfers are binary and start at 0\n");
+		return 0;
+	}
+
 	if (path != NULL) {
 		int i = strlen(buf);
 		buf[i++] = ' ';
@@ -1191,8 +3835,34 @@ int FtpAccess(const char* path, int typ, int mode, NetBuf_t* nControl,
 		strcpy(&buf[i], path);
 	}
 
-	if (openPort(nControl, nData, mode, dir) == -1)
+	#if FTPLIB_ZLIB
+	int feat = 0;
+	int modez = !compress && (nControl->zmodez > 0)
+		&& FtpGetFeatures(&feat, nControl) && (feat & FTPLIB_FEAT_MODEZ);
+	if (modez && !setMode('Z', nControl))
+		modez = 0;
+	if (!modez && !setMode('S', nControl))
+		return 0;
+	#endif
+
+	long long port = nowUs();
+	if (openPort(nControl, nData, mode, dir,
+			(nControl->type == mode) ? NULL : type) == -1)
 		return 0;
+	(*nData)->mstart = start;
+	if (nControl->cmode == FTPLIB_PASSIVE)
+		(*nData)->metrics.openTime = nowUs() - port;
+	nControl->type = mode;
+	if ((offset > 0) && (typ != FTPLIB_FILE_APPEND)) {
+		char rest[32];
+		sprintf(rest, "REST %u", offset);
+		if (!sendCommand(rest, '3', nControl)) {
+			FtpClose(*nData);
+			*nData = NULL;
+			return 0;
+		}
+	}
+	(*nData)->mcmd = nowUs();
 	if (!sendCommand(buf, '1', nControl)) {
 		FtpClose(*nData);
 		*nData = NULL;
@@ -1205,7 +3875,20 @@ int FtpAccess(const char* path, int typ, int mode, NetBuf_t* nControl,
 			nControl->data = NULL;
 			return 0;
 		}
+		(*nData)->metrics.openTime = nowUs() - port;
+	}
+	#if FTPLIB_ZLIB
+	int window = (dir == FTPLIB_READ) ? FTPLIB_MODEZ_WINDOW : nControl->zwindow;
+	if (compress)
+		window = nControl->zwindow + 16;
+	if ((compress || modez) && !zlibStart(window,
+			compress ? nControl->zlevel : nControl->zmodez, *nData)) {
+		FtpClose(*nData);
+		*nData = NULL;
+		sprintf(nControl->response, "Compression setup failed\n");
+		return 0;
 	}
+	#endif
 	return 1;
 }
 
@@ -1220,25 +3903,60 @@ int FtpRead(void* buf, int max, NetBuf_t* nData)
 		return 0;
 	int i = 0;
 	if (nData->buf){
-		i = readLine(buf, max, nData);
+		i = readText(buf, max, nData);
 	}
+	#if FTPLIB_ZLIB
+	else if (nData->zs != NULL)
+		i = zlibRead(buf, max, 0, nData);
+	#endif
 	else {
 		i = socketWait(nData);
 		if (i != 1)
 			return 0;
+		nData->metrics.recvCalls++;
 		i = recv(nData->handle, buf, max, 0);
 	}
 	if (i == -1)
 		return 0;
-	nData->xfered += i;
-	if (nData->idlecb && nData->cbbytes) {
-		nData->xfered1 += i;
-		if (nData->xfered1 > nData->cbbytes) {
-			if (nData->idlecb(nData, nData->xfered, nData->idlearg) == 0)
-				return 0;
-			nData->xfered1 = 0;
-		}
+	if (!countXfer(i, nData))
+		return 0;
+	return i;
+}
+
+
+
+/*
+ * FtpReadFull - read from a data connection until buf is full
+ *
+ * Unlike FtpRead() it only returns early at the end of the data, so a
+ * file written from it sees full buffers instead of one write per
+ * received segment.
+ *
+ * return the number of bytes read, 0 at the end of the data, -1 on
+ * error; what was received before an error is dropped
+ */
+int FtpReadFull(void* buf, int max, NetBuf_t* nData)
+{
+	if (nData->dir != FTPLIB_READ)
+		return -1;
+	int i = 0;
+	if (nData->buf) {
+		int x = 1;
+		while ((i < max) && ((x = readText((char*) buf + i, max - i, nData)) > 0))
+			i += x;
+		if (x == -1)
+			i = -1;
 	}
+	#if FTPLIB_ZLIB
+	else if (nData->zs != NULL)
+		i = zlibRead(buf, max, 1, nData);
+	#endif
+	else
+		i = recvFull(buf, max, nData);
+	if (i <= 0)
+		return i;
+	if (!countXfer(i, nData))
+		return -1;
 	return i;
 }
 
@@ -1246,6 +3964,9 @@ int FtpRead(void* buf, int max, NetBuf_t* nData)
 
 /*
  * FtpWrite - write to a data connection
+ *
+ * Short sends are followed up, all of buf is written unless the idle
+ * callback gives up.
  */
 int FtpWrite(const void* buf, int len, NetBuf_t* nData)
 {
@@ -1254,12 +3975,17 @@ int FtpWrite(const void* buf, int len, NetBuf_t* nData)
 		return 0;
 	if (nData->buf)
 		i = writeLine(buf, len, nData);
+	#if FTPLIB_ZLIB
+	else if (nData->zs != NULL)
+		i = zlibWrite(buf, len, nData);
+	#endif
 	else {
 		socketWait(nData);
-		i = send(nData->handle, buf, len, 0);
+		i = sendAll(buf, len, nData);
 	}
 	if (i == -1)
 		return 0;
+	meterBytes(i, nData);
 	nData->xfered += i;
 	if (nData->idlecb && nData->cbbytes) {
 		nData->xfered1 += i;
@@ -1282,24 +4008,43 @@ int FtpClose(NetBuf_t* nData)
 	{
 		case FTPLIB_WRITE:
 		case FTPLIB_READ:
+		{
+			int rv = 1;
+			#if FTPLIB_ZLIB
+			/* the end of a compressed upload is still in the stream */
+			if ((nData->zs != NULL) && !zlibEnd(nData))
+				rv = 0;
+			#endif
 			if (nData->buf)
-				free(nData->buf);
+				ftplibBufFree(nData->buf);
 			shutdown(nData->handle, 2);
 			closesocket(nData->handle);
 			NetBuf_t* ctrl = nData->ctrl;
-			free(nData);
+			FtpMetrics_t m = nData->metrics;
+			long long start = nData->mstart;
+			netbufFree(nData);
+			/* the session is closing itself */
+			if (ctrl == NULL)
+				return rv;
 			ctrl->data = NULL;
-			if (ctrl && ctrl->response[0] != '4' && ctrl->response[0] != '5')
-				return(readResponse('2', ctrl));
-			return 1;
+			if (ctrl->response[0] != '4' && ctrl->response[0] != '5')
+				rv = readResponse('2', ctrl) && rv;
+			/* a refused command closes the connection with rv still set */
+			meterEnd(&m, start, rv && (ctrl->response[0] == '2'), ctrl);
+			return rv;
+		}
 
 		case FTPLIB_CONTROL:
+			/* the open data connection must not wait for a final reply */
 			if (nData->data) {
-				nData->ctrl = NULL;
+				nData->data->ctrl = NULL;
 				FtpClose(nData->data);
 			}
 			closesocket(nData->handle);
-			free(nData);
+			free(nData->buf);
+			free(nData->cwd);
+			free(nData->response);
+			netbufFree(nData);
 			return 0;
 	}
 	return 1;
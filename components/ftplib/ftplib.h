@@ -28,16 +28,29 @@
 #define FTPLIB_H_
 
 #include <stdint.h>
+#include <time.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define FTPLIB_DEBUG 0
 
+/* defaults when there is no Kconfig, see FtpSetOptions() */
 #define FTPLIB_BUFFER_SIZE 4096
 #define FTPLIB_RESPONSE_BUFFER_SIZE 1024
 #define FTPLIB_TEMP_BUFFER_SIZE 1024
 #define FTPLIB_ACCEPT_TIMEOUT 30
+#define FTPLIB_SYST_SIZE 16
+#define FTPLIB_SEGMENT_MIN (64 * 1024)
+#define FTPLIB_CONNECT_TIMEOUT 10000 /* ms */
+#define FTPLIB_CONNECT_STAGGER 250   /* ms before racing the next address */
+#define FTPLIB_DNS_CACHE_TTL 300     /* s */
+#define FTPLIB_DNS_CACHE_SIZE 4
+#define FTPLIB_COMPRESS_WINDOW 10    /* log2 of the deflate window */
+#define FTPLIB_PIPELINE_DEPTH 0      /* xfer() ring buffers, 0 serial */
+#define FTPLIB_PIPELINE_MAX 8
+#define FTPLIB_MAP_WINDOW (512 * 1024) /* bytes mapped at once, FtpPutMapped */
+#define FTPLIB_METRICS_WINDOW 100    /* ms, peak throughput sample */
 
 /* FtpAccess() type codes */
 #define FTPLIB_DIR 1
@@ -45,6 +58,7 @@ extern "C" {
 #define FTPLIB_FILE_READ 3
 #define FTPLIB_FILE_WRITE 4
 #define FTPLIB_MLSD 5
+#define FTPLIB_FILE_APPEND 6
 
 /* FtpAccess() mode codes */
 #define FTPLIB_ASCII 'A'
@@ -52,21 +66,50 @@ extern "C" {
 #define FTPLIB_TEXT FTPLIB_ASCII
 #define FTPLIB_BINARY FTPLIB_IMAGE
 
+/* FtpEntry_t types */
+#define FTPLIB_ENTRY_OTHER 0
+#define FTPLIB_ENTRY_FILE 1
+#define FTPLIB_ENTRY_DIR 2
+#define FTPLIB_ENTRY_LINK 3
+
 /* connection modes */
 #define FTPLIB_PASSIVE 1
 #define FTPLIB_ACTIVE 2
 
+/* FtpGetFeatures() feature bits */
+#define FTPLIB_FEAT_SIZE 0x01
+#define FTPLIB_FEAT_MDTM 0x02
+#define FTPLIB_FEAT_REST 0x04
+#define FTPLIB_FEAT_MLST 0x08
+#define FTPLIB_FEAT_EPSV 0x10
+#define FTPLIB_FEAT_UTF8 0x20
+#define FTPLIB_FEAT_MODEZ 0x40
+
 /* connection option names */
 #define FTPLIB_CONNMODE 1
 #define FTPLIB_CALLBACK 2
 #define FTPLIB_IDLETIME 3
 #define FTPLIB_CALLBACKARG 4
 #define FTPLIB_CALLBACKBYTES 5
+#define FTPLIB_BUFSIZE 6   /* data buffer bytes, next transfers, also async */
+#define FTPLIB_RESPSIZE 7  /* reply buffer bytes, also async */
+#define FTPLIB_RCVBUF 8    /* data socket SO_RCVBUF, 0 for the stack default */
+#define FTPLIB_SNDBUF 9    /* data socket SO_SNDBUF, 0 for the stack default */
+#define FTPLIB_COMPRESS 10    /* gzip level 1-9 of file transfers, 0 off */
+#define FTPLIB_COMPRESSWIN 11 /* deflate window bits 9-15, next transfers */
+#define FTPLIB_MODEZ 12       /* MODE Z level 1-9 if the server has it, 0 off */
+#define FTPLIB_PIPELINE 13    /* file transfer ring of 2-8 buffers, 0 serial */
+#define FTPLIB_METRICSLOG 14  /* log FtpGetMetrics() after each transfer, 0 off */
 
 typedef struct NetBuf NetBuf_t;
 
 typedef int (*FtpCallback_t)(NetBuf_t *nControl, uint32_t xfered, void *arg);
 
+/* consumes len bytes of received data in place, returns 0 to abort */
+typedef int (*FtpSink_t)(const void *buf, int len, void *arg);
+/* fills up to max bytes at buf, returns bytecount, 0 at end, -1 to abort */
+typedef int (*FtpSource_t)(void *buf, int max, void *arg);
+
 typedef struct {
   FtpCallback_t cbFunc;      /* function to call */
   void *cbArg;               /* argument to pass to function */
@@ -74,15 +117,65 @@ typedef struct {
   unsigned int idleTime; /* callback if this many milliseconds have elapsed */
 } FtpCallbackOptions_t;
 
+/* one directory entry of FtpListEntries(), valid during the callback */
+typedef struct {
+  const char *name;
+  int type;      /* FTPLIB_ENTRY_* */
+  int64_t size;  /* -1 if unknown */
+  time_t mtime;  /* UTC, 0 if unknown */
+} FtpEntry_t;
+
+/* called once per directory entry, returns 0 to stop the listing */
+typedef int (*FtpEntryCb_t)(const FtpEntry_t *entry, void *arg);
+
+typedef struct FtpAsync FtpAsync_t;
+
+/* called from FtpPoll() when a login or transfer has finished */
+typedef void (*FtpDone_t)(FtpAsync_t *nAsync, int ok, void *arg);
+
+typedef struct {
+  const char *cmd; /* command line without CRLF, e.g. "DELE log.txt" */
+  char expresp;    /* expected first digit of the reply */
+  int reply;       /* reply code received, 0 if none */
+} FtpCommand_t;
+
+/* session and last transfer of FtpGetMetrics(), times in microseconds */
+typedef struct {
+  /* session, FtpConnect() and FtpLogin() */
+  uint32_t dnsTime;     /* name lookup, next to nothing when cached */
+  uint32_t connectTime; /* TCP connection up to the server's greeting */
+  uint32_t loginTime;   /* USER and PASS */
+  uint32_t connects;    /* addresses tried by FtpConnect() */
+  /* last data connection, from FtpAccess() to FtpClose() */
+  char cmd[5];            /* RETR, STOR, APPE, LIST, NLST or MLSD */
+  int ok;                 /* the server confirmed the transfer */
+  uint32_t openTime;      /* PASV or PORT until the data connection is up */
+  uint32_t firstByteTime; /* the command going out until the first byte */
+  uint32_t fileTime;      /* local file I/O of FtpGet() and FtpPut() */
+  uint32_t wallTime;      /* FtpAccess() until the final reply */
+  uint64_t bytes;         /* as the application sees them, not compressed */
+  uint32_t avgRate;       /* bytes/s over wallTime */
+  uint32_t peakRate;      /* bytes/s, best FTPLIB_METRICS_WINDOW ms */
+  uint32_t recvCalls;
+  uint32_t sendCalls;
+  uint32_t retries;       /* EPSV/EPRT fallbacks and interrupted calls */
+  uint32_t heapLow;       /* lowest free heap since boot, 0 on the host */
+} FtpMetrics_t;
+
 /*Miscellaneous Functions*/
 int FtpSite(const char *cmd, NetBuf_t *nControl);
+int FtpPipeline(FtpCommand_t *cmds, int count, NetBuf_t *nControl);
 char *FtpGetLastResponse(NetBuf_t *nControl);
 int FtpGetSysType(char *buf, int max, NetBuf_t *nControl);
+int FtpGetFeatures(int *features, NetBuf_t *nControl);
 int FtpGetFileSize(const char *path, unsigned int *size, char mode,
                       NetBuf_t *nControl);
 int FtpGetModDate(const char *path, char *dt, int max, NetBuf_t *nControl);
+int FtpGetModTime(const char *path, time_t *mtime, NetBuf_t *nControl);
 int FtpSetCallback(const FtpCallbackOptions_t *opt, NetBuf_t *nControl);
 int FtpClearCallback(NetBuf_t *nControl);
+int FtpPoolInit(int netbufs, int buffers, int bufsize);
+int FtpGetMetrics(FtpMetrics_t *metrics, NetBuf_t *nControl);
 /*Server connection*/
 int FtpConnect(const char *host, uint16_t port, NetBuf_t **nControl);
 int FtpLogin(const char *user, const char *pass, NetBuf_t *nControl);
@@ -95,6 +188,8 @@ int FtpRemoveDir(const char *path, NetBuf_t *nControl);
 int FtpDir(const char *outputfile, const char *path, NetBuf_t *nControl);
 int FtpNlst(const char *outputfile, const char *path, NetBuf_t *nControl);
 int FtpMlsd(const char *outputfile, const char *path, NetBuf_t *nControl);
+int FtpListEntries(const char *path, FtpEntryCb_t cb, void *arg,
+                      NetBuf_t *nControl);
 int FtpChangeDirUp(NetBuf_t *nControl);
 int FtpPwd(char *path, int max, NetBuf_t *nControl);
 /*File to File Transfer*/
@@ -102,14 +197,52 @@ int FtpGet(const char *outputfile, const char *path, char mode,
               NetBuf_t *nControl);
 int FtpPut(const char *inputfile, const char *path, char mode,
               NetBuf_t *nControl);
+int FtpGetAt(const char *outputfile, const char *path, char mode,
+                unsigned int offset, NetBuf_t *nControl);
+int FtpPutAt(const char *inputfile, const char *path, char mode,
+                unsigned int offset, NetBuf_t *nControl);
+int FtpGetResume(const char *outputfile, const char *path, char mode,
+                    NetBuf_t *nControl);
+int FtpPutResume(const char *inputfile, const char *path, char mode,
+                    NetBuf_t *nControl);
+int FtpGetSegmented(const char *outputfile, const char *path,
+                       NetBuf_t **nControls, int count);
 int FtpDelete(const char *fnm, NetBuf_t *nControl);
 int FtpRename(const char *src, const char *dst, NetBuf_t *nControl);
+/*File to Callback Transfer*/
+int FtpGetToSink(const char *path, char mode, FtpSink_t sink, void *arg,
+                    NetBuf_t *nControl);
+int FtpPutFromSource(const char *path, char mode, FtpSource_t source,
+                        void *arg, NetBuf_t *nControl);
+/*Memory and Flash to File Transfer*/
+int FtpPutFromMemory(const void *buf, unsigned int len, const char *path,
+                        char mode, NetBuf_t *nControl);
+int FtpPutMapped(const char *source, unsigned int offset, unsigned int len,
+                    const char *path, NetBuf_t *nControl);
 /*File to Program Transfer*/
 int FtpAccess(const char *path, int typ, int mode, NetBuf_t *nControl,
                  NetBuf_t **nData);
+int FtpAccessAt(const char *path, int typ, int mode, unsigned int offset,
+                   NetBuf_t *nControl, NetBuf_t **nData);
 int FtpRead(void *buf, int max, NetBuf_t *nData);
+int FtpReadFull(void *buf, int max, NetBuf_t *nData);
 int FtpWrite(const void *buf, int len, NetBuf_t *nData);
 int FtpClose(NetBuf_t *nData);
+/*Asynchronous sessions, passive and binary only*/
+int FtpAsyncConnect(const char *host, uint16_t port, const char *user,
+                       const char *pass, FtpDone_t done, void *arg,
+                       FtpAsync_t **nAsync);
+int FtpAsyncGet(const char *outputfile, const char *path, FtpAsync_t *nAsync);
+int FtpAsyncPut(const char *inputfile, const char *path, FtpAsync_t *nAsync);
+int FtpAsyncGetToSink(const char *path, FtpSink_t sink, void *arg,
+                         FtpAsync_t *nAsync);
+int FtpAsyncPutFromSource(const char *path, FtpSource_t source, void *arg,
+                             FtpAsync_t *nAsync);
+int FtpAsyncBusy(const FtpAsync_t *nAsync);
+const char *FtpAsyncLastResponse(const FtpAsync_t *nAsync);
+int FtpAsyncSetOptions(int opt, long val, FtpAsync_t *nAsync);
+int FtpPoll(FtpAsync_t **sessions, int count, int timeout);
+void FtpAsyncQuit(FtpAsync_t *nAsync);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,917 @@
+/**
+ * @file
+ * @brief ESP32-FTP-Client asynchronous sessions
+ *
+ * Non-blocking FTP sessions driven by FtpPoll().  Every session is a small
+ * state machine over a non-blocking control socket and, during a transfer,
+ * a non-blocking passive (EPSV, or PASV on IPv4 servers without it) data
+ * socket.  One task can run any number of
+ * sessions with a single select() per FtpPoll() call, so concurrent
+ * transfers no longer need a task (and a stack) each.
+ *
+ * @note
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	   http://www.apache.org/licenses/LICENSE-2.0
+ * @note
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/unistd.h>
+#include <arpa/inet.h>
+#include "ftplib.h"
+#include "ftplib_priv.h"
+
+#if !defined ESP_PLATFORM
+#define closesocket(s)					close(s)
+#endif
+
+/* session states */
+#define FTPA_CONNECT					0	/* control connect in progress */
+#define FTPA_GREETING					1	/* waiting for 220 */
+#define FTPA_USER						2	/* USER sent */
+#define FTPA_PASS						3	/* PASS sent */
+#define FTPA_IDLE						4	/* logged in, no operation */
+#define FTPA_TYPE						5	/* TYPE I sent, EPSV/PASV behind it */
+#define FTPA_PASV						6	/* EPSV or PASV sent */
+#define FTPA_OPEN						7	/* RETR/STOR sent, waiting for 1xx */
+#define FTPA_XFER						8	/* data flowing */
+#define FTPA_DEAD						9	/* login failed or connection lost */
+
+#define FTPA_READ						1
+#define FTPA_WRITE						2
+
+struct FtpAsync {
+	int state;
+	int handle;
+	int data;
+	int connecting;		/* data connect still in progress */
+	int dir;
+	int typed;			/* TYPE I already in effect */
+	int family;			/* of the control connection */
+	char* host;			/* dropped from the resolver cache if nothing answers */
+	uint16_t port;
+	int addrcount;
+	int addrnext;		/* next address to connect to */
+	SockAddr_t addrs[FTPLIB_HOST_ADDRS];
+	int ext;			/* EPSV: -1 not tried yet, 0 refused, 1 accepted */
+	int failed;			/* current operation failed, draining replies */
+	int reply;			/* final reply of the transfer, 0 until received */
+	int multi;			/* code of a multi-line reply being read */
+	int eof;			/* source exhausted */
+	char* pass;
+	FtpDone_t done;
+	void* arg;
+	FtpSink_t sink;
+	FtpSource_t source;
+	void* ioarg;
+	FILE* file;
+	char* local;		/* download to remove when it fails */
+	char* buf;			/* bufsize bytes while a transfer runs */
+	int bufsize;
+	int xfersize;		/* FTPLIB_BUFSIZE, for the next transfer */
+	int buflen, bufpos;
+	int outlen, outpos;
+	int linelen;
+	char cmd[FTPLIB_TEMP_BUFFER_SIZE];
+	char out[FTPLIB_TEMP_BUFFER_SIZE];
+	char* response;		/* respsize bytes, FTPLIB_RESPSIZE */
+	int respsize;
+};
+
+/*Internal use functions*/
+static int nonBlocking(int s);
+static int queueCommand(FtpAsync_t* nAsync, const char* fmt, const char* arg);
+static int flushCommands(FtpAsync_t* nAsync);
+static void readControl(FtpAsync_t* nAsync);
+static void onReply(FtpAsync_t* nAsync, int code);
+static int connectNext(FtpAsync_t* nAsync);
+static void openData(FtpAsync_t* nAsync);
+static void readData(FtpAsync_t* nAsync);
+static void writeData(FtpAsync_t* nAsync);
+static void closeData(FtpAsync_t* nAsync);
+static void complete(FtpAsync_t* nAsync, int ok);
+static void lose(FtpAsync_t* nAsync, const char* why);
+static int startTransfer(const char* path, int dir, FtpAsync_t* nAsync);
+static int fileSink(const void* buf, int len, void* arg);
+static int fileSource(void* buf, int max, void* arg);
+
+
+
+static int nonBlocking(int s)
+{
+	int flags = fcntl(s, F_GETFL, 0);
+	return (flags != -1) && (fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1);
+}
+
+
+
+/*
+ * queueCommand - append a command line to the outgoing control buffer
+ *
+ * return 1 if successful, 0 if the line does not fit
+ */
+static int queueCommand(FtpAsync_t* nAsync, const char* fmt, const char* arg)
+{
+	int room = sizeof(nAsync->out) - nAsync->outlen;
+	int l = snprintf(&nAsync->out[nAsync->outlen], room, fmt, arg);
+	if ((l < 0) || (l >= room)) {
+		sprintf(nAsync->response, "Command too long\n");
+		return 0;
+	}
+	nAsync->outlen += l;
+	return 1;
+}
+
+
+
+/*
+ * flushCommands - send as much of the outgoing control buffer as possible
+ *
+ * return 0 if the connection failed, 1 otherwise
+ */
+static int flushCommands(FtpAsync_t* nAsync)
+{
+	while (nAsync->outpos < nAsync->outlen) {
+		int l = send(nAsync->handle, &nAsync->out[nAsync->outpos],
+			nAsync->outlen - nAsync->outpos, 0);
+		if (l == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return 1;
+			return 0;
+		}
+		nAsync->outpos += l;
+	}
+	nAsync->outpos = nAsync->outlen = 0;
+	return 1;
+}
+
+
+
+/*
+ * readControl - collect reply lines and act on every final reply
+ */
+static void readControl(FtpAsync_t* nAsync)
+{
+	char chunk[256];
+	int l = recv(nAsync->handle, chunk, sizeof(chunk), 0);
+	if (l == -1) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return;
+		lose(nAsync, strerror(errno));
+		return;
+	}
+	if (l == 0) {
+		lose(nAsync, "Control connection closed");
+		return;
+	}
+	for (int i = 0; (i < l) && (nAsync->state != FTPA_DEAD); i++) {
+		if (nAsync->linelen < nAsync->respsize - 1)
+			nAsync->response[nAsync->linelen++] = chunk[i];
+		if (chunk[i] != '\n')
+			continue;
+		nAsync->response[nAsync->linelen] = '\0';
+		nAsync->linelen = 0;
+		char* r = nAsync->response;
+		int code = atoi(r);
+		if (nAsync->multi) {
+			/* only "xyz " with the opening code ends a multi-line reply */
+			if ((code != nAsync->multi) || (r[3] != ' '))
+				continue;
+			nAsync->multi = 0;
+		}
+		else if ((code >= 100) && (r[3] == '-')) {
+			nAsync->multi = code;
+			continue;
+		}
+		if (code >= 100)
+			onReply(nAsync, code);
+	}
+}
+
+
+
+/*
+ * onReply - advance the session state machine on a final reply
+ */
+static void onReply(FtpAsync_t* nAsync, int code)
+{
+	switch (nAsync->state) {
+		case FTPA_GREETING:
+			if ((code / 100 != 2) || !queueCommand(nAsync, "USER %s\r\n",
+					nAsync->cmd)) {
+				lose(nAsync, NULL);
+				return;
+			}
+			nAsync->state = FTPA_USER;
+			return;
+
+		case FTPA_USER:
+			if (code / 100 == 2)
+				break;
+			if ((code / 100 != 3) || !queueCommand(nAsync, "PASS %s\r\n",
+					nAsync->pass)) {
+				lose(nAsync, NULL);
+				return;
+			}
+			nAsync->state = FTPA_PASS;
+			return;
+
+		case FTPA_PASS:
+			if (code / 100 != 2) {
+				lose(nAsync, NULL);
+				return;
+			}
+			break;
+
+		case FTPA_TYPE:
+			if (code / 100 == 2)
+				nAsync->typed = 1;
+			else
+				nAsync->failed = 1;
+			nAsync->state = FTPA_PASV;
+			return;
+
+		case FTPA_PASV:
+			/* an IPv4 server without EPSV is asked again with PASV */
+			if ((nAsync->ext == -1) && (code / 100 == 5) && !nAsync->failed
+					&& (nAsync->family != AF_INET6)) {
+				nAsync->ext = 0;
+				if (!queueCommand(nAsync, "%s", "PASV\r\n"))
+					complete(nAsync, 0);
+				return;
+			}
+			if (((code != 227) && (code != 229)) || nAsync->failed) {
+				complete(nAsync, 0);
+				return;
+			}
+			if (code == 229)
+				nAsync->ext = 1;
+			openData(nAsync);
+			return;
+
+		case FTPA_OPEN:
+			if (code < 200) {
+				nAsync->state = FTPA_XFER;
+				return;
+			}
+			/* refused, or done before any preliminary reply */
+			nAsync->state = FTPA_XFER;
+			/* fall through */
+		case FTPA_XFER:
+			nAsync->reply = code;
+			if (code / 100 != 2)
+				closeData(nAsync);
+			if (nAsync->data == -1)
+				complete(nAsync, !nAsync->failed && (code / 100 == 2));
+			return;
+
+		default:
+			/* unsolicited, e.g. 421 before the server hangs up */
+			return;
+	}
+
+	/* logged in */
+	free(nAsync->pass);
+	nAsync->pass = NULL;
+	nAsync->state = FTPA_IDLE;
+	nAsync->done(nAsync, 1, nAsync->arg);
+}
+
+
+
+/*
+ * connectNext - start connecting the control connection to the next
+ * resolved address
+ *
+ * return 1 if a connect is in progress, 0 once every address failed
+ */
+static int connectNext(FtpAsync_t* nAsync)
+{
+	while (nAsync->addrnext < nAsync->addrcount) {
+		SockAddr_t* a = &nAsync->addrs[nAsync->addrnext++];
+		socklen_t l = ftplibSetPort(a, nAsync->port);
+		int sd = socket(a->sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
+		if ((sd != -1) && nonBlocking(sd) && ((connect(sd, &a->sa, l) == 0)
+				|| (errno == EINPROGRESS))) {
+			nAsync->handle = sd;
+			nAsync->family = a->sa.sa_family;
+			return 1;
+		}
+		#if FTPLIB_DEBUG
+		perror("FTP Client Error: AsyncConnect, connect");
+		#endif
+		if (sd != -1)
+			closesocket(sd);
+	}
+	return 0;
+}
+
+
+
+/*
+ * openData - connect to the EPSV or PASV address and send the transfer
+ * command
+ */
+static void openData(FtpAsync_t* nAsync)
+{
+	SockAddr_t sin;
+	socklen_t sl = sizeof(sin);
+	char* cp = strchr(nAsync->response, '(');
+	if (atoi(nAsync->response) == 229) {
+		/* (|||port|), the data goes to the control connection's peer */
+		unsigned long port = 0;
+		char* e = NULL;
+		if ((cp != NULL) && (cp[1] != '\0') && (cp[2] == cp[1])
+				&& (cp[3] == cp[1]))
+			port = strtoul(&cp[4], &e, 10);
+		if ((port == 0) || (port > 65535) || (*e != cp[1])
+				|| (getpeername(nAsync->handle, &sin.sa, &sl) == -1)) {
+			complete(nAsync, 0);
+			return;
+		}
+		sl = ftplibSetPort(&sin, port);
+	}
+	else {
+		unsigned int v[6];
+		if ((cp == NULL) || (sscanf(cp, "(%u,%u,%u,%u,%u,%u", &v[2], &v[3],
+				&v[4], &v[5], &v[0], &v[1]) != 6)) {
+			complete(nAsync, 0);
+			return;
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.in.sin_family = AF_INET;
+		sin.in.sin_port = htons((v[0] << 8) | v[1]);
+		sin.in.sin_addr.s_addr = htonl((v[2] << 24) | (v[3] << 16)
+			| (v[4] << 8) | v[5]);
+		sl = sizeof(sin.in);
+	}
+
+	nAsync->data = socket(sin.sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if ((nAsync->data == -1) || !nonBlocking(nAsync->data)) {
+		sprintf(nAsync->response, "%s\n", strerror(errno));
+		closeData(nAsync);
+		complete(nAsync, 0);
+		return;
+	}
+	nAsync->connecting = 1;
+	if (connect(nAsync->data, &sin.sa, sl) == 0)
+		nAsync->connecting = 0;
+	else if (errno != EINPROGRESS) {
+		sprintf(nAsync->response, "%s\n", strerror(errno));
+		closeData(nAsync);
+		complete(nAsync, 0);
+		return;
+	}
+	if (!queueCommand(nAsync, "%s\r\n", nAsync->cmd)) {
+		closeData(nAsync);
+		complete(nAsync, 0);
+		return;
+	}
+	nAsync->state = FTPA_OPEN;
+}
+
+
+
+/*
+ * readData - hand received data to the sink
+ */
+static void readData(FtpAsync_t* nAsync)
+{
+	int l = recv(nAsync->data, nAsync->buf, nAsync->bufsize, 0);
+	if (l == -1) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return;
+		nAsync->failed = 1;
+		l = 0;
+	}
+	else if ((l > 0) && !nAsync->sink(nAsync->buf, l, nAsync->ioarg)) {
+		nAsync->failed = 1;
+		l = 0;
+	}
+	if (l > 0)
+		return;
+	/* end of data, or aborted: the server still sends its final reply */
+	closeData(nAsync);
+	if (nAsync->reply)
+		complete(nAsync, !nAsync->failed && (nAsync->reply / 100 == 2));
+}
+
+
+
+/*
+ * writeData - send the next block pulled from the source
+ */
+static void writeData(FtpAsync_t* nAsync)
+{
+	if (nAsync->bufpos == nAsync->buflen) {
+		nAsync->bufpos = nAsync->buflen = 0;
+		while (!nAsync->eof && (nAsync->buflen < nAsync->bufsize)) {
+			int l = nAsync->source(&nAsync->buf[nAsync->buflen],
+				nAsync->bufsize - nAsync->buflen, nAsync->ioarg);
+			if (l < 0)
+				nAsync->failed = 1;
+			if (l <= 0)
+				nAsync->eof = 1;
+			else
+				nAsync->buflen += l;
+		}
+	}
+	if (!nAsync->failed && (nAsync->bufpos < nAsync->buflen)) {
+		int l = send(nAsync->data, &nAsync->buf[nAsync->bufpos],
+			nAsync->buflen - nAsync->bufpos, 0);
+		if (l >= 0) {
+			nAsync->bufpos += l;
+			return;
+		}
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return;
+		nAsync->failed = 1;
+	}
+	if (!nAsync->failed && (nAsync->bufpos < nAsync->buflen))
+		return;
+	/* all sent, or aborted: closing the data connection ends the file */
+	closeData(nAsync);
+	if (nAsync->reply)
+		complete(nAsync, !nAsync->failed && (nAsync->reply / 100 == 2));
+}
+
+
+
+static void closeData(FtpAsync_t* nAsync)
+{
+	if (nAsync->data == -1)
+		return;
+	if (nAsync->failed)
+		shutdown(nAsync->data, 2);
+	closesocket(nAsync->data);
+	nAsync->data = -1;
+	nAsync->connecting = 0;
+}
+
+
+
+/*
+ * complete - end the current operation and report it
+ */
+static void complete(FtpAsync_t* nAsync, int ok)
+{
+	closeData(nAsync);
+	if (nAsync->file != NULL) {
+		if ((fclose(nAsync->file) != 0) && (nAsync->dir == FTPA_READ))
+			ok = 0;
+		nAsync->file = NULL;
+	}
+	if (nAsync->local != NULL) {
+		if (!ok)
+			remove(nAsync->local);
+		free(nAsync->local);
+		nAsync->local = NULL;
+	}
+	ftplibBufFree(nAsync->buf);
+	nAsync->buf = NULL;
+	nAsync->state = (nAsync->handle == -1) ? FTPA_DEAD : FTPA_IDLE;
+	nAsync->done(nAsync, ok, nAsync->arg);
+}
+
+
+
+/*
+ * lose - give up on the session after a protocol or connection error
+ */
+static void lose(FtpAsync_t* nAsync, const char* why)
+{
+	if (why != NULL)
+		snprintf(nAsync->response, nAsync->respsize, "%s\n", why);
+	if (nAsync->handle != -1)
+		closesocket(nAsync->handle);
+	nAsync->handle = -1;
+	nAsync->failed = 1;
+	if (nAsync->state == FTPA_IDLE)
+		nAsync->state = FTPA_DEAD;
+	else
+		complete(nAsync, 0);
+}
+
+
+
+/*
+ * startTransfer - pipeline TYPE (first time only) and EPSV or PASV for a
+ * transfer
+ *
+ * return 1 if the transfer was started, 0 otherwise
+ */
+static int startTransfer(const char* path, int dir, FtpAsync_t* nAsync)
+{
+	if (nAsync->state != FTPA_IDLE) {
+		sprintf(nAsync->response, "Session busy\n");
+		return 0;
+	}
+	if ((strlen(path) + 6) >= sizeof(nAsync->cmd)) {
+		sprintf(nAsync->response, "Path too long\n");
+		return 0;
+	}
+	nAsync->bufsize = nAsync->xfersize;
+	nAsync->buf = ftplibBufAlloc(nAsync->bufsize);
+	if (nAsync->buf == NULL) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client startTransfer malloc");
+		#endif
+		return 0;
+	}
+	sprintf(nAsync->cmd, "%s %s", dir == FTPA_READ ? "RETR" : "STOR", path);
+	if ((!nAsync->typed && !queueCommand(nAsync, "%s", "TYPE I\r\n"))
+			|| !queueCommand(nAsync, "%s",
+				(nAsync->ext != 0) ? "EPSV\r\n" : "PASV\r\n")) {
+		ftplibBufFree(nAsync->buf);
+		nAsync->buf = NULL;
+		return 0;
+	}
+	nAsync->dir = dir;
+	nAsync->failed = 0;
+	nAsync->reply = 0;
+	nAsync->eof = 0;
+	nAsync->buflen = nAsync->bufpos = 0;
+	nAsync->state = nAsync->typed ? FTPA_PASV : FTPA_TYPE;
+	return 1;
+}
+
+
+
+static int fileSink(const void* buf, int len, void* arg)
+{
+	return fwrite(buf, 1, len, arg) == (size_t) len;
+}
+
+
+
+static int fileSource(void* buf, int max, void* arg)
+{
+	size_t l = fread(buf, 1, max, arg);
+	return ((l == 0) && ferror((FILE*) arg)) ? -1 : (int) l;
+}
+
+
+
+/*
+ * FtpAsyncConnect - start connecting and logging in to a server
+ *
+ * The host name goes through the resolver cache of FtpConnect(), so only
+ * a lookup that is not cached yet blocks; the addresses are then tried
+ * one after the other and the rest happens in FtpPoll().  done
+ * is called with ok set once the login finished or failed, and again at
+ * the end of every transfer started on the session.
+ *
+ * return 1 if the session was started, 0 otherwise
+ */
+int FtpAsyncConnect(const char* host, uint16_t port, const char* user,
+	const char* pass, FtpDone_t done, void* arg, FtpAsync_t** nAsync)
+{
+	if ((done == NULL) || (strlen(user) + 8 >= FTPLIB_TEMP_BUFFER_SIZE))
+		return 0;
+	ftplibPoolSetup();
+	FtpAsync_t* a = calloc(1, sizeof(FtpAsync_t));
+	if ((a == NULL) || ((a->pass = strdup(pass)) == NULL)
+			|| ((a->host = strdup(host)) == NULL)
+			|| ((a->response = calloc(1, FTPLIB_DEFAULT_RESPONSE_SIZE))
+				== NULL)) {
+		#if FTPLIB_DEBUG
+		perror("FTP Client Error: AsyncConnect, calloc");
+		#endif
+		if (a != NULL) {
+			free(a->pass);
+			free(a->host);
+		}
+		free(a);
+		return 0;
+	}
+	a->respsize = FTPLIB_DEFAULT_RESPONSE_SIZE;
+	a->xfersize = FTPLIB_DEFAULT_BUFFER_SIZE;
+	a->port = port;
+	a->addrcount = ftplibResolveHost(host, a->addrs);
+	/* the connect is still in progress, FtpPoll() moves on to the next
+	 * address when it fails */
+	if (!connectNext(a)) {
+		if (a->addrcount > 0)
+			ftplibForgetHost(host);
+		free(a->response);
+		free(a->host);
+		free(a->pass);
+		free(a);
+		return 0;
+	}
+	strcpy(a->cmd, user);
+	a->data = -1;
+	a->ext = -1;
+	a->state = FTPA_CONNECT;
+	a->done = done;
+	a->arg = arg;
+	*nAsync = a;
+	return 1;
+}
+
+
+
+/*
+ * FtpAsyncGet - start downloading a file, binary mode
+ *
+ * return 1 if the transfer was started, 0 otherwise
+ */
+int FtpAsyncGet(const char* outputfile, const char* path, FtpAsync_t* nAsync)
+{
+	if (nAsync->state != FTPA_IDLE) {
+		sprintf(nAsync->response, "Session busy\n");
+		return 0;
+	}
+	FILE* f = fopen(outputfile, "wb");
+	if (f == NULL) {
+		sprintf(nAsync->response, "Cannot open local file\n");
+		return 0;
+	}
+	if ((nAsync->local = strdup(outputfile)) == NULL
+			|| !FtpAsyncGetToSink(path, fileSink, f, nAsync)) {
+		free(nAsync->local);
+		nAsync->local = NULL;
+		fclose(f);
+		remove(outputfile);
+		return 0;
+	}
+	nAsync->file = f;
+	return 1;
+}
+
+
+
+/*
+ * FtpAsyncPut - start uploading a file, binary mode
+ *
+ * return 1 if the transfer was started, 0 otherwise
+ */
+int FtpAsyncPut(const char* inputfile, const char* path, FtpAsync_t* nAsync)
+{
+	if (nAsync->state != FTPA_IDLE) {
+		sprintf(nAsync->response, "Session busy\n");
+		return 0;
+	}
+	FILE* f = fopen(inputfile, "rb");
+	if (f == NULL) {
+		sprintf(nAsync->response, "Cannot open local file\n");
+		return 0;
+	}
+	if (!FtpAsyncPutFromSource(path, fileSource, f, nAsync)) {
+		fclose(f);
+		return 0;
+	}
+	nAsync->file = f;
+	return 1;
+}
+
+
+
+/*
+ * FtpAsyncGetToSink - start downloading a file into a sink, binary mode
+ *
+ * The sink is called from FtpPoll() with every block received.
+ *
+ * return 1 if the transfer was started, 0 otherwise
+ */
+int FtpAsyncGetToSink(const char* path, FtpSink_t sink, void* arg,
+	FtpAsync_t* nAsync)
+{
+	if (!startTransfer(path, FTPA_READ, nAsync))
+		return 0;
+	nAsync->sink = sink;
+	nAsync->ioarg = arg;
+	return 1;
+}
+
+
+
+/*
+ * FtpAsyncPutFromSource - start uploading data pulled from a source
+ *
+ * The source is called from FtpPoll() whenever the data connection can
+ * take another block, with the same contract as for FtpPutFromSource().
+ *
+ * return 1 if the transfer was started, 0 otherwise
+ */
+int FtpAsyncPutFromSource(const char* path, FtpSource_t source, void* arg,
+	FtpAsync_t* nAsync)
+{
+	if (!startTransfer(path, FTPA_WRITE, nAsync))
+		return 0;
+	nAsync->source = source;
+	nAsync->ioarg = arg;
+	return 1;
+}
+
+
+
+/*
+ * FtpAsyncBusy - tell whether a login or transfer is in progress
+ */
+int FtpAsyncBusy(const FtpAsync_t* nAsync)
+{
+	return (nAsync->state != FTPA_IDLE) && (nAsync->state != FTPA_DEAD);
+}
+
+
+
+/*
+ * FtpAsyncLastResponse - return the last reply or error of a session
+ */
+const char* FtpAsyncLastResponse(const FtpAsync_t* nAsync)
+{
+	return nAsync->response;
+}
+
+
+
+/*
+ * FtpAsyncSetOptions - change session options
+ *
+ * Takes FTPLIB_BUFSIZE, used from the next transfer on, and
+ * FTPLIB_RESPSIZE, with the same limits as FtpSetOptions().
+ *
+ * returns 1 if successful, 0 on error
+ */
+int FtpAsyncSetOptions(int opt, long val, FtpAsync_t* nAsync)
+{
+	int rv = 0;
+	if ((val < FTPLIB_MIN_BUFFER_SIZE) || (val > INT32_MAX))
+		return 0;
+	switch (opt)
+	{
+		case FTPLIB_BUFSIZE:
+		{
+			nAsync->xfersize = (int) val;
+			rv = 1;
+		}
+		break;
+
+		case FTPLIB_RESPSIZE:
+		{
+			char* r = realloc(nAsync->response, val);
+			if (r != NULL) {
+				r[val - 1] = '\0';
+				nAsync->response = r;
+				nAsync->respsize = (int) val;
+				/* a reply line being read is cut like any long one */
+				if (nAsync->linelen > nAsync->respsize - 1)
+					nAsync->linelen = nAsync->respsize - 1;
+				rv = 1;
+			}
+		}
+		break;
+	}
+	return rv;
+}
+
+
+
+/*
+ * FtpPoll - drive a set of sessions
+ *
+ * Waits up to timeout milliseconds (-1 forever) for any of the sessions'
+ * sockets, then runs every session that can make progress.  Completion
+ * callbacks are called from here; they may start the next transfer on
+ * their session but must not quit it.  NULL entries are skipped.
+ *
+ * return the number of sessions still busy, -1 on error
+ */
+int FtpPoll(FtpAsync_t** sessions, int count, int timeout)
+{
+	if (count < 1)
+		return 0;
+	fd_set rfd, wfd;
+	int maxfd = -1;
+	int data[count];
+	FD_ZERO(&rfd);
+	FD_ZERO(&wfd);
+	for (int i = 0; i < count; i++) {
+		FtpAsync_t* a = sessions[i];
+		data[i] = -1;
+		if ((a == NULL) || (a->state == FTPA_DEAD))
+			continue;
+		if ((a->state == FTPA_CONNECT) || (a->outpos < a->outlen))
+			FD_SET(a->handle, &wfd);
+		if (a->state != FTPA_CONNECT)
+			FD_SET(a->handle, &rfd);
+		if (a->handle > maxfd)
+			maxfd = a->handle;
+		if (a->data == -1)
+			continue;
+		if (a->connecting || ((a->dir == FTPA_WRITE) && (a->state == FTPA_XFER)))
+			FD_SET(a->data, &wfd);
+		else if (a->dir == FTPA_READ)
+			FD_SET(a->data, &rfd);
+		else
+			continue;
+		data[i] = a->data;
+		if (a->data > maxfd)
+			maxfd = a->data;
+	}
+	if (maxfd == -1)
+		return 0;
+
+	struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+	if (select(maxfd + 1, &rfd, &wfd, NULL, timeout < 0 ? NULL : &tv) == -1) {
+		if (errno != EINTR)
+			return -1;
+		FD_ZERO(&rfd);
+		FD_ZERO(&wfd);
+	}
+
+	int busy = 0;
+	for (int i = 0; i < count; i++) {
+		FtpAsync_t* a = sessions[i];
+		if ((a == NULL) || (a->state == FTPA_DEAD))
+			continue;
+		if (a->state == FTPA_CONNECT) {
+			if (FD_ISSET(a->handle, &wfd)) {
+				int err = 0;
+				socklen_t l = sizeof(err);
+				getsockopt(a->handle, SOL_SOCKET, SO_ERROR, &err, &l);
+				if (err == 0)
+					a->state = FTPA_GREETING;
+				else {
+					closesocket(a->handle);
+					a->handle = -1;
+					if (!connectNext(a)) {
+						ftplibForgetHost(a->host);
+						lose(a, strerror(err));
+					}
+				}
+			}
+		}
+		else {
+			if (FD_ISSET(a->handle, &rfd))
+				readControl(a);
+			if ((a->state != FTPA_DEAD) && !flushCommands(a))
+				lose(a, strerror(errno));
+		}
+		/* the data socket may have been replaced by a callback above */
+		if ((data[i] != -1) && (a->data == data[i])) {
+			if (a->connecting && FD_ISSET(a->data, &wfd)) {
+				int err = 0;
+				socklen_t l = sizeof(err);
+				getsockopt(a->data, SOL_SOCKET, SO_ERROR, &err, &l);
+				a->connecting = 0;
+				if (err != 0) {
+					/* the server still answers the transfer command */
+					a->failed = 1;
+					closeData(a);
+				}
+			}
+			else if (FD_ISSET(a->data, &rfd))
+				readData(a);
+			else if (FD_ISSET(a->data, &wfd))
+				writeData(a);
+		}
+		if (FtpAsyncBusy(a))
+			busy++;
+	}
+	return busy;
+}
+
+
+
+/*
+ * FtpAsyncQuit - close a session and release it
+ *
+ * A transfer still in progress is dropped, its done callback is not
+ * called.
+ */
+void FtpAsyncQuit(FtpAsync_t* nAsync)
+{
+	if (nAsync == NULL)
+		return;
+	if (nAsync->state >= FTPA_IDLE && nAsync->state != FTPA_DEAD)
+		send(nAsync->handle, "QUIT\r\n", 6, 0);
+	nAsync->failed = 1;
+	closeData(nAsync);
+	if (nAsync->file != NULL)
+		fclose(nAsync->file);
+	if (nAsync->local != NULL)
+		remove(nAsync->local);
+	free(nAsync->local);
+	ftplibBufFree(nAsync->buf);
+	free(nAsync->response);
+	free(nAsync->host);
+	free(nAsync->pass);
+	if (nAsync->handle != -1)
+		closesocket(nAsync->handle);
+	free(nAsync);
+}
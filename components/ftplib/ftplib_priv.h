@@ -0,0 +1,64 @@
+/**
+ * @file
+ * @brief ESP32-FTP-Client internals shared by ftplib.c and ftplib_async.c
+ *
+ * Not part of the API, applications include ftplib.h only.
+ *
+ * @note
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	   http://www.apache.org/licenses/LICENSE-2.0
+ * @note
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FTPLIB_PRIV_H_
+#define FTPLIB_PRIV_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#if defined ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+/* per session defaults, see FtpSetOptions() */
+#if defined CONFIG_FTPLIB_BUFFER_SIZE
+#define FTPLIB_DEFAULT_BUFFER_SIZE		CONFIG_FTPLIB_BUFFER_SIZE
+#define FTPLIB_DEFAULT_RESPONSE_SIZE	CONFIG_FTPLIB_RESPONSE_BUFFER_SIZE
+#define FTPLIB_DEFAULT_RCVBUF			CONFIG_FTPLIB_SO_RCVBUF
+#define FTPLIB_DEFAULT_SNDBUF			CONFIG_FTPLIB_SO_SNDBUF
+#else
+#define FTPLIB_DEFAULT_BUFFER_SIZE		FTPLIB_BUFFER_SIZE
+#define FTPLIB_DEFAULT_RESPONSE_SIZE	FTPLIB_RESPONSE_BUFFER_SIZE
+#define FTPLIB_DEFAULT_RCVBUF			0
+#define FTPLIB_DEFAULT_SNDBUF			0
+#endif
+#define FTPLIB_MIN_BUFFER_SIZE			256
+
+#define FTPLIB_HOST_ADDRS				4
+
+typedef union {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+} SockAddr_t;
+
+/* host names through the resolver cache, see FtpConnect() */
+int ftplibResolveHost(const char* host, SockAddr_t* addrs);
+void ftplibForgetHost(const char* host);
+socklen_t ftplibSetPort(SockAddr_t* addr, uint16_t port);
+
+/* data buffers, from the FtpPoolInit() pool when it fits a block */
+void ftplibPoolSetup(void);
+char* ftplibBufAlloc(int size);
+void ftplibBufFree(char* buf);
+
+#endif /* FTPLIB_PRIV_H_ */
@@ -0,0 +1,66 @@
+/**
+ * @file
+ * @brief Filesystem throughput benchmark for the host build
+ *
+ * Runs ftp_storage_bench(), the benchmark the device runs on its storage
+ * partition, on one or more host directories.  Pointing it at filesystem
+ * images mounted on the host (a FAT image on a loop device, a LittleFS image
+ * through littlefs-fuse) compares the backends with their own on-disk
+ * format; the flash itself is not emulated.  The capacity defaults to the
+ * size of the filesystem holding the directory, which for an image is the
+ * image size.
+ *
+ * usage: fs_bench [-s file_size] [-c capacity] dir [dir ...]
+ *   -s  bytes written and read back per run (256 KB)
+ *   -c  capacity the fill levels are relative to
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+#include "ftp_storage.h"
+
+#define FS_BENCH_FILE_SIZE	(256L * 1024)
+
+int main(int argc, char *argv[])
+{
+	long size = FS_BENCH_FILE_SIZE;
+	long capacity = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+		switch (opt) {
+			case 's': size = strtol(optarg, NULL, 0); break;
+			case 'c': capacity = strtol(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-s file_size] [-c capacity] "
+					"dir [dir ...]\n", argv[0]);
+				return 2;
+		}
+	}
+	if ((optind >= argc) || (size <= 0)) {
+		fprintf(stderr, "usage: %s [-s file_size] [-c capacity] "
+			"dir [dir ...]\n", argv[0]);
+		return 2;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		long cap = capacity;
+		struct statvfs st;
+		if (cap <= 0) {
+			if (statvfs(argv[i], &st) != 0) {
+				perror(argv[i]);
+				return 1;
+			}
+			cap = (long) (st.f_blocks * st.f_frsize);
+		}
+		if (cap < size) {
+			fprintf(stderr, "fs_bench: %s holds less than one %ld byte file\n",
+				argv[i], size);
+			return 1;
+		}
+		ftp_storage_bench(argv[i], size, cap);
+	}
+	return 0;
+}
@@ -0,0 +1,619 @@
+/**
+ * @file
+ * @brief ftplib throughput and latency benchmark for the host build
+ *
+ * Starts the loopback server stand-in on a scratch directory, measures the
+ * round trip of the common control commands and then times FtpPut/FtpGet
+ * for transfer sizes from 4 KB up to 64 MB.  The sink column downloads with
+ * FtpGetToSink into a sink that only counts the bytes, the source column
+ * uploads with FtpPutFromSource from a producer handing out 512 byte chunks.
+ * With -s the seg column downloads with FtpGetSegmented over that many
+ * sessions and the async column runs that many FtpAsyncGetToSink downloads
+ * of the file at once from this thread, reporting the combined rate.
+ * With -w the transfer table is replaced by a sweep of the data buffer and
+ * socket buffer sizes set with FtpSetOptions().
+ * With -z every transfer goes through the gzip stage and the stored column
+ * shows the size of the file on the server against the original.
+ * With -d the put and get columns move the local file through a ring of
+ * that many buffers and a second task.
+ * With -o the ota column streams the file with ftp_ota_run() into a slot
+ * file, hashing it on the way.
+ * With -M the map column uploads the local file with FtpPutMapped(), sent
+ * straight from the mapping instead of through the data buffer.
+ * With -x every row is followed by FtpGetMetrics() of its last put and get.
+ *
+ * usage: ftp_bench [-a] [-t] [-l rtt_ms] [-m max_bytes] [-n iterations]
+ *                  [-s sessions] [-b bufsize] [-r sockbuf] [-w] [-p]
+ *                  [-z level] [-d depth] [-o] [-M] [-x]
+ *   -a  active (PORT) data connections instead of passive
+ *   -t  ASCII transfers instead of binary
+ *   -l  emulated control channel round trip time
+ *   -s  sessions for the segmented download column
+ *   -b  data buffer size (FTPLIB_BUFSIZE)
+ *   -r  data socket SO_RCVBUF and SO_SNDBUF, 0 for the default
+ *   -w  sweep buffer sizes with transfers of up to max_bytes (16 MB)
+ *   -p  take NetBufs and data buffers from FtpPoolInit() instead of the heap
+ *   -z  gzip compression level (FTPLIB_COMPRESS), binary only, no -s
+ *   -d  pipeline depth (FTPLIB_PIPELINE), 0 for serial transfers
+ *   -o  OTA download column, binary only, no -z, needs OpenSSL
+ *   -M  mapped upload column, always binary
+ *   -x  transfer metrics of the last put and get of each size
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ftplib.h"
+#include "ftpd_stub.h"
+#if FTP_BENCH_OTA
+#include "ftp_ota.h"
+#endif
+
+#define BENCH_MIN_SIZE		(4L * 1024)
+#define BENCH_MAX_SIZE		(64L * 1024 * 1024)
+#define BENCH_MIN_VOLUME	(32L * 1024 * 1024)
+#define BENCH_MAX_RUNS		64
+#define BENCH_MAX_SESSIONS	8
+#define BENCH_SWEEP_SIZE	(16L * 1024 * 1024)
+
+static char scratch[] = "/tmp/ftp_benchXXXXXX";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, NetBuf_t *nControl)
+{
+	fprintf(stderr, "ftp_bench: %s failed: %s\n", what,
+		nControl ? FtpGetLastResponse(nControl) : "");
+	exit(1);
+}
+
+/*
+ * makeFile - create a local file of len bytes of printable text
+ *
+ * Text with regular line breaks keeps ASCII and binary runs comparable.
+ */
+static void makeFile(const char *path, long len)
+{
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	char line[64];
+	for (int i = 0; i < (int) sizeof(line) - 1; i++)
+		line[i] = 'a' + i % 26;
+	line[sizeof(line) - 1] = '\n';
+	for (long o = 0; o < len; o += sizeof(line))
+		fwrite(line, 1, (len - o) < (long) sizeof(line) ? (size_t) (len - o)
+			: sizeof(line), f);
+	fclose(f);
+}
+
+static long fileSize(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 ? (long) st.st_size : -1;
+}
+
+/* 1 if both files hold the same bytes, like cmp(1) */
+static int sameFile(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	int same = (fa != NULL) && (fb != NULL);
+	while (same) {
+		char ba[8192], bb[sizeof(ba)];
+		size_t la = fread(ba, 1, sizeof(ba), fa);
+		size_t lb = fread(bb, 1, sizeof(bb), fb);
+		same = (la == lb) && (memcmp(ba, bb, la) == 0);
+		if (la == 0)
+			break;
+	}
+	if (fa != NULL)
+		fclose(fa);
+	if (fb != NULL)
+		fclose(fb);
+	return same;
+}
+
+static int countSink(const void *buf, int len, void *arg)
+{
+	(void) buf;
+	*(long *) arg += len;
+	return 1;
+}
+
+/* produces remaining bytes of text in small chunks, like a sensor ring */
+static int countEntry(const FtpEntry_t *entry, void *arg)
+{
+	(void) entry;
+	(*(int *) arg)++;
+	return 1;
+}
+
+static int textSource(void *buf, int max, void *arg)
+{
+	static char chunk[512];
+	long *remaining = arg;
+	if (chunk[0] == '\0')
+		for (int i = 0; i < (int) sizeof(chunk); i++)
+			chunk[i] = (i & 63) == 63 ? '\n' : 'a' + i % 26;
+	int l = max < (int) sizeof(chunk) ? max : (int) sizeof(chunk);
+	if (l > *remaining)
+		l = *remaining;
+	memcpy(buf, chunk, l);
+	*remaining -= l;
+	return l;
+}
+
+/* one line of FtpGetMetrics() after a transfer table row */
+static void printMetrics(const FtpMetrics_t *m)
+{
+	printf("        %s  open %.2f ms  first byte %.2f ms  file %.2f ms"
+		"  peak %.2f MB/s  %u recv  %u send\n", m->cmd, m->openTime / 1e3,
+		m->firstByteTime / 1e3, m->fileTime / 1e3,
+		m->peakRate / (1024.0 * 1024), (unsigned) m->recvCalls,
+		(unsigned) m->sendCalls);
+}
+
+static void asyncDone(FtpAsync_t *nAsync, int ok, void *arg)
+{
+	(void) nAsync;
+	if (!ok)
+		*(int *) arg = 1;
+}
+
+/* runs count downloads of path at once, all driven from this thread */
+static void asyncGet(FtpAsync_t **sessions, int count, const char *path,
+	long *sunk)
+{
+	for (int i = 0; i < count; i++)
+		if (!FtpAsyncGetToSink(path, countSink, sunk, sessions[i])) {
+			fprintf(stderr, "ftp_bench: FtpAsyncGetToSink failed: %s\n",
+				FtpAsyncLastResponse(sessions[i]));
+			exit(1);
+		}
+	int busy;
+	while ((busy = FtpPoll(sessions, count, -1)) > 0)
+		;
+	if (busy < 0) {
+		perror("FtpPoll");
+		exit(1);
+	}
+}
+
+/* put and get size bytes for every data buffer and socket buffer size */
+static void sweep(NetBuf_t *nControl, const char *local, const char *fetched,
+	long size, char mode)
+{
+	static const long bufsizes[] = { 1024, 2048, 4096, 8192, 16384, 32768 };
+	static const long sockbufs[] = { 0, 16384, 65536, 262144 };
+	int runs = BENCH_MIN_VOLUME / size;
+	if (runs < 1)
+		runs = 1;
+	if (runs > BENCH_MAX_RUNS)
+		runs = BENCH_MAX_RUNS;
+	makeFile(local, size);
+
+	printf("\nbuffer sweep, %ld KB transfers, %d runs\n", size / 1024, runs);
+	printf("   bufsize   sockbuf   put MB/s   get MB/s\n");
+	for (size_t s = 0; s < sizeof(sockbufs) / sizeof(sockbufs[0]); s++) {
+		for (size_t b = 0; b < sizeof(bufsizes) / sizeof(bufsizes[0]); b++) {
+			FtpSetOptions(FTPLIB_BUFSIZE, bufsizes[b], nControl);
+			FtpSetOptions(FTPLIB_RCVBUF, sockbufs[s], nControl);
+			FtpSetOptions(FTPLIB_SNDBUF, sockbufs[s], nControl);
+
+			double t = now();
+			for (int i = 0; i < runs; i++)
+				if (!FtpPut(local, "payload.bin", mode, nControl))
+					fail("FtpPut", nControl);
+			double tPut = (now() - t) / runs;
+			t = now();
+			for (int i = 0; i < runs; i++)
+				if (!FtpGet(fetched, "payload.bin", mode, nControl))
+					fail("FtpGet", nControl);
+			double tGet = (now() - t) / runs;
+			if (!sameFile(local, fetched))
+				fail("sweep content check", NULL);
+
+			printf("  %8ld  %8ld  %9.2f  %9.2f\n", bufsizes[b], sockbufs[s],
+				size / tPut / (1024 * 1024), size / tGet / (1024 * 1024));
+			fflush(stdout);
+		}
+	}
+}
+
+static void printSize(long n)
+{
+	if (n >= 1024L * 1024)
+		printf("%6ld MB", n / (1024L * 1024));
+	else
+		printf("%6ld KB", n / 1024);
+}
+
+static void latency(NetBuf_t *nControl, int iterations, const char *local)
+{
+	char buf[256];
+	unsigned int size;
+	double t;
+
+	printf("\ncommand latency (average of %d)\n", iterations);
+
+	t = now();
+	for (int i = 0; i < iterations; i++)
+		if (!FtpPwd(buf, sizeof(buf), nControl))
+			fail("PWD", nControl);
+	printf("  %-22s %9.1f us\n", "PWD", (now() - t) / iterations * 1e6);
+
+	t = now();
+	for (int i = 0; i < iterations; i++)
+		if (!FtpChangeDir("/", nControl))
+			fail("CWD", nControl);
+	printf("  %-22s %9.1f us\n", "CWD", (now() - t) / iterations * 1e6);
+
+	t = now();
+	for (int i = 0; i < iterations; i++)
+		if (!FtpGetSysType(buf, sizeof(buf), nControl))
+			fail("SYST", nControl);
+	printf("  %-22s %9.1f us\n", "SYST", (now() - t) / iterations * 1e6);
+
+	t = now();
+	for (int i = 0; i < iterations; i++)
+		if (!FtpGetFileSize("latency.bin", &size, FTPLIB_IMAGE, nControl))
+			fail("SIZE", nControl);
+	printf("  %-22s %9.1f us\n", "FtpGetFileSize", (now() - t) / iterations * 1e6);
+
+	t = now();
+	for (int i = 0; i < iterations; i++)
+		if (!FtpMakeDir("latency.d", nControl)
+				|| !FtpRemoveDir("latency.d", nControl))
+			fail("MKD/RMD", nControl);
+	printf("  %-22s %9.1f us\n", "MKD+RMD", (now() - t) / iterations * 1e6);
+
+	t = now();
+	for (int i = 0; i < iterations; i++) {
+		FtpCommand_t c[2] = { { "MKD latency.d", '2', 0 },
+			{ "RMD latency.d", '2', 0 } };
+		if (!FtpPipeline(c, 2, nControl))
+			fail("pipelined MKD/RMD", nControl);
+	}
+	printf("  %-22s %9.1f us\n", "MKD+RMD pipelined",
+		(now() - t) / iterations * 1e6);
+
+	t = now();
+	for (int i = 0; i < iterations; i++)
+		if (!FtpGet(local, "latency.bin", FTPLIB_IMAGE, nControl))
+			fail("RETR", nControl);
+	printf("  %-22s %9.1f us\n", "FtpGet (empty file)",
+		(now() - t) / iterations * 1e6);
+
+	int entries = 0;
+	t = now();
+	for (int i = 0; i < iterations; i++)
+		if (!FtpListEntries(".", countEntry, &entries, nControl))
+			fail("FtpListEntries", nControl);
+	printf("  %-22s %9.1f us\n", "FtpListEntries",
+		(now() - t) / iterations * 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	long max = BENCH_MAX_SIZE;
+	int iterations = 200;
+	unsigned int rtt = 0;
+	int cmode = FTPLIB_PASSIVE;
+	char mode = FTPLIB_IMAGE;
+	int sessions = 0;
+	long bufsize = 0;
+	long sockbuf = -1;
+	int sweeping = 0;
+	int pooled = 0;
+	int level = 0;
+	int depth = 0;
+	int ota = 0;
+	int mapped = 0;
+	int metrics = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "atl:m:n:s:b:r:wpz:d:oMx")) != -1) {
+		switch (opt) {
+			case 'a': cmode = FTPLIB_ACTIVE; break;
+			case 't': mode = FTPLIB_ASCII; break;
+			case 'l': rtt = atoi(optarg); break;
+			case 'm': max = strtol(optarg, NULL, 0); break;
+			case 'n': iterations = atoi(optarg); break;
+			case 's': sessions = atoi(optarg); break;
+			case 'b': bufsize = strtol(optarg, NULL, 0); break;
+			case 'r': sockbuf = strtol(optarg, NULL, 0); break;
+			case 'w': sweeping = 1; break;
+			case 'p': pooled = 1; break;
+			case 'z': level = atoi(optarg); break;
+			case 'd': depth = atoi(optarg); break;
+			case 'o': ota = 1; break;
+			case 'M': mapped = 1; break;
+			case 'x': metrics = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-a] [-t] [-l rtt_ms] [-m max_bytes] "
+					"[-n iterations] [-s sessions] [-b bufsize] [-r sockbuf] "
+					"[-w] [-p] [-z level] [-d depth] [-o] [-M] [-x]\n", argv[0]);
+				return 2;
+		}
+	}
+	/* segments start at offsets, a gzip stream cannot */
+	if ((level > 0) && ((sessions > 0) || (mode != FTPLIB_IMAGE))) {
+		fprintf(stderr, "ftp_bench: -z needs binary transfers and no -s\n");
+		return 2;
+	}
+	/* the slot gets the bytes as stored, like the firmware on a device */
+	if (ota && ((level > 0) || (mode != FTPLIB_IMAGE))) {
+		fprintf(stderr, "ftp_bench: -o needs binary transfers and no -z\n");
+		return 2;
+	}
+#if !FTP_BENCH_OTA
+	if (ota) {
+		fprintf(stderr, "ftp_bench: built without ftp_ota (OpenSSL)\n");
+		return 2;
+	}
+#endif
+	if (iterations < 1)
+		iterations = 1;
+	if (sessions > BENCH_MAX_SESSIONS)
+		sessions = BENCH_MAX_SESSIONS;
+	if (pooled && !FtpPoolInit(BENCH_MAX_SESSIONS + 1, BENCH_MAX_SESSIONS + 1,
+			bufsize > 0 ? bufsize : FTPLIB_BUFFER_SIZE)) {
+		fprintf(stderr, "ftp_bench: FtpPoolInit failed\n");
+		return 1;
+	}
+
+	if (mkdtemp(scratch) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char srvdir[sizeof(scratch) + 8], local[sizeof(scratch) + 16],
+		fetched[sizeof(scratch) + 16], served[sizeof(scratch) + 16],
+		stored[sizeof(scratch) + 16], slot[sizeof(scratch) + 16],
+		copied[sizeof(scratch) + 16];
+	snprintf(srvdir, sizeof(srvdir), "%s/srv", scratch);
+	snprintf(local, sizeof(local), "%s/local.bin", scratch);
+	snprintf(fetched, sizeof(fetched), "%s/fetched.bin", scratch);
+	snprintf(served, sizeof(served), "%s/srv/latency.bin", scratch);
+	snprintf(stored, sizeof(stored), "%s/srv/payload.bin", scratch);
+	snprintf(slot, sizeof(slot), "%s/ota_slot.bin", scratch);
+	snprintf(copied, sizeof(copied), "%s/srv/mapped.bin", scratch);
+	mkdir(srvdir, 0755);
+	makeFile(served, 0);
+
+	FtpdStub_t *srv = ftpd_stub_start(srvdir);
+	if (srv == NULL) {
+		perror("ftpd_stub_start");
+		return 1;
+	}
+	ftpd_stub_set_latency(srv, rtt);
+
+	NetBuf_t *nControl = NULL;
+	double t = now();
+	if (!FtpConnect("127.0.0.1", ftpd_stub_port(srv), &nControl))
+		fail("FtpConnect", NULL);
+	double tConnect = now() - t;
+	t = now();
+	if (!FtpLogin("bench", "bench", nControl))
+		fail("FtpLogin", nControl);
+	double tLogin = now() - t;
+
+	/* the first lookup of a name goes to the resolver, later ones to the
+	 * ftplib host cache */
+	double tName = 0, tCached = 0;
+	for (int i = 0; i <= iterations / 10; i++) {
+		NetBuf_t *byName;
+		t = now();
+		if (!FtpConnect("localhost", ftpd_stub_port(srv), &byName))
+			fail("FtpConnect localhost", NULL);
+		if (i == 0)
+			tName = now() - t;
+		else
+			tCached += now() - t;
+		FtpQuit(byName);
+	}
+	tCached /= iterations / 10 > 0 ? iterations / 10 : 1;
+	FtpSetOptions(FTPLIB_CONNMODE, cmode, nControl);
+	if ((bufsize > 0) && !FtpSetOptions(FTPLIB_BUFSIZE, bufsize, nControl))
+		fail("FTPLIB_BUFSIZE", NULL);
+	if ((sockbuf >= 0) && (!FtpSetOptions(FTPLIB_RCVBUF, sockbuf, nControl)
+			|| !FtpSetOptions(FTPLIB_SNDBUF, sockbuf, nControl)))
+		fail("FTPLIB_RCVBUF", NULL);
+	if (!FtpSetOptions(FTPLIB_PIPELINE, depth, nControl))
+		fail("FTPLIB_PIPELINE", NULL);
+
+	NetBuf_t *segs[BENCH_MAX_SESSIONS] = { nControl };
+	for (int i = 1; i < sessions; i++) {
+		if (!FtpConnect("127.0.0.1", ftpd_stub_port(srv), &segs[i]))
+			fail("FtpConnect", NULL);
+		if (!FtpLogin("bench", "bench", segs[i]))
+			fail("FtpLogin", segs[i]);
+		FtpSetOptions(FTPLIB_CONNMODE, cmode, segs[i]);
+	}
+	FtpAsync_t *async[BENCH_MAX_SESSIONS];
+	int asyncFailed = 0;
+	for (int i = 0; i < sessions; i++)
+		if (!FtpAsyncConnect("127.0.0.1", ftpd_stub_port(srv), "bench", "bench",
+				asyncDone, &asyncFailed, &async[i]))
+			fail("FtpAsyncConnect", NULL);
+	while (FtpPoll(async, sessions, -1) > 0)
+		;
+	if (asyncFailed)
+		fail("FtpAsyncConnect login", NULL);
+	for (int i = 0; i < sessions; i++)
+		if ((bufsize > 0) && !FtpAsyncSetOptions(FTPLIB_BUFSIZE, bufsize,
+				async[i]))
+			fail("FtpAsyncSetOptions", NULL);
+
+	printf("ftplib host benchmark: loopback, %s, %s, rtt %u ms, "
+		"data buffer %ld, socket buffers %ld, pipeline %d%s%s\n",
+		cmode == FTPLIB_PASSIVE ? "passive" : "active",
+		mode == FTPLIB_IMAGE ? "binary" : "ascii", rtt,
+		bufsize > 0 ? bufsize : FTPLIB_BUFFER_SIZE, sockbuf > 0 ? sockbuf : 0,
+		depth, pooled ? ", pooled" : "", level > 0 ? ", gzip" : "");
+	printf("\nsession setup\n");
+	printf("  %-22s %9.1f us\n", "FtpConnect", tConnect * 1e6);
+	printf("  %-22s %9.1f us\n", "FtpLogin", tLogin * 1e6);
+	printf("  %-22s %9.1f us\n", "FtpConnect localhost", tName * 1e6);
+	printf("  %-22s %9.1f us\n", "  cached", tCached * 1e6);
+
+	latency(nControl, iterations, fetched);
+	/* the latency file is not compressed */
+	if ((level > 0) && !FtpSetOptions(FTPLIB_COMPRESS, level, nControl))
+		fail("FTPLIB_COMPRESS", NULL);
+
+	if (sweeping)
+		sweep(nControl, local, fetched,
+			max < BENCH_SWEEP_SIZE ? max : BENCH_SWEEP_SIZE, mode);
+	else {
+		printf("\ntransfers\n");
+		printf("      size  runs   put MB/s  put ms/op   get MB/s  get ms/op"
+			"  sink MB/s  source MB/s%s%s%s%s\n",
+			sessions > 0 ? "   seg MB/s  async MB/s" : "",
+			ota ? "   ota MB/s" : "", mapped ? "   map MB/s" : "",
+			level > 0 ? "  stored" : "");
+		for (long size = BENCH_MIN_SIZE; size <= max; size *= 4) {
+			int runs = BENCH_MIN_VOLUME / size;
+			if (runs < 1)
+				runs = 1;
+			if (runs > BENCH_MAX_RUNS)
+				runs = BENCH_MAX_RUNS;
+			makeFile(local, size);
+
+			FtpMetrics_t mPut, mGet;
+			t = now();
+			for (int i = 0; i < runs; i++)
+				if (!FtpPut(local, "payload.bin", mode, nControl))
+					fail("FtpPut", nControl);
+			double tPut = (now() - t) / runs;
+			FtpGetMetrics(&mPut, nControl);
+
+			t = now();
+			for (int i = 0; i < runs; i++)
+				if (!FtpGet(fetched, "payload.bin", mode, nControl))
+					fail("FtpGet", nControl);
+			double tGet = (now() - t) / runs;
+			FtpGetMetrics(&mGet, nControl);
+			if (!sameFile(local, fetched))
+				fail("FtpGet content check", NULL);
+
+			long sunk = 0;
+			t = now();
+			for (int i = 0; i < runs; i++)
+				if (!FtpGetToSink("payload.bin", mode, countSink, &sunk, nControl))
+					fail("FtpGetToSink", nControl);
+			double tSink = (now() - t) / runs;
+
+			t = now();
+			for (int i = 0; i < runs; i++) {
+				long remaining = size;
+				if (!FtpPutFromSource("source.bin", mode, textSource, &remaining,
+						nControl))
+					fail("FtpPutFromSource", nControl);
+			}
+			double tSource = (now() - t) / runs;
+
+			double tSeg = 0;
+			if (sessions > 0) {
+				t = now();
+				for (int i = 0; i < runs; i++)
+					if (!FtpGetSegmented(fetched, "payload.bin", segs, sessions))
+						fail("FtpGetSegmented", nControl);
+				tSeg = (now() - t) / runs;
+				if (!sameFile(local, fetched))
+					fail("FtpGetSegmented content check", NULL);
+			}
+
+			double tAsync = 0;
+			if (sessions > 0) {
+				long asyncSunk = 0;
+				t = now();
+				for (int i = 0; i < runs; i++)
+					asyncGet(async, sessions, "payload.bin", &asyncSunk);
+				tAsync = (now() - t) / runs;
+				if (asyncFailed || asyncSunk != size * runs * sessions)
+					fail("async download", NULL);
+			}
+
+			double tOta = 0;
+#if FTP_BENCH_OTA
+			if (ota) {
+				ftp_ota_config_t config = { .path = "payload.bin",
+					.partition = slot };
+				ftp_ota_stats_t stats;
+				t = now();
+				for (int i = 0; i < runs; i++)
+					if ((ftp_ota_run(&nControl, &config, &stats) != 0)
+							|| (stats.size != size))
+						fail("ftp_ota_run", nControl);
+				tOta = (now() - t) / runs;
+				if (!sameFile(local, slot))
+					fail("ftp_ota_run content check", NULL);
+			}
+#endif
+
+			double tMap = 0;
+			if (mapped) {
+				t = now();
+				for (int i = 0; i < runs; i++)
+					if (!FtpPutMapped(local, 0, 0, "mapped.bin", nControl))
+						fail("FtpPutMapped", nControl);
+				tMap = (now() - t) / runs;
+				if (!sameFile(local, copied))
+					fail("FtpPutMapped content check", NULL);
+			}
+
+			if (sunk != size * runs) {
+				fprintf(stderr, "ftp_bench: size mismatch, sent %ld got %ld\n",
+					size, sunk / runs);
+				return 1;
+			}
+			printSize(size);
+			printf("  %4d  %9.2f  %9.3f  %9.2f  %9.3f  %9.2f  %11.2f", runs,
+				size / tPut / (1024 * 1024), tPut * 1e3,
+				size / tGet / (1024 * 1024), tGet * 1e3,
+				size / tSink / (1024 * 1024), size / tSource / (1024 * 1024));
+			if (sessions > 0)
+				printf("  %9.2f  %10.2f", size / tSeg / (1024 * 1024),
+					size * sessions / tAsync / (1024 * 1024));
+			if (ota)
+				printf("  %9.2f", size / tOta / (1024 * 1024));
+			if (mapped)
+				printf("  %9.2f", size / tMap / (1024 * 1024));
+			if (level > 0)
+				printf("  %5.1f%%", 100.0 * fileSize(stored) / size);
+			printf("\n");
+			if (metrics) {
+				printMetrics(&mPut);
+				printMetrics(&mGet);
+			}
+			fflush(stdout);
+		}
+	}
+
+	FtpDelete("payload.bin", nControl);
+	FtpDelete("source.bin", nControl);
+	FtpDelete("mapped.bin", nControl);
+	FtpDelete("latency.bin", nControl);
+	for (int i = 1; i < sessions; i++)
+		FtpQuit(segs[i]);
+	for (int i = 0; i < sessions; i++)
+		FtpAsyncQuit(async[i]);
+	FtpQuit(nControl);
+	ftpd_stub_stop(srv);
+	unlink(local);
+	unlink(fetched);
+	unlink(slot);
+	rmdir(srvdir);
+	rmdir(scratch);
+	return 0;
+}
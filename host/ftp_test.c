@@ -0,0 +1,309 @@
+/**
+ * @file
+ * @brief ftplib tests for the host build, run by ctest
+ *
+ * Starts the loopback server stand-in on a scratch directory and checks
+ * what ftplib hands back against the files on both sides, byte for byte.
+ * Prints one line per failed check and exits with the number of failures.
+ *
+ * usage: ftp_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "ftplib.h"
+#include "ftpd_stub.h"
+
+#define TEST_SIZE_SENTINEL	0xdeadbeefu
+#define TEST_SESSIONS		3
+
+static char scratch[] = "/tmp/ftp_testXXXXXX";
+static char srvdir[sizeof(scratch) + 8];
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __func__, __LINE__)
+
+static void check(int ok, const char *what, const char *func, int line)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "ftp_test: %s:%d: %s\n", func, line, what);
+	failures++;
+}
+
+/* path of name in the scratch directory, or its server side with srv set */
+static const char *scratchPath(const char *name, int srv)
+{
+	static char path[4][sizeof(scratch) + 64];
+	static int next;
+	char *p = path[next++ % 4];
+	snprintf(p, sizeof(path[0]), "%s/%s", srv ? srvdir : scratch, name);
+	return p;
+}
+
+static void writeFile(const char *path, const char *data, long len)
+{
+	FILE *f = fopen(path, "wb");
+	if ((f == NULL) || (fwrite(data, 1, len, f) != (size_t) len)) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+}
+
+/* 1 if the file holds exactly len bytes of data */
+static int fileHolds(const char *path, const char *data, long len)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+	char buf[8192];
+	long o = 0;
+	size_t l;
+	int same = 1;
+	while (same && ((l = fread(buf, 1, sizeof(buf), f)) > 0)) {
+		same = (o + (long) l <= len) && (memcmp(buf, data + o, l) == 0);
+		o += l;
+	}
+	fclose(f);
+	return same && (o == len);
+}
+
+/* len bytes that are not the same in every segment, lines if text is set */
+static char *makeData(long len, int text)
+{
+	char *data = malloc(len);
+	if (data == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (long i = 0; i < len; i++)
+		data[i] = text ? ((i % 61) == 60 ? '\n' : 'a' + (i * 7) % 26)
+			: (char) (i * 131 + (i >> 9));
+	return data;
+}
+
+static NetBuf_t *login(FtpdStub_t *srv)
+{
+	NetBuf_t *nControl;
+	if (!FtpConnect("127.0.0.1", ftpd_stub_port(srv), &nControl)
+			|| !FtpLogin("test", "test", nControl)) {
+		fprintf(stderr, "ftp_test: cannot log in\n");
+		exit(1);
+	}
+	return nControl;
+}
+
+/* SIZE with and without TYPE going out first, see FtpGetFileSize() */
+static void testSize(FtpdStub_t *srv)
+{
+	writeFile(scratchPath("size.bin", 1), "0123456789", 10);
+	NetBuf_t *nControl = login(srv);
+	unsigned int size = TEST_SIZE_SENTINEL;
+	CHECK(FtpGetFileSize("size.bin", &size, FTPLIB_IMAGE, nControl)
+		&& (size == 10));
+	size = TEST_SIZE_SENTINEL;
+	CHECK(FtpGetFileSize("size.bin", &size, FTPLIB_IMAGE, nControl)
+		&& (size == 10));
+	size = TEST_SIZE_SENTINEL;
+	CHECK(FtpGetFileSize("size.bin", &size, FTPLIB_ASCII, nControl)
+		&& (size == 10));
+	size = TEST_SIZE_SENTINEL;
+	CHECK(FtpGetFileSize("size.bin", &size, FTPLIB_IMAGE, nControl)
+		&& (size == 10));
+	size = TEST_SIZE_SENTINEL;
+	CHECK(!FtpGetFileSize("missing.bin", &size, FTPLIB_ASCII, nControl)
+		&& (size == TEST_SIZE_SENTINEL));
+	FtpQuit(nControl);
+}
+
+/* MDTM parsed to seconds since the epoch, see FtpGetModTime() */
+static void testModTime(FtpdStub_t *srv)
+{
+	const char *remote = scratchPath("mtime.bin", 1);
+	writeFile(remote, "x", 1);
+	struct utimbuf times = { 951782400, 951782400 };	/* 2000-02-29 */
+	utime(remote, &times);
+	NetBuf_t *nControl = login(srv);
+	time_t mtime = 0;
+	CHECK(FtpGetModTime("mtime.bin", &mtime, nControl)
+		&& (mtime == 951782400));
+	mtime = 0;
+	CHECK(!FtpGetModTime("missing.bin", &mtime, nControl) && (mtime == 0));
+	FtpQuit(nControl);
+}
+
+/* REST from a partial local file or a partial server copy */
+static void testResume(FtpdStub_t *srv)
+{
+	const long len = 200 * 1024 + 17;
+	char *data = makeData(len, 0);
+	const char *local = scratchPath("resume.bin", 0);
+	const char *remote = scratchPath("resume.bin", 1);
+	NetBuf_t *nControl = login(srv);
+
+	writeFile(remote, data, len);
+	writeFile(local, data, 70001);
+	CHECK(FtpGetResume(local, "resume.bin", FTPLIB_IMAGE, nControl)
+		&& fileHolds(local, data, len));
+	/* complete already, nothing to fetch */
+	CHECK(FtpGetResume(local, "resume.bin", FTPLIB_IMAGE, nControl)
+		&& fileHolds(local, data, len));
+	/* longer than the remote file, fetched again */
+	writeFile(remote, data, 4096);
+	CHECK(FtpGetResume(local, "resume.bin", FTPLIB_IMAGE, nControl)
+		&& fileHolds(local, data, 4096));
+
+	writeFile(local, data, len);
+	writeFile(remote, data, 123457);
+	CHECK(FtpPutResume(local, "resume.bin", FTPLIB_IMAGE, nControl)
+		&& fileHolds(remote, data, len));
+	unlink(remote);
+	CHECK(FtpPutResume(local, "resume.bin", FTPLIB_IMAGE, nControl)
+		&& fileHolds(remote, data, len));
+	FtpQuit(nControl);
+	free(data);
+}
+
+/* one file over several sessions, including a short last range */
+static void testSegmented(FtpdStub_t *srv)
+{
+	const long len = TEST_SESSIONS * FTPLIB_SEGMENT_MIN + 1001;
+	char *data = makeData(len, 0);
+	const char *local = scratchPath("seg.bin", 0);
+	writeFile(scratchPath("seg.bin", 1), data, len);
+	NetBuf_t *nControls[TEST_SESSIONS];
+	for (int i = 0; i < TEST_SESSIONS; i++)
+		nControls[i] = login(srv);
+
+	CHECK(FtpGetSegmented(local, "seg.bin", nControls, TEST_SESSIONS)
+		&& fileHolds(local, data, len));
+	/* an idle time bounds the wait, a live transfer never reaches it */
+	CHECK(FtpSetOptions(FTPLIB_IDLETIME, 2000, nControls[0])
+		&& FtpGetSegmented(local, "seg.bin", nControls, TEST_SESSIONS)
+		&& fileHolds(local, data, len));
+	/* a file too small to split goes over the first session only */
+	writeFile(scratchPath("seg.bin", 1), data, 1000);
+	CHECK(FtpGetSegmented(local, "seg.bin", nControls, TEST_SESSIONS)
+		&& fileHolds(local, data, 1000));
+	for (int i = 0; i < TEST_SESSIONS; i++)
+		FtpQuit(nControls[i]);
+	free(data);
+}
+
+/* LF text through CRLF on the wire, with line ends split across buffers */
+static void testAscii(FtpdStub_t *srv)
+{
+	const long len = 100 * 1024 + 3;
+	char *data = makeData(len, 1);
+	const char *local = scratchPath("text.txt", 0);
+	const char *fetched = scratchPath("fetched.txt", 0);
+	const char *remote = scratchPath("text.txt", 1);
+	writeFile(local, data, len);
+	NetBuf_t *nControl = login(srv);
+
+	static const long bufsizes[] = { 1000, 1024, FTPLIB_BUFFER_SIZE };
+	for (size_t b = 0; b < sizeof(bufsizes) / sizeof(bufsizes[0]); b++) {
+		FtpSetOptions(FTPLIB_BUFSIZE, bufsizes[b], nControl);
+		unlink(remote);
+		unlink(fetched);
+		CHECK(FtpPut(local, "text.txt", FTPLIB_ASCII, nControl)
+			&& fileHolds(remote, data, len));
+		CHECK(FtpGet(fetched, "text.txt", FTPLIB_ASCII, nControl)
+			&& fileHolds(fetched, data, len));
+	}
+	/* binary gets the bytes as stored, the server keeps LF endings */
+	CHECK(FtpGet(fetched, "text.txt", FTPLIB_IMAGE, nControl)
+		&& fileHolds(fetched, data, len));
+	FtpQuit(nControl);
+	free(data);
+}
+
+static void asyncDone(FtpAsync_t *nAsync, int ok, void *arg)
+{
+	(void) nAsync;
+	*(int *) arg = ok;
+}
+
+static int asyncRun(FtpAsync_t *nAsync, int *ok)
+{
+	*ok = -1;
+	while (FtpPoll(&nAsync, 1, 5000) > 0)
+		;
+	return *ok == 1;
+}
+
+/* asynchronous transfers with the buffer sizes of FtpAsyncSetOptions() */
+static void testAsync(FtpdStub_t *srv)
+{
+	const long len = 150 * 1024 + 5;
+	char *data = makeData(len, 0);
+	const char *local = scratchPath("async.bin", 0);
+	const char *fetched = scratchPath("async_fetched.bin", 0);
+	writeFile(local, data, len);
+	FtpAsync_t *nAsync;
+	int ok;
+	CHECK(FtpAsyncConnect("127.0.0.1", ftpd_stub_port(srv), "test", "test",
+		asyncDone, &ok, &nAsync) && asyncRun(nAsync, &ok));
+
+	CHECK(!FtpAsyncSetOptions(FTPLIB_BUFSIZE, 100, nAsync));
+	CHECK(FtpAsyncSetOptions(FTPLIB_BUFSIZE, 1000, nAsync));
+	CHECK(FtpAsyncSetOptions(FTPLIB_RESPSIZE, 256, nAsync));
+	CHECK(FtpAsyncPut(local, "async.bin", nAsync) && asyncRun(nAsync, &ok)
+		&& fileHolds(scratchPath("async.bin", 1), data, len));
+	CHECK(FtpAsyncGet(fetched, "async.bin", nAsync) && asyncRun(nAsync, &ok)
+		&& fileHolds(fetched, data, len));
+	CHECK(FtpAsyncGet(fetched, "missing.bin", nAsync)
+		&& !asyncRun(nAsync, &ok)
+		&& (strncmp(FtpAsyncLastResponse(nAsync), "550", 3) == 0));
+	FtpAsyncQuit(nAsync);
+	free(data);
+}
+
+/* closing a session with a download still open, see FtpClose() */
+static void testCloseSession(FtpdStub_t *srv)
+{
+	static char data[256 * 1024];
+	writeFile(scratchPath("open.bin", 1), data, sizeof(data));
+	NetBuf_t *nControl = login(srv);
+	NetBuf_t *nData;
+	char buf[16];
+	CHECK(FtpAccess("open.bin", FTPLIB_FILE_READ, FTPLIB_IMAGE, nControl,
+		&nData) && (FtpRead(buf, sizeof(buf), nData) > 0));
+	CHECK(FtpClose(nControl) == 0);
+}
+
+int main(void)
+{
+	if (mkdtemp(scratch) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(srvdir, sizeof(srvdir), "%s/srv", scratch);
+	mkdir(srvdir, 0755);
+	FtpdStub_t *srv = ftpd_stub_start(srvdir);
+	if (srv == NULL) {
+		perror("ftpd_stub_start");
+		return 1;
+	}
+
+	testSize(srv);
+	testModTime(srv);
+	testResume(srv);
+	testSegmented(srv);
+	testAscii(srv);
+	testAsync(srv);
+	testCloseSession(srv);
+
+	ftpd_stub_stop(srv);
+	char cmd[sizeof(scratch) + 16];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", scratch);
+	if (system(cmd) != 0)
+		fprintf(stderr, "ftp_test: cannot remove %s\n", scratch);
+	printf("ftp_test: %d failure(s)\n", failures);
+	return failures;
+}
@@ -0,0 +1,873 @@
+/**
+ * @file
+ * @brief Loopback FTP server stand-in for the host build
+ *
+ * Files live in a real directory on the host, so what ftplib uploads can be
+ * inspected and compared after the fact.  TYPE A transfers are converted
+ * to and from CRLF line endings like a regular Unix server would.  When
+ * built with zlib it offers MODE Z, deflating the data connections.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if FTPD_ZLIB
+#include <zlib.h>
+#endif
+#include "ftpd_stub.h"
+
+#if !defined FTPD_ZLIB
+#define FTPD_ZLIB			0
+#endif
+#define FTPD_MODEZ_LEVEL		6
+
+#define FTPD_LINE_SIZE		1024
+#define FTPD_XFER_SIZE		65536
+
+struct FtpdStub {
+	int handle;
+	uint16_t port;
+	pthread_t thread;
+	unsigned int latency;
+	char root[PATH_MAX];
+};
+
+typedef struct {
+	int handle;
+	unsigned int latency;
+	char root[PATH_MAX];
+	char cwd[PATH_MAX];
+	char type;
+	long long rest;
+	int pasv;
+	struct sockaddr_storage port;
+	socklen_t portlen;
+	int hasport;
+	int modez;	/* MODE Z level, 0 in MODE S */
+	char rnfr[PATH_MAX];
+	char in[FTPD_LINE_SIZE];
+	int inlen;
+} FtpdSession_t;
+
+/* one data connection, deflated in MODE Z */
+typedef struct {
+	int handle;
+#if FTPD_ZLIB
+	z_stream z;
+	int deflating;
+	int inflating;
+#endif
+} FtpdData_t;
+
+/*
+ * reply - send a formatted reply line on the control connection
+ */
+static void reply(FtpdSession_t *s, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static void reply(FtpdSession_t *s, const char *fmt, ...)
+{
+	char buf[FTPD_LINE_SIZE];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf) - 2, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n > (int) sizeof(buf) - 3)
+		n = sizeof(buf) - 3;
+	buf[n++] = '\r';
+	buf[n++] = '\n';
+	send(s->handle, buf, n, MSG_NOSIGNAL);
+}
+
+/*
+ * readCommand - read one CRLF terminated command line
+ *
+ * Several pipelined commands may arrive in a single segment, the surplus
+ * stays in the session buffer for the next call.  Each segment is held
+ * back for the configured latency, so a ping-pong exchange pays it once
+ * per command while a pipelined batch pays it once per segment.
+ * return line length, -1 on disconnect
+ */
+static int readCommand(FtpdSession_t *s, char *line, int max)
+{
+	for (;;) {
+		char *nl = memchr(s->in, '\n', s->inlen);
+		if (nl != NULL) {
+			int l = nl - s->in;
+			int used = l + 1;
+			if (l > 0 && s->in[l - 1] == '\r')
+				l--;
+			if (l >= max)
+				l = max - 1;
+			memcpy(line, s->in, l);
+			line[l] = '\0';
+			memmove(s->in, s->in + used, s->inlen - used);
+			s->inlen -= used;
+			return l;
+		}
+		if (s->inlen == (int) sizeof(s->in))
+			s->inlen = 0;
+		int x = recv(s->handle, s->in + s->inlen, sizeof(s->in) - s->inlen, 0);
+		if (x <= 0)
+			return -1;
+		if (s->latency)
+			usleep(s->latency * 1000);
+		s->inlen += x;
+	}
+}
+
+/*
+ * virtualPath - resolve arg against the session cwd
+ *
+ * ".." never climbs above the served root.
+ */
+static void virtualPath(const FtpdSession_t *s, const char *arg, char *out,
+	size_t max)
+{
+	char tmp[PATH_MAX * 2];
+	if (arg == NULL || *arg == '\0')
+		arg = ".";
+	if (*arg == '/')
+		snprintf(tmp, sizeof(tmp), "%s", arg);
+	else
+		snprintf(tmp, sizeof(tmp), "%s/%s", s->cwd, arg);
+
+	size_t o = 0;
+	out[o++] = '/';
+	char *save = NULL;
+	for (char *tok = strtok_r(tmp, "/", &save); tok != NULL;
+			tok = strtok_r(NULL, "/", &save)) {
+		if (strcmp(tok, ".") == 0)
+			continue;
+		if (strcmp(tok, "..") == 0) {
+			while (o > 1 && out[o - 1] != '/')
+				o--;
+			if (o > 1)
+				o--;
+			continue;
+		}
+		if (o > 1 && o < max - 1)
+			out[o++] = '/';
+		size_t l = strlen(tok);
+		if (o + l >= max)
+			break;
+		memcpy(&out[o], tok, l);
+		o += l;
+	}
+	out[o] = '\0';
+}
+
+/*
+ * realPath - map arg to a path below the served root
+ *
+ * A path that does not fit comes back empty, which no file call accepts.
+ *
+ * return 1 if successful, 0 if the path is too long
+ */
+static int realPath(const FtpdSession_t *s, const char *arg, char *out,
+	size_t max)
+{
+	char v[PATH_MAX];
+	virtualPath(s, arg, v, sizeof(v));
+	int n = snprintf(out, max, "%s%s", s->root, v);
+	if (n < 0 || (size_t) n >= max) {
+		*out = '\0';
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * openData - establish the data connection for the pending transfer
+ *
+ * return socket, -1 on error
+ */
+static int openData(FtpdSession_t *s)
+{
+	int d = -1;
+	if (s->pasv >= 0) {
+		d = accept(s->pasv, NULL, NULL);
+		close(s->pasv);
+		s->pasv = -1;
+	}
+	else if (s->hasport) {
+		d = socket(s->port.ss_family, SOCK_STREAM, 0);
+		if (d >= 0 && connect(d, (struct sockaddr *) &s->port,
+				s->portlen) == -1) {
+			close(d);
+			d = -1;
+		}
+		s->hasport = 0;
+	}
+	return d;
+}
+
+/*
+ * dataOpen - open the data connection and start MODE Z on it
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int dataOpen(FtpdSession_t *s, FtpdData_t *dc, int out)
+{
+	memset(dc, 0, sizeof(*dc));
+	dc->handle = openData(s);
+	if (dc->handle < 0)
+		return 0;
+#if FTPD_ZLIB
+	if (s->modez > 0 && out)
+		dc->deflating = deflateInit(&dc->z, s->modez) == Z_OK;
+	else if (s->modez > 0)
+		dc->inflating = inflateInit(&dc->z) == Z_OK;
+#else
+	(void) out;
+#endif
+	return 1;
+}
+
+/*
+ * dataSend - write the whole buffer to the data connection
+ */
+static int dataSend(FtpdData_t *dc, const char *buf, size_t len, int finish)
+{
+#if FTPD_ZLIB
+	static __thread char zout[FTPD_XFER_SIZE];
+	if (dc->deflating) {
+		dc->z.next_in = (Bytef *) buf;
+		dc->z.avail_in = len;
+		int r;
+		do {
+			dc->z.next_out = (Bytef *) zout;
+			dc->z.avail_out = sizeof(zout);
+			r = deflate(&dc->z, finish ? Z_FINISH : Z_NO_FLUSH);
+			size_t n = sizeof(zout) - dc->z.avail_out;
+			for (size_t o = 0; o < n; ) {
+				ssize_t w = send(dc->handle, zout + o, n - o, MSG_NOSIGNAL);
+				if (w <= 0)
+					return 0;
+				o += w;
+			}
+		} while (dc->z.avail_in > 0 || dc->z.avail_out == 0
+			|| (finish && r != Z_STREAM_END));
+		return 1;
+	}
+#endif
+	while (len > 0) {
+		ssize_t w = send(dc->handle, buf, len, MSG_NOSIGNAL);
+		if (w <= 0)
+			return 0;
+		buf += w;
+		len -= w;
+	}
+	(void) finish;
+	return 1;
+}
+
+/*
+ * dataRecv - read from the data connection
+ *
+ * return bytecount, 0 at the end of the data, -1 on error
+ */
+static ssize_t dataRecv(FtpdData_t *dc, char *buf, size_t max)
+{
+#if FTPD_ZLIB
+	static __thread char zin[FTPD_XFER_SIZE];
+	if (dc->inflating) {
+		dc->z.next_out = (Bytef *) buf;
+		dc->z.avail_out = max;
+		while (dc->z.avail_out == max) {
+			if (dc->z.avail_in == 0) {
+				ssize_t x = recv(dc->handle, zin, sizeof(zin), 0);
+				if (x <= 0)
+					return x;
+				dc->z.next_in = (Bytef *) zin;
+				dc->z.avail_in = x;
+			}
+			int r = inflate(&dc->z, Z_NO_FLUSH);
+			if (r == Z_STREAM_END)
+				inflateReset(&dc->z);
+			else if (r != Z_OK && r != Z_BUF_ERROR)
+				return -1;
+		}
+		return max - dc->z.avail_out;
+	}
+#endif
+	return recv(dc->handle, buf, max, 0);
+}
+
+/*
+ * dataClose - finish MODE Z and close the data connection
+ *
+ * return 1 if all data went out, 0 otherwise
+ */
+static int dataClose(FtpdData_t *dc)
+{
+	int ok = 1;
+#if FTPD_ZLIB
+	if (dc->deflating) {
+		ok = dataSend(dc, NULL, 0, 1);
+		deflateEnd(&dc->z);
+	}
+	if (dc->inflating)
+		inflateEnd(&dc->z);
+#endif
+	close(dc->handle);
+	return ok;
+}
+
+/*
+ * sendAll - write the whole buffer, converting LF to CRLF in ASCII mode
+ */
+static int sendAll(FtpdData_t *dc, const char *buf, size_t len, char type)
+{
+	static __thread char out[FTPD_XFER_SIZE * 2];
+	if (type == 'A') {
+		size_t o = 0;
+		for (size_t i = 0; i < len; i++) {
+			if (buf[i] == '\n')
+				out[o++] = '\r';
+			out[o++] = buf[i];
+		}
+		buf = out;
+		len = o;
+	}
+	return dataSend(dc, buf, len, 0);
+}
+
+static void cmdRetr(FtpdSession_t *s, const char *arg)
+{
+	char path[PATH_MAX];
+	realPath(s, arg, path, sizeof(path));
+	FILE *f = fopen(path, "rb");
+	long long rest = s->rest;
+	s->rest = 0;
+	if (f == NULL) {
+		reply(s, "550 %s: %s", arg, strerror(errno));
+		return;
+	}
+	if (rest > 0 && fseeko(f, rest, SEEK_SET) != 0) {
+		fclose(f);
+		reply(s, "554 Invalid REST offset");
+		return;
+	}
+	reply(s, "150 Opening %s mode data connection for %s",
+		s->type == 'A' ? "ASCII" : "BINARY", arg);
+	FtpdData_t d;
+	if (!dataOpen(s, &d, 1)) {
+		fclose(f);
+		reply(s, "425 Can't open data connection");
+		return;
+	}
+	static __thread char buf[FTPD_XFER_SIZE];
+	size_t l;
+	int ok = 1;
+	while (ok && (l = fread(buf, 1, sizeof(buf), f)) > 0)
+		ok = sendAll(&d, buf, l, s->type);
+	fclose(f);
+	ok = dataClose(&d) && ok;
+	if (ok)
+		reply(s, "226 Transfer complete");
+	else
+		reply(s, "426 Connection closed; transfer aborted");
+}
+
+static void cmdStor(FtpdSession_t *s, const char *arg, int append)
+{
+	char path[PATH_MAX];
+	realPath(s, arg, path, sizeof(path));
+	long long rest = s->rest;
+	s->rest = 0;
+	FILE *f;
+	if (append)
+		f = fopen(path, "ab");
+	else if (rest > 0) {
+		f = fopen(path, "r+b");
+		if (f != NULL && fseeko(f, rest, SEEK_SET) != 0) {
+			fclose(f);
+			reply(s, "554 Invalid REST offset");
+			return;
+		}
+	}
+	else
+		f = fopen(path, "wb");
+	if (f == NULL) {
+		reply(s, "553 %s: %s", arg, strerror(errno));
+		return;
+	}
+	reply(s, "150 Opening %s mode data connection for %s",
+		s->type == 'A' ? "ASCII" : "BINARY", arg);
+	FtpdData_t d;
+	if (!dataOpen(s, &d, 0)) {
+		fclose(f);
+		reply(s, "425 Can't open data connection");
+		return;
+	}
+	static __thread char buf[FTPD_XFER_SIZE];
+	static __thread char out[FTPD_XFER_SIZE + 1];
+	ssize_t l;
+	int cr = 0;
+	while ((l = dataRecv(&d, buf, sizeof(buf))) > 0) {
+		if (s->type == 'A') {
+			ssize_t o = 0;
+			for (ssize_t i = 0; i < l; i++) {
+				if (cr && buf[i] != '\n')
+					out[o++] = '\r';
+				cr = (buf[i] == '\r');
+				if (!cr)
+					out[o++] = buf[i];
+			}
+			fwrite(out, 1, o, f);
+		}
+		else
+			fwrite(buf, 1, l, f);
+	}
+	if (cr)
+		fputc('\r', f);
+	fclose(f);
+	dataClose(&d);
+	reply(s, "226 Transfer complete");
+}
+
+/*
+ * cmdList - LIST (format 0), NLST (1) or MLSD (2)
+ */
+static void cmdList(FtpdSession_t *s, const char *arg, int format)
+{
+	while (arg != NULL && *arg == '-') {
+		arg = strchr(arg, ' ');
+		if (arg != NULL)
+			arg++;
+	}
+	char path[PATH_MAX];
+	realPath(s, arg, path, sizeof(path));
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		reply(s, "550 %s", strerror(errno));
+		return;
+	}
+	reply(s, "150 Here comes the directory listing");
+	FtpdData_t d;
+	if (!dataOpen(s, &d, 1)) {
+		closedir(dir);
+		reply(s, "425 Can't open data connection");
+		return;
+	}
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		char line[PATH_MAX + 128];
+		char full[PATH_MAX * 2];
+		struct stat st;
+		snprintf(full, sizeof(full), "%s/%s", path, e->d_name);
+		if (stat(full, &st) != 0)
+			continue;
+		if (format == 1)
+			snprintf(line, sizeof(line), "%s\n", e->d_name);
+		else if (format == 2) {
+			char date[32];
+			struct tm tm;
+			gmtime_r(&st.st_mtime, &tm);
+			strftime(date, sizeof(date), "%Y%m%d%H%M%S", &tm);
+			snprintf(line, sizeof(line), "type=%s;size=%lld;modify=%s; %s\n",
+				S_ISDIR(st.st_mode) ? "dir" : "file", (long long) st.st_size,
+				date, e->d_name);
+		}
+		else {
+			char date[32];
+			struct tm tm;
+			gmtime_r(&st.st_mtime, &tm);
+			strftime(date, sizeof(date), "%b %d %H:%M", &tm);
+			snprintf(line, sizeof(line), "%s 1 ftp ftp %12lld %s %s\n",
+				S_ISDIR(st.st_mode) ? "drwxr-xr-x" : "-rw-r--r--",
+				(long long) st.st_size, date, e->d_name);
+		}
+		if (!sendAll(&d, line, strlen(line), 'A'))
+			break;
+	}
+	closedir(dir);
+	dataClose(&d);
+	reply(s, "226 Directory send OK");
+}
+
+static void cmdPasv(FtpdSession_t *s)
+{
+	if (s->pasv >= 0)
+		close(s->pasv);
+	s->pasv = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t l = sizeof(sin);
+	if (s->pasv < 0 || bind(s->pasv, (struct sockaddr *) &sin, l) == -1
+			|| listen(s->pasv, 1) == -1
+			|| getsockname(s->pasv, (struct sockaddr *) &sin, &l) == -1) {
+		if (s->pasv >= 0)
+			close(s->pasv);
+		s->pasv = -1;
+		reply(s, "425 Can't open passive connection");
+		return;
+	}
+	uint32_t a = ntohl(sin.sin_addr.s_addr);
+	uint16_t p = ntohs(sin.sin_port);
+	reply(s, "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u)",
+		a >> 24, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff, p >> 8, p & 0xff);
+}
+
+/*
+ * cmdEpsv - passive data connection on the control connection's address
+ */
+static void cmdEpsv(FtpdSession_t *s)
+{
+	if (s->pasv >= 0)
+		close(s->pasv);
+	struct sockaddr_storage ss;
+	socklen_t l = sizeof(ss);
+	if (getsockname(s->handle, (struct sockaddr *) &ss, &l) == -1
+			|| (s->pasv = socket(ss.ss_family, SOCK_STREAM, 0)) < 0) {
+		s->pasv = -1;
+		reply(s, "425 Can't open passive connection");
+		return;
+	}
+	if (ss.ss_family == AF_INET6)
+		((struct sockaddr_in6 *) &ss)->sin6_port = 0;
+	else
+		((struct sockaddr_in *) &ss)->sin_port = 0;
+	if (bind(s->pasv, (struct sockaddr *) &ss, l) == -1
+			|| listen(s->pasv, 1) == -1
+			|| getsockname(s->pasv, (struct sockaddr *) &ss, &l) == -1) {
+		close(s->pasv);
+		s->pasv = -1;
+		reply(s, "425 Can't open passive connection");
+		return;
+	}
+	reply(s, "229 Entering Extended Passive Mode (|||%u|)",
+		ntohs(ss.ss_family == AF_INET6 ?
+			((struct sockaddr_in6 *) &ss)->sin6_port :
+			((struct sockaddr_in *) &ss)->sin_port));
+}
+
+/*
+ * cmdEprt - active data connection to |1|a.b.c.d|port| or |2|ipv6|port|
+ */
+static void cmdEprt(FtpdSession_t *s, const char *arg)
+{
+	char host[INET6_ADDRSTRLEN];
+	unsigned int af, port;
+	memset(&s->port, 0, sizeof(s->port));
+	if (arg == NULL || sscanf(arg, "|%u|%45[^|]|%u|", &af, host, &port) != 3
+			|| port == 0 || port > 65535) {
+		reply(s, "501 Illegal EPRT command");
+		return;
+	}
+	struct sockaddr_in *in = (struct sockaddr_in *) &s->port;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &s->port;
+	if (af == 1 && inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		s->portlen = sizeof(*in);
+	}
+	else if (af == 2 && inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		s->portlen = sizeof(*in6);
+	}
+	else {
+		reply(s, "522 Network protocol not supported, use (1,2)");
+		return;
+	}
+	s->hasport = 1;
+	reply(s, "200 EPRT command successful");
+}
+
+static void cmdPort(FtpdSession_t *s, const char *arg)
+{
+	unsigned int v[6];
+	if (arg == NULL || sscanf(arg, "%u,%u,%u,%u,%u,%u",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6) {
+		reply(s, "501 Illegal PORT command");
+		return;
+	}
+	struct sockaddr_in *in = (struct sockaddr_in *) &s->port;
+	memset(&s->port, 0, sizeof(s->port));
+	in->sin_family = AF_INET;
+	in->sin_addr.s_addr =
+		htonl((v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3]);
+	in->sin_port = htons((v[4] << 8) | v[5]);
+	s->portlen = sizeof(*in);
+	s->hasport = 1;
+	reply(s, "200 PORT command successful");
+}
+
+/*
+ * session - serve one control connection until QUIT or disconnect
+ */
+static void *session(void *arg)
+{
+	FtpdSession_t *s = arg;
+	char line[FTPD_LINE_SIZE];
+	char path[PATH_MAX];
+	struct stat st;
+
+	reply(s, "220 ftpd_stub ready");
+	while (readCommand(s, line, sizeof(line)) >= 0) {
+		char *a = strchr(line, ' ');
+		if (a != NULL)
+			*a++ = '\0';
+		for (char *c = line; *c; c++)
+			if (*c >= 'a' && *c <= 'z')
+				*c -= 'a' - 'A';
+
+		if (strcmp(line, "USER") == 0)
+			reply(s, "331 Please specify the password");
+		else if (strcmp(line, "PASS") == 0)
+			reply(s, "230 Login successful");
+		else if (strcmp(line, "SYST") == 0)
+			reply(s, "215 UNIX Type: L8");
+		else if (strcmp(line, "FEAT") == 0)
+			reply(s, "211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n"
+				" EPSV\r\n MLST type*;size*;modify*;\r\n%s211 End",
+				FTPD_ZLIB ? " MODE Z\r\n" : "");
+		else if (strcmp(line, "NOOP") == 0)
+			reply(s, "200 NOOP ok");
+		else if (strcmp(line, "SITE") == 0)
+			reply(s, "200 SITE ok");
+		else if (strcmp(line, "TYPE") == 0) {
+			if (a != NULL && (*a == 'A' || *a == 'I')) {
+				s->type = *a;
+				reply(s, "200 Switching to %s mode",
+					s->type == 'A' ? "ASCII" : "Binary");
+			}
+			else
+				reply(s, "504 Bad TYPE command");
+		}
+		else if (strcmp(line, "MODE") == 0) {
+			if (a != NULL && (*a == 'S' || *a == 's')) {
+				s->modez = 0;
+				reply(s, "200 Mode set to S");
+			}
+			else if (FTPD_ZLIB && a != NULL && (*a == 'Z' || *a == 'z')) {
+				s->modez = FTPD_MODEZ_LEVEL;
+				reply(s, "200 Mode set to Z");
+			}
+			else
+				reply(s, "504 Bad MODE command");
+		}
+		else if (strcmp(line, "OPTS") == 0) {
+			int level;
+			if (a != NULL && sscanf(a, "MODE Z LEVEL %d", &level) == 1
+					&& s->modez > 0 && level >= 1 && level <= 9) {
+				s->modez = level;
+				reply(s, "200 MODE Z level set to %d", level);
+			}
+			else
+				reply(s, "501 Bad OPTS command");
+		}
+		else if (strcmp(line, "PASV") == 0)
+			cmdPasv(s);
+		else if (strcmp(line, "PORT") == 0)
+			cmdPort(s, a);
+		else if (strcmp(line, "EPSV") == 0)
+			cmdEpsv(s);
+		else if (strcmp(line, "EPRT") == 0)
+			cmdEprt(s, a);
+		else if (strcmp(line, "REST") == 0) {
+			s->rest = a != NULL ? strtoll(a, NULL, 10) : 0;
+			reply(s, "350 Restart position accepted (%lld)", s->rest);
+		}
+		else if (strcmp(line, "RETR") == 0)
+			cmdRetr(s, a);
+		else if (strcmp(line, "STOR") == 0)
+			cmdStor(s, a, 0);
+		else if (strcmp(line, "APPE") == 0)
+			cmdStor(s, a, 1);
+		else if (strcmp(line, "LIST") == 0)
+			cmdList(s, a, 0);
+		else if (strcmp(line, "NLST") == 0)
+			cmdList(s, a, 1);
+		else if (strcmp(line, "MLSD") == 0)
+			cmdList(s, a, 2);
+		else if (strcmp(line, "SIZE") == 0) {
+			realPath(s, a, path, sizeof(path));
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+				reply(s, "213 %lld", (long long) st.st_size);
+			else
+				reply(s, "550 Could not get file size");
+		}
+		else if (strcmp(line, "MDTM") == 0) {
+			realPath(s, a, path, sizeof(path));
+			if (stat(path, &st) == 0) {
+				struct tm tm;
+				char date[32];
+				gmtime_r(&st.st_mtime, &tm);
+				strftime(date, sizeof(date), "%Y%m%d%H%M%S", &tm);
+				reply(s, "213 %s", date);
+			}
+			else
+				reply(s, "550 Could not get modification time");
+		}
+		else if (strcmp(line, "PWD") == 0)
+			reply(s, "257 \"%s\" is the current directory", s->cwd);
+		else if (strcmp(line, "CWD") == 0 || strcmp(line, "CDUP") == 0) {
+			char v[PATH_MAX];
+			virtualPath(s, line[1] == 'D' ? ".." : a, v, sizeof(v));
+			int n = snprintf(path, sizeof(path), "%s%s", s->root, v);
+			if (n >= 0 && (size_t) n < sizeof(path)
+					&& stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+				strcpy(s->cwd, v);
+				reply(s, "250 Directory successfully changed");
+			}
+			else
+				reply(s, "550 Failed to change directory");
+		}
+		else if (strcmp(line, "MKD") == 0) {
+			realPath(s, a, path, sizeof(path));
+			if (mkdir(path, 0755) == 0)
+				reply(s, "257 \"%s\" created", a);
+			else
+				reply(s, "550 Create directory operation failed");
+		}
+		else if (strcmp(line, "RMD") == 0) {
+			realPath(s, a, path, sizeof(path));
+			if (rmdir(path) == 0)
+				reply(s, "250 Remove directory operation successful");
+			else
+				reply(s, "550 Remove directory operation failed");
+		}
+		else if (strcmp(line, "DELE") == 0) {
+			realPath(s, a, path, sizeof(path));
+			if (unlink(path) == 0)
+				reply(s, "250 Delete operation successful");
+			else
+				reply(s, "550 Delete operation failed");
+		}
+		else if (strcmp(line, "RNFR") == 0) {
+			realPath(s, a, s->rnfr, sizeof(s->rnfr));
+			if (stat(s->rnfr, &st) == 0)
+				reply(s, "350 Ready for RNTO");
+			else {
+				s->rnfr[0] = '\0';
+				reply(s, "550 RNFR command failed");
+			}
+		}
+		else if (strcmp(line, "RNTO") == 0) {
+			realPath(s, a, path, sizeof(path));
+			if (s->rnfr[0] != '\0' && rename(s->rnfr, path) == 0)
+				reply(s, "250 Rename successful");
+			else
+				reply(s, "550 Rename failed");
+			s->rnfr[0] = '\0';
+		}
+		else if (strcmp(line, "QUIT") == 0) {
+			reply(s, "221 Goodbye");
+			break;
+		}
+		else
+			reply(s, "502 Command not implemented");
+	}
+	if (s->pasv >= 0)
+		close(s->pasv);
+	close(s->handle);
+	free(s);
+	return NULL;
+}
+
+static void *acceptLoop(void *arg)
+{
+	FtpdStub_t *srv = arg;
+	for (;;) {
+		int c = accept(srv->handle, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		FtpdSession_t *s = calloc(1, sizeof(FtpdSession_t));
+		if (s == NULL) {
+			close(c);
+			continue;
+		}
+		/* replies are tiny writes, don't let Nagle hold them back */
+		int on = 1;
+		setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		s->handle = c;
+		s->latency = srv->latency;
+		s->pasv = -1;
+		s->type = 'A';
+		strcpy(s->cwd, "/");
+		strcpy(s->root, srv->root);
+		pthread_t t;
+		if (pthread_create(&t, NULL, session, s) != 0) {
+			close(c);
+			free(s);
+			continue;
+		}
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+FtpdStub_t *ftpd_stub_start(const char *root)
+{
+	FtpdStub_t *srv = calloc(1, sizeof(FtpdStub_t));
+	if (srv == NULL)
+		return NULL;
+	if (realpath(root, srv->root) == NULL) {
+		free(srv);
+		return NULL;
+	}
+	srv->handle = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t l = sizeof(sin);
+	int on = 1;
+	setsockopt(srv->handle, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (srv->handle < 0 || bind(srv->handle, (struct sockaddr *) &sin, l) == -1
+			|| listen(srv->handle, 16) == -1
+			|| getsockname(srv->handle, (struct sockaddr *) &sin, &l) == -1) {
+		if (srv->handle >= 0)
+			close(srv->handle);
+		free(srv);
+		return NULL;
+	}
+	srv->port = ntohs(sin.sin_port);
+	if (pthread_create(&srv->thread, NULL, acceptLoop, srv) != 0) {
+		close(srv->handle);
+		free(srv);
+		return NULL;
+	}
+	return srv;
+}
+
+uint16_t ftpd_stub_port(const FtpdStub_t *srv)
+{
+	return srv->port;
+}
+
+void ftpd_stub_set_latency(FtpdStub_t *srv, unsigned int ms)
+{
+	srv->latency = ms;
+}
+
+void ftpd_stub_stop(FtpdStub_t *srv)
+{
+	shutdown(srv->handle, SHUT_RDWR);
+	close(srv->handle);
+	pthread_join(srv->thread, NULL);
+	free(srv);
+}
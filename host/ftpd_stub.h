@@ -0,0 +1,56 @@
+/**
+ * @file
+ * @brief Loopback FTP server stand-in for the host build
+ *
+ * A small, directory backed FTP server that runs inside the benchmark
+ * process.  It only implements what ftplib needs (USER, PASS, SYST, TYPE,
+ * PASV, PORT, EPSV, EPRT, REST, RETR, STOR, APPE, LIST, NLST, MLSD, SIZE,
+ * MDTM, CWD, CDUP, PWD, MKD, RMD, DELE, RNFR, RNTO, FEAT, NOOP, QUIT, and
+ * MODE and OPTS MODE Z when built with zlib) and accepts any credentials.
+ * Every control connection is served by its own thread.
+ */
+
+#ifndef FTPD_STUB_H_
+#define FTPD_STUB_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FtpdStub FtpdStub_t;
+
+/*
+ * ftpd_stub_start - serve the directory root on 127.0.0.1
+ *
+ * The listening port is chosen by the kernel, see ftpd_stub_port().
+ * return the server handle, NULL on error
+ */
+FtpdStub_t *ftpd_stub_start(const char *root);
+
+/*
+ * ftpd_stub_port - port the server is listening on
+ */
+uint16_t ftpd_stub_port(const FtpdStub_t *srv);
+
+/*
+ * ftpd_stub_set_latency - emulate a control channel round trip time
+ *
+ * Commands received on connections accepted afterwards are answered ms
+ * milliseconds late, once per received segment.
+ */
+void ftpd_stub_set_latency(FtpdStub_t *srv, unsigned int ms);
+
+/*
+ * ftpd_stub_stop - stop accepting connections and release the server
+ *
+ * Sessions still open keep running until their client disconnects.
+ */
+void ftpd_stub_stop(FtpdStub_t *srv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTPD_STUB_H_ */
@@ -0,0 +1,19 @@
+/*
+ * Minimal stand-in for ESP-IDF's esp_log.h used by the host build.
+ *
+ * Errors and warnings go to stderr, everything else is compiled out so the
+ * benchmarks are not skewed by logging.
+ */
+
+#ifndef HOST_ESP_LOG_H_
+#define HOST_ESP_LOG_H_
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E (%s) " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W (%s) " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) do { (void)(tag); } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { (void)(tag); } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { (void)(tag); } while (0)
+
+#endif /* HOST_ESP_LOG_H_ */
@@ -2,6 +2,9 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include "freertos/idf_additions.h"
+#include "ftp_ota.h"
+#include "ftp_pool.h"
+#include "ftp_sync.h"
 #include "ftplib.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +15,18 @@
 #define FTP_SERVER_PORT CONFIG_FTP_SERVER_PORT
 #define FTP_USER CONFIG_FTP_SERVER_USER
 #define FTP_PASSWORD CONFIG_FTP_SERVER_PASSWORD
+#define FTP_STORAGE_BASE_PATH CONFIG_FTP_STORAGE_BASE_PATH
+#define FTP_SYNC_LOCAL_DIR CONFIG_FTP_SYNC_LOCAL_DIR
+#define FTP_SYNC_REMOTE_DIR CONFIG_FTP_SYNC_REMOTE_DIR
+#define FTP_SYNC_INDEX CONFIG_FTP_SYNC_INDEX
+#ifdef CONFIG_FTP_SYNC_VERIFY_REMOTE
+#define FTP_SYNC_VERIFY_REMOTE true
+#else
+#define FTP_SYNC_VERIFY_REMOTE false
+#endif
+#define FTP_OTA_PATH CONFIG_FTP_OTA_PATH
+#define FTP_OTA_SHA256 CONFIG_FTP_OTA_SHA256
+#define FTP_OTA_RETRIES CONFIG_FTP_OTA_RETRIES
 // Menuconfig ----------------------------
 
 #define FTP_SUCCESS BIT0
@@ -19,26 +34,13 @@
 
 static const char *FTP_TAG = "FTP";
 static NetBuf_t *ftp_connection = NULL;
+static ftp_pool_t *ftp_pool = NULL;
 
 void error(char *message) {
   ESP_LOGE(FTP_TAG, "%s: %s", message, FtpGetLastResponse(ftp_connection));
 }
 
-esp_err_t connect_ftp_server(void) {
-  // Connect to FTP server
-  if (!FtpConnect(FTP_SERVER_IP, FTP_SERVER_PORT, &ftp_connection)) {
-    error("Connection failed");
-    return FTP_FAILURE;
-  }
-  ESP_LOGI(FTP_TAG, "Connected to FTP: %s", FtpGetLastResponse(ftp_connection));
-
-  // Login to FTP server
-  if (!FtpLogin(FTP_USER, FTP_PASSWORD, ftp_connection)) {
-    error("Login failed");
-    return FTP_FAILURE;
-  }
-  ESP_LOGI(FTP_TAG, "Logged in to FTP: %s", FtpGetLastResponse(ftp_connection));
-
+static esp_err_t run_ftp_session(void) {
   // ls
   ESP_LOGI(FTP_TAG, "Listing remote directory:");
   if (!FtpDir(NULL, ".", ftp_connection)) {
@@ -54,15 +56,16 @@ esp_err_t connect_ftp_server(void) {
 
   // Put the file in spiffs to the remote server
   ESP_LOGI(FTP_TAG, "Putting file (text.txt) to remote server (./text.txt)");
-  if (!FtpPut("/storage/text.txt", "text.txt", FTPLIB_ASCII, ftp_connection)) {
+  if (!FtpPut(FTP_STORAGE_BASE_PATH "/text.txt", "text.txt", FTPLIB_ASCII,
+              ftp_connection)) {
     error("Failed to put \"text.txt\" to remote server \"./text.txt\"");
     return FTP_FAILURE;
   }
 
   ESP_LOGI(FTP_TAG,
            "Putting file (text.txt) to remote server (./testDir/textDir.txt)");
-  if (!FtpPut("/storage/text.txt", "testDir/textDir.txt", FTPLIB_ASCII,
-              ftp_connection)) {
+  if (!FtpPut(FTP_STORAGE_BASE_PATH "/text.txt", "testDir/textDir.txt",
+              FTPLIB_ASCII, ftp_connection)) {
     error("Failed to put \"text.txt\" to remote server \"./testDir/text.txt\"");
     return FTP_FAILURE;
   }
@@ -172,14 +175,14 @@ esp_err_t connect_ftp_server(void) {
 
   // Get file and check contents
   ESP_LOGI(FTP_TAG, "Getting file (renamed.txt)");
-  if (!FtpGet("/storage/remoteGet.txt", "renamed.txt", FTPLIB_ASCII,
-              ftp_connection)) {
+  if (!FtpGet(FTP_STORAGE_BASE_PATH "/remoteGet.txt", "renamed.txt",
+              FTPLIB_ASCII, ftp_connection)) {
     error("Failed to get file");
     return FTP_FAILURE;
   }
 
-  // Compare the contents of "/storage/remoteGet.txt" with "Hello World\n"
-  FILE *fd = fopen("/storage/remoteGet.txt", "r");
+  // Compare the contents of "remoteGet.txt" with "Hello World\n"
+  FILE *fd = fopen(FTP_STORAGE_BASE_PATH "/remoteGet.txt", "r");
   if (fd == NULL) {
     ESP_LOGE(FTP_TAG, "Failed to open file");
     return FTP_FAILURE;
@@ -203,8 +206,115 @@ esp_err_t connect_ftp_server(void) {
     error("Failed to delete file");
   }
 
-  // Close FTP connection
-  FtpQuit(ftp_connection);
+  return FTP_SUCCESS;
+}
+
+esp_err_t connect_ftp_server(void) {
+  // The pool keeps the session logged in between calls, only the first call
+  // pays for connect and login
+  if (ftp_pool == NULL) {
+    ftp_pool_config_t config = {
+        .host = FTP_SERVER_IP,
+        .port = FTP_SERVER_PORT,
+        .user = FTP_USER,
+        .password = FTP_PASSWORD,
+    };
+    if (ftp_pool_create(&config, &ftp_pool) != ESP_OK) {
+      ESP_LOGE(FTP_TAG, "Failed to create the session pool");
+      return FTP_FAILURE;
+    }
+  }
+
+  if (ftp_pool_acquire(ftp_pool, &ftp_connection, portMAX_DELAY) != ESP_OK) {
+    ESP_LOGE(FTP_TAG, "Connection failed");
+    return FTP_FAILURE;
+  }
+  ESP_LOGI(FTP_TAG, "Session ready: %s", FtpGetLastResponse(ftp_connection));
+
+  // A session left mid-transfer by a failure is not reused
+  esp_err_t status = run_ftp_session();
+  ftp_pool_release(ftp_pool, ftp_connection, status == FTP_SUCCESS);
+  ftp_connection = NULL;
 
+  return status;
+}
+
+// Upload what changed in the local directory since the last call, needs a
+// pool created by connect_ftp_server()
+esp_err_t sync_ftp_server(void) {
+  NetBuf_t *conn = NULL;
+  if (ftp_pool == NULL ||
+      ftp_pool_acquire(ftp_pool, &conn, portMAX_DELAY) != ESP_OK) {
+    ESP_LOGE(FTP_TAG, "Connection failed");
+    return FTP_FAILURE;
+  }
+
+  // Both paths are relative to the mount point
+  char local_dir[128], index_path[128];
+  snprintf(local_dir, sizeof(local_dir), "%s%s%s", FTP_STORAGE_BASE_PATH,
+           FTP_SYNC_LOCAL_DIR[0] != '\0' ? "/" : "", FTP_SYNC_LOCAL_DIR);
+  snprintf(index_path, sizeof(index_path), "%s/%s", FTP_STORAGE_BASE_PATH,
+           FTP_SYNC_INDEX);
+
+  ftp_sync_config_t config = {
+      .local_dir = local_dir,
+      .remote_dir = FTP_SYNC_REMOTE_DIR,
+      .index = index_path,
+      .verify_remote = FTP_SYNC_VERIFY_REMOTE,
+  };
+  ftp_sync_stats_t stats;
+  esp_err_t err = ftp_sync_run(conn, &config, &stats);
+
+  // A failed upload closes its data connection, the session stays usable
+  ftp_pool_release(ftp_pool, conn, true);
+  if (err != ESP_OK) {
+    ESP_LOGE(FTP_TAG, "Sync failed: %s", esp_err_to_name(err));
+    return FTP_FAILURE;
+  }
+  return FTP_SUCCESS;
+}
+
+// The session broke mid-download, the pool drops it and hands out another
+static NetBuf_t *ota_reconnect(NetBuf_t *dead, void *arg) {
+  ftp_pool_release(ftp_pool, dead, false);
+  NetBuf_t *conn = NULL;
+  if (ftp_pool_acquire(ftp_pool, &conn, portMAX_DELAY) != ESP_OK)
+    return NULL;
+  return conn;
+}
+
+// Write the firmware image on the server to the next OTA slot and make it
+// the boot partition, unless it is the version already running. Needs a
+// pool created by connect_ftp_server()
+esp_err_t update_ftp_firmware(void) {
+  NetBuf_t *conn = NULL;
+  if (ftp_pool == NULL ||
+      ftp_pool_acquire(ftp_pool, &conn, portMAX_DELAY) != ESP_OK) {
+    ESP_LOGE(FTP_TAG, "Connection failed");
+    return FTP_FAILURE;
+  }
+
+  ftp_ota_config_t config = {
+      .path = FTP_OTA_PATH,
+      .sha256 = FTP_OTA_SHA256[0] != '\0' ? FTP_OTA_SHA256 : NULL,
+      .retries = FTP_OTA_RETRIES,
+      .reconnect = ota_reconnect,
+      .set_boot = true,
+      .skip_running = true,
+  };
+  ftp_ota_stats_t stats;
+  esp_err_t err = ftp_ota_run(&conn, &config, &stats);
+
+  // Only a transfer that broke for good leaves the session in doubt
+  if (conn != NULL)
+    ftp_pool_release(ftp_pool, conn, err != ESP_FAIL);
+  if (err == ESP_ERR_INVALID_VERSION) {
+    ESP_LOGI(FTP_TAG, "Firmware is up to date");
+    return FTP_FAILURE;
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(FTP_TAG, "Firmware update failed: %s", esp_err_to_name(err));
+    return FTP_FAILURE;
+  }
   return FTP_SUCCESS;
 }
@@ -1,38 +1,30 @@
 #include "esp_err.h"
+#include "esp_system.h"
 #include "ftp.c"
+#include "ftp_storage.h"
 #include "nvs_flash.h"
 #include "wifi.c"
 #include <esp_log.h>
-#include <esp_spiffs.h>
 #include <stdio.h>
 
 static const char *FS_TAG = "Filesystem setup";
 
-esp_err_t init_spiffs(char *mount_point, char *partition_label) {
-  esp_vfs_spiffs_conf_t spiffs_conf = {
-      .base_path = mount_point,
-      .partition_label = partition_label,
-      .max_files = 1,
-      .format_if_mount_failed = true,
-  };
-
-  esp_err_t result = esp_vfs_spiffs_register(&spiffs_conf);
+// Mounts the filesystem chosen in menuconfig on its partition
+esp_err_t init_storage(void) {
+  esp_err_t result = ftp_storage_mount();
   if (result != ESP_OK) {
-    ESP_LOGE(FS_TAG, "Failed to initialize SPIFFS: %s",
+    ESP_LOGE(FS_TAG, "Failed to initialize storage: %s",
              esp_err_to_name(result));
     return result;
   }
 
-  // Free space calculation
-  size_t total = 0, used = 0;
-  result = esp_spiffs_info(spiffs_conf.partition_label, &total, &used);
-  if (result != ESP_OK) {
-    ESP_LOGE(FS_TAG, "Failed to obtain partition info: %s",
-             esp_err_to_name(result));
-    return result;
-  } else {
-    ESP_LOGI(FS_TAG, "Partition size: total: %d, used %d", total, used);
-  }
+#ifdef CONFIG_FTP_STORAGE_BENCH
+  // Fill levels are relative to the space still free
+  uint64_t total = 0, used = 0;
+  if (ftp_storage_info(&total, &used) == ESP_OK)
+    ftp_storage_bench(CONFIG_FTP_STORAGE_BASE_PATH, 64 * 1024,
+                      (long)(total - used));
+#endif
 
   return result;
 }
@@ -56,12 +48,12 @@ void app_main(void) {
     return;
   }
 
-  // SPIFFS Filesystem setup
-  if (init_spiffs("/storage", NULL) != ESP_OK)
+  // Filesystem setup
+  if (init_storage() != ESP_OK)
     return;
 
   // Read a file from the storage
-  FILE *fd = fopen("/storage/text.txt", "r");
+  FILE *fd = fopen(CONFIG_FTP_STORAGE_BASE_PATH "/text.txt", "r");
   if (fd == NULL) {
     ESP_LOGE(FS_TAG, "Failed to open file");
     return;
@@ -78,4 +70,16 @@ void app_main(void) {
     ESP_LOGE(FTP_TAG, "Error occured in FTP Client, dying...");
     return;
   }
+
+#ifdef CONFIG_FTP_SYNC_ON_BOOT
+  // Only the files changed since the last boot are uploaded
+  sync_ftp_server();
+#endif
+
+#ifdef CONFIG_FTP_OTA_ON_BOOT
+  if (update_ftp_firmware() == FTP_SUCCESS) {
+    ESP_LOGI(FTP_TAG, "Restarting into the new firmware");
+    esp_restart();
+  }
+#endif
 }